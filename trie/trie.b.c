@@ -0,0 +1,507 @@
+// Benchmarks of the trie with reproducible workloads.
+//
+// usage: trie.b.tsk [-n ntargets] [-s seed] [-f flags] [-z] [-j maxthreads] [workload]...
+//
+// Each workload is a set of keys, which resemble the rules of a makefile, and
+// a set of targets to look up. The keys and the targets are generated from
+// SEED, so that two runs with the same arguments push and look up the same
+// keys in the same order. The workloads are
+// make: %.ext rules for 1000 extensions, obj/dir/%.o rules for 64 dirs and an
+//     explicit rule for every 4th target of a build tree.
+// deep: an explicit rule for each target of a deep source tree, whose paths
+//     share long runs of chars, and two pattern rules.
+// escaped: pattern rules for dirs, whose names have an escaped %, and explicit
+//     rules with escaped % for every 4th target.
+// manymatch: every pattern, which matches a common target template, so that
+//     each target matches 184 patterns.
+// Without workload arguments all workloads run.
+//
+// Each workload runs with each set of FLAGS of trie_init, or with FLAGS
+// only, if -f is specified. trie_push is timed for each key and trie_find_all,
+// trie_find and trie_has are timed for each target. The latencies include the
+// cost of reading the clock, which is some tens of ns.
+// trie_prefix_iter is timed for the dir of each target, i.e. the target up to
+// the last / with each % escaped, listing up to 16 keys, as a completion
+// would, as op prefix_k16, and listing all keys as op prefix_all.
+// With -z the trie is frozen with trie_freeze after all keys were pushed and
+// the targets are looked up in the frozen trie.
+// With -j the trie is also built with trie_build_parallel on 1, 2, 4 and so
+// on up to MAXTHREADS threads, and each build is reported as op build_jN of
+// N threads, whose n is the number of keys and whose latencies are the time
+// of the build per key.
+//
+// The output is a header line followed by one line of tab separated fields
+// for each workload, flags and operation
+// workload flags op n total_ns ops_per_s p50_ns p90_ns p99_ns max_ns bytes bytes_per_key misses_per_op
+// bytes is trie_memory after all keys were pushed, or after the trie was
+// frozen. misses_per_op is the number of the cache misses of the cpu, which
+// the operations caused, divided by n, or -1 if the kernel does not let the
+// process count them.
+// Return 1 if a lookup found an unexpected number of matches, 0 otherwise.
+#include "trie.h"
+#include <assert.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+static const int flag_sets[] = {0, trie_engine_nfa, trie_suffix_index,
+                                trie_engine_nfa | trie_suffix_index,
+                                trie_lookup_cache};
+
+struct workload {
+    char **keys; /* The keys to push in this order. */
+    int nkeys;
+    char **targets; /* The targets to look up. */
+    int ntargets;
+    long nmatches; /* The number of matches of all targets. */
+};
+
+// The counter of the cache misses of this process or -1.
+static int misses_fd = -1;
+
+static
+void misses_open (void)
+{
+    struct perf_event_attr attr;
+
+    memset (&attr, 0, sizeof attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof attr;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    misses_fd = syscall (SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static
+void misses_start (void)
+{
+    if (misses_fd < 0)
+        return;
+    ioctl (misses_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl (misses_fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+// Return the cache misses since misses_start or -1.
+static
+long long misses_stop (void)
+{
+    long long n;
+
+    if (misses_fd < 0)
+        return -1;
+    ioctl (misses_fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read (misses_fd, &n, sizeof n) != sizeof n)
+        return -1;
+    return n;
+}
+
+static
+uint64_t now_ns (void)
+{
+    struct timespec ts;
+    int rc;
+    rc = clock_gettime (CLOCK_MONOTONIC, &ts);
+    assert (rc == 0);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Append the string formatted from FMT to the array STRS of *N strings.
+static
+void append (char ***strs, int *n, const char *fmt, ...)
+{
+    char buf[512];
+    va_list ap;
+    int rc;
+
+    va_start (ap, fmt);
+    rc = vsnprintf (buf, sizeof buf, fmt, ap);
+    va_end (ap);
+    assert (rc >= 0 && rc < (int) sizeof buf);
+    // Double the array when *n reaches a power of 2.
+    if ((*n & (*n - 1)) == 0) {
+        *strs = realloc (*strs, (*n ? 2 * *n : 1) * sizeof **strs);
+        assert (*strs);
+    }
+    (*strs)[*n] = strdup (buf);
+    assert ((*strs)[*n]);
+    ++*n;
+}
+
+static
+void gen_make (struct workload *w, int n, unsigned seed)
+{
+    for (int e = 0; e < 1000; ++e)
+        append (&w->keys, &w->nkeys, "%%.x%d", e);
+    for (int d = 0; d < 64; ++d)
+        append (&w->keys, &w->nkeys, "obj/dir%d/%%.o", d);
+    append (&w->keys, &w->nkeys, "%%.o");
+    append (&w->keys, &w->nkeys, "obj/%%");
+    for (int k = 0; k < n; ++k) {
+        int d = rand_r (&seed) % 64, s = rand_r (&seed) % 16;
+        append (&w->targets, &w->ntargets, "obj/dir%d/sub%d/file%d.o", d, s, k);
+        // A target matches %.o, obj/dir/%.o, obj/% and its explicit rule.
+        w->nmatches += 3;
+        if (k % 4)
+            continue;
+        append (&w->keys, &w->nkeys, "%s", w->targets[k]);
+        ++w->nmatches;
+    }
+}
+
+static
+void gen_deep (struct workload *w, int n, unsigned seed)
+{
+    for (int k = 0; k < n; ++k) {
+        int m = rand_r (&seed) % 97, s = rand_r (&seed) % 13;
+        append (&w->targets, &w->ntargets,
+                "src/components/module%d/implementation/subdir%d/file%d.c",
+                m, s, k);
+        append (&w->keys, &w->nkeys, "%s", w->targets[k]);
+    }
+    append (&w->keys, &w->nkeys, "%%.c");
+    append (&w->keys, &w->nkeys, "src/components/%%.c");
+    w->nmatches = 3L * n;
+}
+
+static
+void gen_escaped (struct workload *w, int n, unsigned seed)
+{
+    for (int d = 0; d < 64; ++d)
+        append (&w->keys, &w->nkeys, "gen/\\%%%d/%%.h", d);
+    append (&w->keys, &w->nkeys, "%%.h");
+    append (&w->keys, &w->nkeys, "gen/%%");
+    for (int k = 0; k < n; ++k) {
+        int d = rand_r (&seed) % 64;
+        append (&w->targets, &w->ntargets, "gen/%%%d/file%d.h", d, k);
+        // A target matches gen/\%d/%.h, %.h, gen/% and its explicit rule.
+        w->nmatches += 3;
+        if (k % 4)
+            continue;
+        append (&w->keys, &w->nkeys, "gen/\\%%%d/file%d.h", d, k);
+        ++w->nmatches;
+    }
+}
+
+static
+void gen_manymatch (struct workload *w, int n, unsigned seed)
+{
+    const char dir[] = "src/module/subdir/file", ext[] = "_name.o";
+    const int dlen = sizeof dir - 1, elen = sizeof ext - 1;
+
+    // Push every pattern, which is a prefix of dir followed by % followed by
+    // a suffix of ext.
+    for (int p = 0; p <= dlen; ++p)
+        for (int s = 0; s <= elen; ++s)
+            append (&w->keys, &w->nkeys, "%.*s%%%s", p, dir, ext + elen - s);
+    // A target matches hundreds of patterns, so look up fewer targets.
+    n = n / 16 + 1;
+    for (int k = 0; k < n; ++k)
+        append (&w->targets, &w->ntargets, "%s%u%s", dir, rand_r (&seed), ext);
+    w->nmatches = (long) w->nkeys * n;
+}
+
+static const struct {
+    const char *name;
+    void (*gen) (struct workload *w, int n, unsigned seed);
+} workloads[] = {
+    {"make", gen_make},
+    {"deep", gen_deep},
+    {"escaped", gen_escaped},
+    {"manymatch", gen_manymatch},
+};
+enum {nworkloads = sizeof workloads / sizeof *workloads};
+
+static
+int cmp_u64 (const void *x, const void *y)
+{
+    uint64_t a = *(const uint64_t *) x, b = *(const uint64_t *) y;
+    return (a > b) - (a < b);
+}
+
+// Print the line of OP, which took TOTAL ns and caused MISSES cache misses,
+// from the N latencies LAT. Sort LAT.
+static
+void report (const char *workload, int flags, const char *op, uint64_t *lat,
+             int n, uint64_t total, size_t bytes, int nkeys, long long misses)
+{
+    assert (n > 0);
+    qsort (lat, n, sizeof *lat, cmp_u64);
+    printf ("%s\t%d\t%s\t%d\t%llu\t%.0f\t%llu\t%llu\t%llu\t%llu\t%zu\t%zu\t%.2f\n",
+            workload, flags, op, n, (unsigned long long) total,
+            total ? n * 1e9 / total : 0,
+            (unsigned long long) lat[(n - 1) / 2],
+            (unsigned long long) lat[(long) (n - 1) * 90 / 100],
+            (unsigned long long) lat[(long) (n - 1) * 99 / 100],
+            (unsigned long long) lat[n - 1],
+            bytes, nkeys ? bytes / nkeys : 0, misses < 0 ? -1.0 : (double) misses / n);
+    fflush (stdout);
+}
+
+// Run workload W with FLAGS. Look up the targets in the order of ORDER.
+// Freeze the trie before the lookups, if FREEZE is nonzero.
+// Return the number of operations, which found an unexpected number of matches.
+static
+int run (const char *name, const struct workload *w, int flags, const int *order, int freeze)
+{
+    const int nlat = w->nkeys > w->ntargets ? w->nkeys : w->ntargets;
+    uint64_t *lat = malloc (nlat * sizeof *lat);
+    uint64_t start, stop, t;
+    const char userdata[] = "userdata";
+    long long misses;
+    long nfound;
+    int nerrors = 0;
+    size_t bytes;
+    void *trie;
+
+    assert (lat);
+    trie = trie_init (0, 0, 0, flags);
+    assert (trie);
+    misses_start ();
+    start = now_ns ();
+    for (int k = 0; k < w->nkeys; ++k) {
+        int rc;
+        t = now_ns ();
+        rc = trie_push (trie, w->keys[k], userdata);
+        lat[k] = now_ns () - t;
+        assert (rc == 0);
+    }
+    stop = now_ns ();
+    misses = misses_stop ();
+    bytes = trie_memory (trie);
+    report (name, flags, "push", lat, w->nkeys, stop - start, bytes, w->nkeys, misses);
+
+    if (freeze) {
+        int rc;
+        misses_start ();
+        start = now_ns ();
+        rc = trie_freeze (trie);
+        stop = now_ns ();
+        misses = misses_stop ();
+        assert (rc == 0);
+        lat[0] = stop - start;
+        bytes = trie_memory (trie);
+        report (name, flags, "freeze", lat, 1, stop - start, bytes, w->nkeys, misses);
+    }
+
+    nfound = 0;
+    misses_start ();
+    start = now_ns ();
+    for (int k = 0; k < w->ntargets; ++k) {
+        const struct result **r;
+        t = now_ns ();
+        r = trie_find_all (trie, w->targets[order[k]]);
+        lat[k] = now_ns () - t;
+        for (; *r; ++r)
+            ++nfound;
+    }
+    stop = now_ns ();
+    misses = misses_stop ();
+    report (name, flags, "find_all", lat, w->ntargets, stop - start, bytes, w->nkeys, misses);
+    if (nfound != w->nmatches) {
+        fprintf (stderr, "%s, flags %d: trie_find_all found %ld matches, expected %ld\n",
+                 name, flags, nfound, w->nmatches);
+        ++nerrors;
+    }
+
+    nfound = 0;
+    misses_start ();
+    start = now_ns ();
+    for (int k = 0; k < w->ntargets; ++k) {
+        const struct result *r;
+        t = now_ns ();
+        r = trie_find (trie, w->targets[order[k]]);
+        lat[k] = now_ns () - t;
+        nfound += r != 0;
+    }
+    stop = now_ns ();
+    misses = misses_stop ();
+    report (name, flags, "find", lat, w->ntargets, stop - start, bytes, w->nkeys, misses);
+
+    misses_start ();
+    start = now_ns ();
+    for (int k = 0; k < w->ntargets; ++k) {
+        t = now_ns ();
+        nfound += trie_has (trie, w->targets[order[k]], trie_prefer_auto);
+        lat[k] = now_ns () - t;
+    }
+    stop = now_ns ();
+    misses = misses_stop ();
+    report (name, flags, "has", lat, w->ntargets, stop - start, bytes, w->nkeys, misses);
+    // Every target matches, so each trie_find and trie_has found one.
+    if (nfound != 2L * w->ntargets) {
+        fprintf (stderr, "%s, flags %d: trie_find and trie_has found %ld, expected %ld\n",
+                 name, flags, nfound, 2L * w->ntargets);
+        ++nerrors;
+    }
+
+    for (int limit = 16; limit >= -1; limit -= 17) {
+        char dir[1024];
+        misses_start ();
+        start = now_ns ();
+        for (int k = 0; k < w->ntargets; ++k) {
+            const char *target = w->targets[order[k]], *slash = strrchr (target, '/');
+            size_t len = 0;
+            void *it;
+            // A target is a name, its % is not a wildcard.
+            for (const char *c = target; slash && c <= slash; ++c) {
+                if (*c == '%')
+                    dir[len++] = '\\';
+                dir[len++] = *c;
+            }
+            assert (len < sizeof dir);
+            dir[len] = '\0';
+            t = now_ns ();
+            it = trie_prefix_iter (trie, dir, limit);
+            while (trie_iter_next (it))
+                ;
+            trie_iter_end (it);
+            lat[k] = now_ns () - t;
+        }
+        stop = now_ns ();
+        misses = misses_stop ();
+        report (name, flags, limit < 0 ? "prefix_all" : "prefix_k16", lat, w->ntargets,
+                stop - start, bytes, w->nkeys, misses);
+    }
+
+    trie_free (trie);
+    free (lat);
+    return nerrors;
+}
+
+// Build the trie of workload W with FLAGS with trie_build_parallel on 1, 2, 4
+// and so on up to MAXTHREADS threads.
+static
+void run_parallel_builds (const char *name, const struct workload *w, int flags, int maxthreads)
+{
+    uint64_t *lat = malloc (w->nkeys * sizeof *lat);
+    uint64_t start, stop;
+    long long misses;
+    char op[32];
+    void *trie;
+    int rc;
+
+    assert (lat);
+    for (int j = 1;; j = 2 * j < maxthreads ? 2 * j : maxthreads) {
+        trie = trie_init (0, 0, 0, flags);
+        assert (trie);
+        misses_start ();
+        start = now_ns ();
+        rc = trie_build_parallel (trie, (const char *const *) w->keys, 0, w->nkeys, j, 0);
+        stop = now_ns ();
+        misses = misses_stop ();
+        assert (rc == w->nkeys);
+        for (int k = 0; k < w->nkeys; ++k)
+            lat[k] = (stop - start) / w->nkeys;
+        snprintf (op, sizeof op, "build_j%d", j);
+        report (name, flags, op, lat, w->nkeys, stop - start, trie_memory (trie), w->nkeys, misses);
+        trie_free (trie);
+        if (j == maxthreads)
+            break;
+    }
+    free (lat);
+}
+
+static
+void workload_free (struct workload *w)
+{
+    for (int k = 0; k < w->nkeys; ++k)
+        free (w->keys[k]);
+    for (int k = 0; k < w->ntargets; ++k)
+        free (w->targets[k]);
+    free (w->keys);
+    free (w->targets);
+}
+
+int main (int argc, char *argv[])
+{
+    int ntargets = 100000, flags = -1, freeze = 0, maxthreads = 0, status = 0, opt;
+    unsigned seed = 1;
+    int selected[nworkloads];
+
+    while ((opt = getopt (argc, argv, "n:s:f:zj:")) != -1) {
+        switch (opt) {
+        case 'n':
+            ntargets = atoi (optarg);
+            break;
+        case 's':
+            seed = strtoul (optarg, 0, 0);
+            break;
+        case 'f':
+            flags = strtol (optarg, 0, 0);
+            break;
+        case 'z':
+            freeze = 1;
+            break;
+        case 'j':
+            maxthreads = atoi (optarg);
+            break;
+        default:
+            fprintf (stderr, "usage: %s [-n ntargets] [-s seed] [-f flags] [-z] [-j maxthreads] [workload]...\n",
+                     argv[0]);
+            return 1;
+        }
+    }
+    if (ntargets < 1) {
+        fprintf (stderr, "%s: ntargets has to be positive\n", argv[0]);
+        return 1;
+    }
+    if (maxthreads < 0) {
+        fprintf (stderr, "%s: maxthreads cannot be negative\n", argv[0]);
+        return 1;
+    }
+    for (int w = 0; w < nworkloads; ++w)
+        selected[w] = optind == argc;
+    for (int a = optind; a < argc; ++a) {
+        int w;
+        for (w = 0; w < nworkloads && strcmp (argv[a], workloads[w].name); ++w)
+            ;
+        if (w == nworkloads) {
+            fprintf (stderr, "%s: unknown workload %s\n", argv[0], argv[a]);
+            return 1;
+        }
+        selected[w] = 1;
+    }
+
+    misses_open ();
+    printf ("workload\tflags\top\tn\ttotal_ns\tops_per_s\tp50_ns\tp90_ns\tp99_ns\tmax_ns\tbytes\tbytes_per_key\tmisses_per_op\n");
+    for (int w = 0; w < nworkloads; ++w) {
+        struct workload load = {0};
+        unsigned shuffle_seed = seed;
+        int *order;
+
+        if (!selected[w])
+            continue;
+        workloads[w].gen (&load, ntargets, seed);
+        // Look up the targets in a random order, so that consecutive lookups
+        // share no more than the targets of a real build do.
+        order = malloc (load.ntargets * sizeof *order);
+        assert (order);
+        for (int k = 0; k < load.ntargets; ++k)
+            order[k] = k;
+        for (int k = load.ntargets - 1; k > 0; --k) {
+            int j = rand_r (&shuffle_seed) % (k + 1), tmp = order[k];
+            order[k] = order[j];
+            order[j] = tmp;
+        }
+        for (int e = 0; e < (int) (sizeof flag_sets / sizeof *flag_sets); ++e) {
+            const int f = flags >= 0 ? flags : flag_sets[e];
+            status |= run (workloads[w].name, &load, f, order, freeze) != 0;
+            if (maxthreads > 0)
+                run_parallel_builds (workloads[w].name, &load, f, maxthreads);
+            if (flags >= 0)
+                break;
+        }
+        free (order);
+        workload_free (&load);
+    }
+    return status;
+}
@@ -3,628 +3,4452 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
-#include <stdarg.h>
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined (__x86_64__)
+#include <immintrin.h>
+#endif
 
-static int g_loglevel;
+// Tracing is compiled out when TRIE_NO_TRACE is defined, e.g. by make
+// release. Otherwise, print traces when the loglevel of the trie is nonzero.
+// print is a macro to test the loglevel inline, rather than call a variadic
+// function at every step of a lookup. The arguments are still compiled, so
+// that variables used only for tracing are not reported unused.
+#ifdef TRIE_NO_TRACE
+enum {trace_enabled = 0};
+#else
+enum {trace_enabled = 1};
+#endif
+#define print(loglevel, ...) \
+    ((void) (trace_enabled && (loglevel) ? printf (__VA_ARGS__) : 0))
 
+// The lookups count their work, when TRIE_STATS is defined, e.g. by the debug
+// build of the makefile. A lookup counts to lookup_stats of its thread, so
+// that the steps of a lookup are not slowed down by atomics, and adds the
+// counts to the trie at the end, see stats_end. Otherwise, count and
+// count_depth compile to nothing.
+#ifdef TRIE_STATS
+struct lookup_stats {
+    size_t nodes;
+    size_t backtracks;
+    size_t sorted;
+    size_t merges;
+    int depth;
+};
+static __thread struct lookup_stats lookup_stats;
+#define count(field, n) ((void) (lookup_stats.field += (n)))
+#define count_depth(d) \
+    ((void) (lookup_stats.depth < (d) ? lookup_stats.depth = (d) : 0))
+#else
+#define count(field, n) ((void) 0)
+#define count_depth(d) ((void) 0)
+#endif
+
+// Unix filenames cannot contain '\0' (slot 0) and '/' (slot 47).
+// Keys which trie accepts can contain a slash though. e.g. "obj/hello.o".
+// This leaves slot 0 for trie's internal purposes.
+// Escaped percent is stored in slot 0.
+// A key can contain any other byte, e.g. of UTF-8. The index of a byte is
+// its unsigned value.
+// In a trie, whose wildcard is another byte W, see TRIE_WILDCARD, the naked
+// and the escaped W take these indices, and a % takes the index of W. A lookup
+// swaps W and % in the key, see swapped_key, and the rest is as for %.
+enum {asciisz = 128, nindices = 256, escaped_percent = 0};
+
+// Return the index of the node of key char C.
+static
+int key_index (char c)
+{
+    return c == '%' ? escaped_percent : (unsigned char) c;
+}
+
+// A node has one of 5 kinds, depending on how many children it has.
+// A new node is a node4. node_push promotes a node to the next kind, when the
+// node runs out of child slots.
+// node4 and node16 keep the slots of their children sorted.
+// node48 maps a slot to the index of the child.
+// node128 and node256 are indexed by slot directly.
+// node48 and node128 only hold the indices of ASCII chars, which keeps them
+// small. A node, which gets a child of a byte >= 0x80 and does not fit a
+// node16, becomes a node256. The root is always a node256.
+//
+// A nodeseg is a node, whose one child is reached by a run of chars, the
+// segment, rather than by one char. node_push stores the chars of a key,
+// which no other key shares, in segments, and splits a segment where a new
+// key leaves it. A lookup compares a segment with the key at once. A segment
+// holds neither a naked nor an escaped %, so that it compares to the chars of
+// a key as is, and a naked % always has a node of its own.
+//
+// A child is referenced by its offset in the node allocator's arena rather
+// than by a pointer. The offset is measured in units of node_align bytes.
+// The root is the first node in the arena and its offset is 0. The root is
+// nobody's child. This lets offset 0 mean no child.
+// The nodes contain no pointers and the arena can be copied, saved and loaded
+// as is.
+enum {node4, node16, node48, node128, node256, nodeseg, nkinds};
+enum {node_align = 8};
+//
+// Every node keeps statistics of the keys in its subtree, which trie_has uses
+// to choose and prune its descent. nkeys is the number of keys, saturated at
+// UINT16_MAX, see node_remove_path. lastchars has bit lastchar_bit (c) set
+// for every key whose last char is c and bit any_lastchar set for every key
+// which ends with a naked %.
+// The statistics fit the padding of the header, node4 stays 32 bytes.
+struct node {
+    uint8_t kind;
+    uint8_t nchildren;
+    uint16_t nkeys;
+    int32_t result_offs; /* Index of the result, see result_at.
+                          * When >=0 this node is the end of a word. */
+    uint32_t lastchars;
+};
+
+enum {any_lastchar = 1u << 31};
+
+// Return the bit of lastchars for a key, which ends with C.
+static
+uint32_t lastchar_bit (unsigned char c)
+{
+    return 1u << (c % 31);
+}
+
+// Return nonzero if a key in the subtree of NODE can match a nonempty target,
+// whose last char has bit LASTBIT.
+static
+int may_match (const struct node *node, uint32_t lastbit)
+{
+    return node->lastchars & (lastbit | any_lastchar);
+}
+
+struct node4 {
+    struct node hdr;
+    unsigned char slot[4];
+    uint32_t child[4];
+};
+
+struct node16 {
+    struct node hdr;
+    unsigned char slot[16];
+    uint32_t child[16];
+};
+
+struct node48 {
+    struct node hdr;
+    unsigned char index[asciisz]; /* 1 + index to child. 0 if no child. */
+    uint32_t child[48];
+};
+
+struct node128 {
+    struct node hdr;
+    uint32_t child[asciisz];
+};
+
+struct node256 {
+    struct node hdr;
+    uint32_t child[nindices];
+};
+
+enum {seg_capacity = 47};
+struct nodeseg {
+    struct node hdr;
+    uint32_t child;
+    uint8_t len;
+    unsigned char seg[seg_capacity];
+};
+
+#define NODE_SIZE(type) ((sizeof (type) + node_align - 1) / node_align * node_align)
+static const size_t node_size[nkinds] = {
+    NODE_SIZE (struct node4), NODE_SIZE (struct node16),
+    NODE_SIZE (struct node48), NODE_SIZE (struct node128),
+    NODE_SIZE (struct node256), NODE_SIZE (struct nodeseg)
+};
+#undef NODE_SIZE
+static const int node_capacity[nkinds] = {4, 16, 48, asciisz, nindices, 1};
+
+// Return nonzero if NODE has room for a child at INDEX.
+// nchildren of a node256 wraps to 0 at 256 children, which is the capacity
+// of a node256 anyway.
+static
+int node_fits (const struct node *node, int index)
+{
+    switch (node->kind) {
+    case node48:
+    case node128:
+        return node->nchildren < node_capacity[node->kind] && index < asciisz;
+    case node256:
+        return 1;
+    }
+    assert (node->kind != nodeseg);
+    return node->nchildren < node_capacity[node->kind];
+}
+
+
+// A node which was replaced with a bigger one is kept on a free list until
+// reused.
+struct free_node {
+    struct node hdr;
+    uint32_t next;
+};
+
+// The node allocator hands out nodes from chunks of chunk_units units.
+// The next chunk is allocated when the current one is full. A chunk is never
+// moved or freed until the trie is freed. A node never straddles two chunks.
+// The node at offset OFFS lives in chunk OFFS >> chunk_shift.
+enum {chunk_shift = 13, chunk_units = 1 << chunk_shift};
+struct node_allocator {
+    char **chunk;
+    uint32_t nchunks;
+    uint32_t maxchunks; /* The capacity of chunk. */
+    uint64_t pos; /* The offset of the next node to hand out. */
+    uint32_t free[nkinds]; /* 0 if the free list is empty. */
+    int loglevel;
+};
+
+static
+int alloc_init (struct node_allocator *alloc, size_t nnodes, int loglevel)
+{
+    memset (alloc, 0, sizeof *alloc);
+    alloc->loglevel = loglevel;
+    // Every node takes at least one unit.
+    alloc->maxchunks = nnodes / chunk_units + 1;
+    alloc->chunk = malloc (alloc->maxchunks * sizeof *alloc->chunk);
+    assert (alloc->chunk);
+    print (alloc->loglevel, "maxchunks = %u\n", alloc->maxchunks);
+    return 0;
+}
+
+static
+void alloc_free (struct node_allocator *alloc)
+{
+    for (uint32_t k = 0; k < alloc->nchunks; ++k)
+        free (alloc->chunk[k]);
+    free (alloc->chunk);
+}
+
+static
+struct node *node_at (const struct node_allocator *alloc, uint32_t offs)
+{
+    return (struct node *) (alloc->chunk[offs >> chunk_shift]
+                            + (size_t) (offs & (chunk_units - 1)) * node_align);
+}
+
+static
+void alloc_chunk (struct node_allocator *alloc)
+{
+    if (alloc->nchunks == alloc->maxchunks) {
+        alloc->maxchunks *= 2;
+        alloc->chunk = realloc (alloc->chunk, alloc->maxchunks * sizeof *alloc->chunk);
+        assert (alloc->chunk);
+    }
+    // The nodes are initialized when handed out. Pages of the chunk which
+    // have no nodes yet are never touched.
+    alloc->chunk[alloc->nchunks] = malloc ((size_t) chunk_units * node_align);
+    assert (alloc->chunk[alloc->nchunks]);
+    print (alloc->loglevel, "chunk %u = %p\n", alloc->nchunks, alloc->chunk[alloc->nchunks]);
+    ++alloc->nchunks;
+}
+
+static
+uint32_t alloc_node (struct node_allocator *alloc, int kind)
+{
+    struct node *node;
+    uint32_t offs;
+    const size_t nbytes = node_size[kind];
+    const uint32_t nunits = nbytes / node_align;
+
+    if (alloc->free[kind]) {
+        offs = alloc->free[kind];
+        node = node_at (alloc, offs);
+        alloc->free[kind] = ((struct free_node *) node)->next;
+    } else {
+        // Skip the tail of the current chunk, if the node does not fit.
+        if ((alloc->pos & (chunk_units - 1)) + nunits > chunk_units) {
+            const uint64_t next = (alloc->pos | (chunk_units - 1)) + 1;
+            // Zero the tail, so that trie_save does not write garbage.
+            memset (node_at (alloc, alloc->pos), 0, (next - alloc->pos) * node_align);
+            alloc->pos = next;
+        }
+        // An offset has to fit in 32 bits.
+        assert (alloc->pos + nunits <= (uint64_t) UINT32_MAX + 1);
+        if (alloc->pos >> chunk_shift == alloc->nchunks)
+            alloc_chunk (alloc);
+        offs = (uint32_t) alloc->pos;
+        alloc->pos += nunits;
+        node = node_at (alloc, offs);
+    }
+    memset (node, 0, nbytes);
+    node->kind = kind;
+    node->result_offs = -1;
+    return offs;
+}
+
+static
+void free_node (struct node_allocator *alloc, uint32_t offs)
+{
+    struct node *node = node_at (alloc, offs);
+    ((struct free_node *) node)->next = alloc->free[node->kind];
+    alloc->free[node->kind] = offs;
+}
+
+// Return the address of the slot of NODE which holds the child at INDEX.
+// Return 0 if NODE has no slot for INDEX.
+// node128 has a slot for every ASCII index and node256 for every index, the
+// slot can hold 0. A nodeseg has no slot, its child is reached by node_step.
+static
+uint32_t *node_slot (const struct node *node, int index)
+{
+    switch (node->kind) {
+    case node4: {
+        struct node4 *n = (struct node4 *) node;
+        for (int k = 0; k < n->hdr.nchildren && n->slot[k] <= index; ++k)
+            if (n->slot[k] == index)
+                return &n->child[k];
+        return 0;
+    }
+    case node16: {
+        struct node16 *n = (struct node16 *) node;
+        for (int k = 0; k < n->hdr.nchildren && n->slot[k] <= index; ++k)
+            if (n->slot[k] == index)
+                return &n->child[k];
+        return 0;
+    }
+    case node48: {
+        struct node48 *n = (struct node48 *) node;
+        if (index >= asciisz)
+            return 0;
+        return n->index[index] ? &n->child[n->index[index] - 1] : 0;
+    }
+    case node128:
+        return index < asciisz ? &((struct node128 *) node)->child[index] : 0;
+    case nodeseg:
+        return 0;
+    }
+    assert (node->kind == node256);
+    return &((struct node256 *) node)->child[index];
+}
+
+static
+uint32_t node_next (const struct node *node, int index)
+{
+    uint32_t *slot = node_slot (node, index);
+    return slot ? *slot : 0;
+}
+
+// Return the child of NODE at INDEX.
+// Return 0 if there is no such child.
+static
+const struct node *node_child (const struct node_allocator *alloc, const struct node *node, int index)
+{
+    uint32_t next = node_next (node, index);
+    if (next == 0)
+        return 0;
+    count (nodes, 1);
+    return node_at (alloc, next);
+}
+
+// Return the node, which the chars at *KEY lead to from NODE, and advance
+// *KEY past these chars. This is one char, or the segment of a nodeseg.
+// Return 0 if there is no such node. **KEY is not '\0'.
+static
+const struct node *node_step (const struct node_allocator *alloc, const struct node *node, const char **key)
+{
+    const struct node *next;
+
+    if (node->kind == nodeseg) {
+        const struct nodeseg *n = (const struct nodeseg *) node;
+        // A segment has no '\0', the compare stops at the end of a shorter
+        // key. An inline loop beats a call of strncmp on short segments.
+        for (int k = 0; k < n->len; ++k)
+            if ((unsigned char) (*key)[k] != n->seg[k])
+                return 0;
+        *key += n->len;
+        count (nodes, 1);
+        return node_at (alloc, n->child);
+    }
+    next = node_child (alloc, node, key_index (**key));
+    if (next)
+        ++*key;
+    return next;
+}
+
+// The chars of a key, which a step from a node can start with, see
+// scan_set_init. Inside a wildcard, a lookup skips the chars of the key,
+// which are not in the set, in bulk.
+enum {scan_max = 4};
+struct scan_set {
+    int n; /* -1 if the node has too many children to scan for. */
+    unsigned char c[scan_max];
+};
+
+// Store the chars, which a step from NODE can start with, to SET.
+// The naked % is not a char of a key and is left out.
+static
+void scan_set_init (struct scan_set *set, const struct node *node)
+{
+    const unsigned char *slot;
+
+    set->n = 0;
+    switch (node->kind) {
+    case node4:
+        slot = ((const struct node4 *) node)->slot;
+        for (int k = 0; k < node->nchildren; ++k)
+            if (slot[k] != '%')
+                set->c[set->n++] = slot[k] == escaped_percent ? '%' : slot[k];
+        return;
+    case nodeseg:
+        set->c[set->n++] = ((const struct nodeseg *) node)->seg[0];
+        return;
+    }
+    set->n = -1;
+}
+
+// Return the first char at or after KEY, which is in SET, or the end of KEY.
+// scan_key_scalar, scan_key_sse2 and scan_key_avx2 do the same, trie_init
+// chooses the fastest one the cpu supports.
+static
+const char *scan_key_scalar (const struct scan_set *set, const char *key)
+{
+    if (set->n < 0)
+        return key;
+    for (; *key; ++key)
+        for (int k = 0; k < set->n; ++k)
+            if ((unsigned char) *key == set->c[k])
+                return key;
+    return key;
+}
+
+#if defined (__x86_64__)
+// The vector versions read the key in aligned blocks, which never cross a
+// page, and may read past the end of the key within the last block. Hence
+// asan is off for them, like for the string functions of libc.
+#define SCAN_KEY(name, attr, vec, width, setzero, set1, load, cmpeq, or, movemask) \
+attr __attribute__ ((no_sanitize_address)) \
+static \
+const char *name (const struct scan_set *set, const char *key) \
+{ \
+    const vec zero = setzero (); \
+    vec c[scan_max], v, eq; \
+    uintptr_t p = (uintptr_t) key & ~(uintptr_t) (width - 1); \
+    uint32_t mask; \
+    if (set->n < 0) \
+        return key; \
+    for (int k = 0; k < set->n; ++k) \
+        c[k] = set1 ((char) set->c[k]); \
+    for (;; p += width) { \
+        v = load ((const vec *) p); \
+        eq = cmpeq (v, zero); \
+        for (int k = 0; k < set->n; ++k) \
+            eq = or (eq, cmpeq (v, c[k])); \
+        mask = movemask (eq); \
+        if (p < (uintptr_t) key) \
+            /* Skip the chars before KEY in the first block. */ \
+            mask &= ~(uint32_t) 0 << ((uintptr_t) key - p); \
+        if (mask) \
+            return (const char *) (p + __builtin_ctz (mask)); \
+    } \
+}
+SCAN_KEY (scan_key_sse2, , __m128i, 16, _mm_setzero_si128, _mm_set1_epi8,
+          _mm_load_si128, _mm_cmpeq_epi8, _mm_or_si128, _mm_movemask_epi8)
+SCAN_KEY (scan_key_avx2, __attribute__ ((target ("avx2"))), __m256i, 32,
+          _mm256_setzero_si256, _mm256_set1_epi8, _mm256_load_si256,
+          _mm256_cmpeq_epi8, _mm256_or_si256, _mm256_movemask_epi8)
+#undef SCAN_KEY
+#endif
+
+typedef const char *scan_key_fn (const struct scan_set *set, const char *key);
+
+// Return the scan_key function for a trie of FLAGS.
+static
+scan_key_fn *choose_scan_key (int flags)
+{
+    if (flags & trie_scalar_scan)
+        return scan_key_scalar;
+#if defined (__x86_64__)
+    if (__builtin_cpu_supports ("avx2"))
+        return scan_key_avx2;
+    // x86-64 always has sse2.
+    return scan_key_sse2;
+#else
+    return scan_key_scalar;
+#endif
+}
+
+// Return the offset of the node, which the N node indices INDEX lead to from
+// NODE, like node_step. Store the number of indices used to *USED.
+static
+uint32_t node_step_path (const struct node *node, const unsigned char *index, int n, int *used)
+{
+    if (node->kind == nodeseg) {
+        const struct nodeseg *s = (const struct nodeseg *) node;
+        if (s->len > n || memcmp (s->seg, index, s->len))
+            return 0;
+        *used = s->len;
+        return s->child;
+    }
+    *used = 1;
+    return node_next (node, index[0]);
+}
+
+// Return the offset of the child of NODE with the lowest index, which is not
+// less than *INDEX. Store the index of the child to *INDEX.
+// Return 0 if there is no such child.
+// for (k = 0; (child = node_next_child (node, &k)); ++k)
+// visits all children of node in the order of their indices.
+static
+uint32_t node_next_child (const struct node *node, int *index)
+{
+    switch (node->kind) {
+    case node4: {
+        const struct node4 *n = (const struct node4 *) node;
+        for (int k = 0; k < n->hdr.nchildren; ++k)
+            if (n->slot[k] >= *index) {
+                *index = n->slot[k];
+                return n->child[k];
+            }
+        return 0;
+    }
+    case node16: {
+        const struct node16 *n = (const struct node16 *) node;
+        for (int k = 0; k < n->hdr.nchildren; ++k)
+            if (n->slot[k] >= *index) {
+                *index = n->slot[k];
+                return n->child[k];
+            }
+        return 0;
+    }
+    case node48: {
+        const struct node48 *n = (const struct node48 *) node;
+        for (int k = *index; k < asciisz; ++k)
+            if (n->index[k]) {
+                *index = k;
+                return n->child[n->index[k] - 1];
+            }
+        return 0;
+    }
+    case node128: {
+        const struct node128 *n = (const struct node128 *) node;
+        for (int k = *index; k < asciisz; ++k)
+            if (n->child[k]) {
+                *index = k;
+                return n->child[k];
+            }
+        return 0;
+    }
+    case nodeseg: {
+        // The child is ordered by the first char of the segment.
+        const struct nodeseg *n = (const struct nodeseg *) node;
+        if (n->seg[0] < *index)
+            return 0;
+        *index = n->seg[0];
+        return n->child;
+    }
+    }
+    assert (node->kind == node256);
+    const struct node256 *n = (const struct node256 *) node;
+    for (int k = *index; k < nindices; ++k)
+        if (n->child[k]) {
+            *index = k;
+            return n->child[k];
+        }
+    return 0;
+}
+
+// Return the address of the slot of NODE, which holds the child at INDEX, as
+// found by node_next_child.
+static
+uint32_t *node_child_slot (struct node *node, int index)
+{
+    if (node->kind == nodeseg)
+        return &((struct nodeseg *) node)->child;
+    return node_slot (node, index);
+}
+
+static
+uint32_t *insert_sorted (unsigned char *slot, uint32_t *child, uint8_t *nchildren, int index)
+{
+    int k;
+    for (k = *nchildren; k > 0 && slot[k-1] > index; --k) {
+        slot[k] = slot[k-1];
+        child[k] = child[k-1];
+    }
+    slot[k] = index;
+    child[k] = 0;
+    ++*nchildren;
+    return &child[k];
+}
+
+static uint32_t *node_add_slot (uint32_t *ref, int index, struct node_allocator *alloc);
+
+// Return the kind of node to replace NODE, which has no room for a child at
+// INDEX, with.
+static
+int grow_kind (const struct node *node, int index)
+{
+    int k = asciisz;
+
+    if (node->kind == node4)
+        return node16;
+    // A node16 with a child of a byte >= 0x80 has no ASCII only kind to grow
+    // to.
+    if (index >= asciisz || (node->kind == node16 && node_next_child (node, &k)))
+        return node256;
+    return node->kind + 1;
+}
+
+// Replace the node at offset OFFS with a node of kind KIND and return the
+// offset of the new node.
+static
+uint32_t node_grow (uint32_t offs, int kind, struct node_allocator *alloc)
+{
+    const struct node *node;
+    struct node *big;
+    uint32_t bigoffs, child;
+
+    node = node_at (alloc, offs);
+    assert (kind > node->kind && kind < nkinds);
+    bigoffs = alloc_node (alloc, kind);
+    big = node_at (alloc, bigoffs);
+    print (alloc->loglevel, "growing node %u of kind %d to %u\n", offs, node->kind, bigoffs);
+    big->result_offs = node->result_offs;
+    big->nkeys = node->nkeys;
+    big->lastchars = node->lastchars;
+    for (int k = 0; (child = node_next_child (node, &k)); ++k) {
+        uint32_t *slot = node_slot (big, k);
+        if (slot == 0)
+            slot = node_add_slot (&bigoffs, k, alloc);
+        *slot = child;
+    }
+    if (big->kind == node128 || big->kind == node256)
+        big->nchildren = node->nchildren;
+    free_node (alloc, offs);
+    return bigoffs;
+}
+
+// Add an empty slot for a child at INDEX to the node referenced by REF and
+// return the address of the slot.
+// If the node is full, then the node is replaced with a bigger one and REF is
+// updated.
+static
+uint32_t *node_add_slot (uint32_t *ref, int index, struct node_allocator *alloc)
+{
+    struct node *node = node_at (alloc, *ref);
+
+    if (!node_fits (node, index)) {
+        *ref = node_grow (*ref, grow_kind (node, index), alloc);
+        node = node_at (alloc, *ref);
+    }
+
+    switch (node->kind) {
+    case node4: {
+        struct node4 *n = (struct node4 *) node;
+        return insert_sorted (n->slot, n->child, &n->hdr.nchildren, index);
+    }
+    case node16: {
+        struct node16 *n = (struct node16 *) node;
+        return insert_sorted (n->slot, n->child, &n->hdr.nchildren, index);
+    }
+    case node48: {
+        struct node48 *n = (struct node48 *) node;
+        n->index[index] = ++n->hdr.nchildren;
+        return &n->child[n->hdr.nchildren - 1];
+    }
+    }
+    ++node->nchildren;
+    if (node->kind == node128)
+        return &((struct node128 *) node)->child[index];
+    assert (node->kind == node256);
+    return &((struct node256 *) node)->child[index];
+}
+
+// Return the address of the slot, which holds the child at INDEX of the node
+// referenced by REF. Allocate the child, if missing.
+static
+uint32_t *node_push_child (uint32_t *ref, int index, struct node_allocator *alloc)
+{
+    struct node *node = node_at (alloc, *ref);
+    uint32_t *slot = node_slot (node, index);
+    uint32_t child;
+
+    if (slot && *slot)
+        return slot;
+    child = alloc_node (alloc, node4);
+    if (slot == 0)
+        slot = node_add_slot (ref, index, alloc);
+    else {
+        // A node128 or node256.
+        assert (node->kind == node128 || node->kind == node256);
+        ++node->nchildren;
+    }
+    *slot = child;
+    return slot;
+}
+
+// Remove the child at INDEX from NODE.
+// The node keeps its kind.
+static
+void node_remove_child (struct node *node, int index)
+{
+    switch (node->kind) {
+    case node4:
+    case node16: {
+        unsigned char *slot;
+        uint32_t *child;
+        int k;
+        if (node->kind == node4) {
+            slot = ((struct node4 *) node)->slot;
+            child = ((struct node4 *) node)->child;
+        } else {
+            slot = ((struct node16 *) node)->slot;
+            child = ((struct node16 *) node)->child;
+        }
+        for (k = 0; slot[k] != index; ++k)
+            assert (k + 1 < node->nchildren);
+        for (--node->nchildren; k < node->nchildren; ++k) {
+            slot[k] = slot[k+1];
+            child[k] = child[k+1];
+        }
+        return;
+    }
+    case node48: {
+        struct node48 *n = (struct node48 *) node;
+        const int pos = n->index[index] - 1;
+        assert (pos >= 0);
+        n->index[index] = 0;
+        // Move the last child to the freed position.
+        if (pos != --n->hdr.nchildren) {
+            for (int k = 0; k < asciisz; ++k)
+                if (n->index[k] == n->hdr.nchildren + 1) {
+                    n->index[k] = pos + 1;
+                    break;
+                }
+            n->child[pos] = n->child[n->hdr.nchildren];
+        }
+        return;
+    }
+    }
+    uint32_t *slot = node_slot (node, index);
+    assert (node->kind == node128 || node->kind == node256);
+    assert (slot && *slot);
+    *slot = 0;
+    --node->nchildren;
+}
+
+// Return the nodes of the subtree at OFFS to the free lists.
+static
+void node_free_subtree (uint32_t offs, struct node_allocator *alloc)
+{
+    uint32_t local[64], *stack = local, child;
+    int depth = 0, maxdepth = sizeof local / sizeof *local;
+
+    stack[depth++] = offs;
+    while (depth > 0) {
+        const struct node *node = node_at (alloc, offs = stack[--depth]);
+        for (int k = 0; (child = node_next_child (node, &k)); ++k) {
+            if (depth == maxdepth) {
+                uint32_t *bigger = malloc (2 * maxdepth * sizeof *bigger);
+                assert (bigger);
+                memcpy (bigger, stack, depth * sizeof *stack);
+                if (stack != local)
+                    free (stack);
+                stack = bigger;
+                maxdepth *= 2;
+            }
+            stack[depth++] = child;
+        }
+        free_node (alloc, offs);
+    }
+    if (stack != local)
+        free (stack);
+}
+
+// Replace the node at offset OFFS with a node of kind KIND, which has no
+// children and keeps the result and the statistics of the replaced node.
+// Return the offset of the new node.
+static
+uint32_t node_replace (uint32_t offs, int kind, struct node_allocator *alloc)
+{
+    const uint32_t newoffs = alloc_node (alloc, kind);
+    const struct node *node = node_at (alloc, offs);
+    struct node *n = node_at (alloc, newoffs);
+
+    n->result_offs = node->result_offs;
+    n->nkeys = node->nkeys;
+    n->lastchars = node->lastchars;
+    free_node (alloc, offs);
+    return newoffs;
+}
+
+// The link of a pattern in the list of the patterns with the same suffix.
+struct suffix_link {
+    int32_t next; /* The next pattern with the same suffix or -1. */
+    uint32_t prefix_hash; /* prefix_hash of the part before the naked %. */
+};
+
+// Return the number of keys of NODE and of its subtree from the counts of its
+// children, saturated at UINT16_MAX. LINKS is the suffix_link of a node of the
+// suffix index, whose result_offs starts a list of patterns, or 0.
+static
+uint16_t node_recount (const struct node *node, const struct suffix_link *links, const struct node_allocator *alloc)
+{
+    uint32_t nkeys = 0, child;
+
+    for (int k = 0; nkeys < UINT16_MAX && (child = node_next_child (node, &k)); ++k)
+        nkeys += node_at (alloc, child)->nkeys;
+    if (links)
+        for (int32_t r = node->result_offs; nkeys < UINT16_MAX && r >= 0; r = links[r].next)
+            ++nkeys;
+    else
+        nkeys += node->result_offs >= 0;
+    return nkeys < UINT16_MAX ? nkeys : UINT16_MAX;
+}
+
+// Remove a key, which ends at the end of the path of the N indices INDEX from
+// the node at ROOT, from the statistics of the nodes on the path.
+// LINKS is the suffix_link of the suffix index, if ROOT is its root, or 0.
+// A node, whose count is saturated, is counted anew from its children, after
+// they lost the key, so that the count of a node, which had UINT16_MAX keys or
+// more, drops again and the node is freed with its last key.
+// Cut the path below the last node, which has other keys, and free the rest.
+// The caller unlinks the key from the node at the end of the path first.
+// lastchars is left as is, it may keep the bits of removed keys.
+// Segments are not merged back, the nodes of the remaining keys stay as
+// they are.
+static
+void node_remove_path (uint32_t root, const unsigned char *index, int n, const struct suffix_link *links, struct node_allocator *alloc)
+{
+    uint32_t *ref = &root; // The slot which holds the current node.
+    // The slots of the nodes with a saturated count, from the top down.
+    uint32_t *local[64], **saturated = local;
+    int nsaturated = 0, maxsaturated = sizeof local / sizeof *local;
+    struct node *node;
+    uint32_t offs;
+    int used, k;
+
+    for (k = 0; k <= n; k += used) {
+        node = node_at (alloc, *ref);
+        assert (node->nkeys > 0);
+        if (node->nkeys < UINT16_MAX)
+            --node->nkeys;
+        else {
+            if (nsaturated == maxsaturated) {
+                uint32_t **bigger = malloc (2 * maxsaturated * sizeof *bigger);
+                assert (bigger);
+                memcpy (bigger, saturated, nsaturated * sizeof *saturated);
+                if (saturated != local)
+                    free (saturated);
+                saturated = bigger;
+                maxsaturated *= 2;
+            }
+            saturated[nsaturated++] = ref;
+        }
+        if (k == n)
+            break;
+        offs = node_step_path (node, index + k, n - k, &used);
+        assert (offs);
+        if (node_at (alloc, offs)->nkeys == 1) {
+            // The rest of the path leads to this key only.
+            node_free_subtree (offs, alloc);
+            if (node->kind == nodeseg)
+                // A segment without its child is a leaf.
+                *ref = node_replace (*ref, node4, alloc);
+            else
+                node_remove_child (node, index[k]);
+            break;
+        }
+        if (node->kind == nodeseg)
+            ref = &((struct nodeseg *) node)->child;
+        else
+            ref = node_slot (node, index[k]);
+    }
+    // The parents of the nodes on the path are not moved, so the slots
+    // still hold the nodes.
+    while (nsaturated > 0) {
+        node = node_at (alloc, *saturated[--nsaturated]);
+        node->nkeys = node_recount (node, links, alloc);
+    }
+    if (saturated != local)
+        free (saturated);
+}
+
+// The results live in chunks of results_per_chunk results. A chunk is never
+// moved, so a pointer to a result stays valid until the trie is freed.
+enum {results_shift = 10, results_per_chunk = 1 << results_shift};
+
+// The keys live in blocks of at least key_block_size bytes.
+enum {key_block_size = 64 * 1024};
+struct key_block {
+    struct key_block *prev;
+    char keys[];
+};
+
+// Return the hash of the prefix of KLEN nodes followed by node INDEX, given
+// HASH, the hash of the prefix. The empty prefix has hash prefix_hash_init.
+// This is FNV-1a.
+enum {prefix_hash_init = 2166136261u};
+static
+uint32_t prefix_hash (uint32_t hash, int index)
+{
+    return (hash ^ (uint32_t) index) * 16777619u;
+}
+
+struct trie {
+    uint32_t root; /* Always 0. */
+    struct result **results; /* trie_push stores the pushed keys and userdata here. */
+    int nresults;
+    int maxresults; /* The number of results which fit the allocated chunks. */
+    int nchunks; /* The number of chunks of results. */
+    int maxchunks; /* The capacity of results. */
+    const struct result **found; /* trie_find_all stores the found matching records here. */
+    int maxfound; /* The capacity of found. */
+    struct key_block *keys; /* trie_push stores the pushed keys here. */
+    char *keys_pos; /* The free space in keys. */
+    size_t keys_left;
+    size_t keys_nbytes; /* The number of bytes taken by key blocks. */
+    int size; // The number of keys in this trie.
+    int order;
+    struct node_allocator node_alloc;
+    char *image; /* The mapped image of a trie opened with trie_open_mmap. */
+    size_t imagesz;
+    char *frozen; /* The node block of a trie frozen by trie_freeze. */
+    int loglevel;
+    int flags; /* The flags passed to trie_init, e.g. trie_engine_nfa. */
+    int wildcard; /* The wildcard of the keys as unsigned char, see key_index. */
+    scan_key_fn *scan_key; /* See choose_scan_key. */
+    // With trie_suffix_index, the literal suffix after the naked % of every
+    // pattern is also pushed reversed to a second tree of nodes rooted at
+    // suffix_root. The node of a suffix heads a list of the patterns with
+    // this suffix in result_offs, linked by suffix_link.
+    uint32_t suffix_root; /* 0 without trie_suffix_index. */
+    struct suffix_link *suffix_link; /* By result index. Has maxresults
+                                      * elements. */
+    int32_t *free_results; /* The results freed by trie_remove. */
+    int nfree_results;
+    int maxfree_results; /* The capacity of free_results. */
+    // With trie_lookup_cache, trie_find_all keeps the matches of the recent
+    // keys here. An entry is valid while its generation equals generation,
+    // which every change of the keys increments, see keys_changed.
+    struct cache_entry *cache; /* cache_slots entries, allocated by the
+                                * first lookup. */
+    uint32_t generation;
+    size_t cache_hits;
+    size_t cache_misses;
+    // The counters of the lookups of each thread, see stats_block.
+    struct stats_block *stats_blocks;
+    uint64_t stats_id; /* Unique among the tries of this process. */
+};
+
+// An entry of the lookup cache. The key and the null terminated matches of
+// the key share one buffer, the matches first.
+enum {cache_slots = 4096, cache_entry_max = 512};
+struct cache_entry {
+    const struct result **found;
+    const char *key;
+    size_t size; /* The number of bytes allocated at found. */
+    uint32_t hash;
+    uint32_t generation; /* 0 if the entry is empty. */
+};
+
+#ifdef TRIE_STATS
+// The counters of the lookups of one thread in one trie. Only the owner
+// thread writes them, so a lookup adds its counts without a locked
+// instruction. trie_stats sums the blocks of all threads.
+struct stats_block {
+    struct trie_stats stats;
+    const void *owner; /* The lookup_stats of the owner thread. */
+    struct stats_block *next;
+};
+
+// The block of the trie, which this thread looked up a key in last.
+static __thread struct {
+    uint64_t trie_id;
+    struct stats_block *block;
+} last_block;
+static uint64_t last_trie_id;
+
+// Return the bucket of N of a histogram of struct trie_stats.
+static
+int stats_bucket (size_t n)
+{
+    const int b = n ? 64 - __builtin_clzll (n) : 0;
+    return b < trie_stats_buckets ? b : trie_stats_buckets - 1;
+}
+
+// Add N to COUNTER of a block of this thread. trie_stats may read COUNTER
+// at the same time.
+static
+void stats_add (size_t *counter, size_t n)
+{
+    __atomic_store_n (counter, __atomic_load_n (counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+// Return the block of this thread in TR. Allocate it, if this is the first
+// lookup of this thread in TR.
+static
+struct stats_block *stats_block (const struct trie *tr)
+{
+    struct stats_block **head = (struct stats_block **) &tr->stats_blocks;
+    struct stats_block *b;
+
+    if (last_block.trie_id == tr->stats_id)
+        return last_block.block;
+    // A thread, which exited, does not write its block any more, and the
+    // next thread with its lookup_stats address takes the block over.
+    for (b = __atomic_load_n (head, __ATOMIC_ACQUIRE); b; b = b->next)
+        if (b->owner == &lookup_stats)
+            break;
+    if (b == 0) {
+        b = calloc (1, sizeof *b);
+        assert (b);
+        b->owner = &lookup_stats;
+        b->next = __atomic_load_n (head, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n (head, &b->next, b, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    last_block.trie_id = tr->stats_id;
+    last_block.block = b;
+    return b;
+}
+#endif
+
+static
+void stats_init (struct trie *tr)
+{
+#ifdef TRIE_STATS
+    tr->stats_id = __atomic_add_fetch (&last_trie_id, 1, __ATOMIC_RELAXED);
+#else
+    (void) tr;
+#endif
+}
+
+static
+void stats_free (struct trie *tr)
+{
+#ifdef TRIE_STATS
+    struct stats_block *b, *next;
+    for (b = tr->stats_blocks; b; b = next) {
+        next = b->next;
+        free (b);
+    }
+#else
+    (void) tr;
+#endif
+}
+
+// Start counting the work of a lookup.
+static
+void stats_begin (void)
+{
+#ifdef TRIE_STATS
+    memset (&lookup_stats, 0, sizeof lookup_stats);
+#endif
+}
+
+// Add the work of the lookup, which found NMATCHES matches, to the stats of
+// TR. The stats are the only part of TR, which a lookup modifies.
+static
+void stats_end (const struct trie *tr, size_t nmatches)
+{
+#ifdef TRIE_STATS
+    struct trie_stats *st = &stats_block (tr)->stats;
+    const struct lookup_stats *ls = &lookup_stats;
+
+    stats_add (&st->lookups, 1);
+    stats_add (&st->nodes, ls->nodes);
+    stats_add (&st->backtracks, ls->backtracks);
+    stats_add (&st->matches, nmatches);
+    stats_add (&st->sorted, ls->sorted);
+    stats_add (&st->merges, ls->merges);
+    if (ls->depth > st->max_depth)
+        __atomic_store_n (&st->max_depth, ls->depth, __ATOMIC_RELAXED);
+    stats_add (&st->nodes_hist[stats_bucket (ls->nodes)], 1);
+    stats_add (&st->matches_hist[stats_bucket (nmatches)], 1);
+    stats_add (&st->sorted_hist[stats_bucket (ls->sorted)], 1);
+#else
+    (void) tr;
+    (void) nmatches;
+#endif
+}
+
+int trie_stats (const void *trie, struct trie_stats *stats)
+{
+    memset (stats, 0, sizeof *stats);
+#ifdef TRIE_STATS
+    const struct trie *tr = trie;
+    const struct stats_block *b;
+    // Each counter is read atomically, not all of them at once.
+    for (b = __atomic_load_n (&tr->stats_blocks, __ATOMIC_ACQUIRE); b; b = b->next) {
+        const struct trie_stats *st = &b->stats;
+        int depth = __atomic_load_n (&st->max_depth, __ATOMIC_RELAXED);
+        stats->lookups += __atomic_load_n (&st->lookups, __ATOMIC_RELAXED);
+        stats->nodes += __atomic_load_n (&st->nodes, __ATOMIC_RELAXED);
+        stats->backtracks += __atomic_load_n (&st->backtracks, __ATOMIC_RELAXED);
+        stats->matches += __atomic_load_n (&st->matches, __ATOMIC_RELAXED);
+        stats->sorted += __atomic_load_n (&st->sorted, __ATOMIC_RELAXED);
+        stats->merges += __atomic_load_n (&st->merges, __ATOMIC_RELAXED);
+        if (depth > stats->max_depth)
+            stats->max_depth = depth;
+        for (int k = 0; k < trie_stats_buckets; ++k) {
+            stats->nodes_hist[k] += __atomic_load_n (&st->nodes_hist[k], __ATOMIC_RELAXED);
+            stats->matches_hist[k] += __atomic_load_n (&st->matches_hist[k], __ATOMIC_RELAXED);
+            stats->sorted_hist[k] += __atomic_load_n (&st->sorted_hist[k], __ATOMIC_RELAXED);
+        }
+    }
+    return 0;
+#else
+    (void) trie;
+    return -1;
+#endif
+}
+
+// The number of elements in a buffer for trie_find_all_r for a trie of
+// NRESULTS results. The first half holds the found results and the null
+// terminator, the second half is scratch space for sort_results.
+static
+size_t found_size (int nresults)
+{
+    return 2 * ((size_t) nresults + 1);
+}
+
+static
+struct result *result_at (const struct trie *tr, int32_t offs)
+{
+    return tr->results[offs >> results_shift] + (offs & (results_per_chunk - 1));
+}
+
+// Reads the indices of the nodes of a pushed key one by one.
+struct key_reader {
+    const char *k;
+    size_t nbackslashes; /* The backslashes to return before the next char. */
+    int percent; /* The % to return after the backslashes or -1. */
+    int naked; /* Set when the last returned index is a naked %. */
+    int wildcard; /* The char, which is the %, as unsigned char. */
+};
+
+static
+void key_reader_init (struct key_reader *rd, const char *key, int wildcard)
+{
+    rd->wildcard = wildcard;
+    rd->k = key;
+    rd->nbackslashes = 0;
+    rd->percent = -1;
+    rd->naked = 0;
+}
+
+// Return the index of the next node of the key or -1 at the end of the key.
+static
+int key_next (struct key_reader *rd)
+{
+    rd->naked = 0;
+    if (rd->nbackslashes > 0) {
+        --rd->nbackslashes;
+        return '\\';
+    }
+    if (rd->percent >= 0) {
+        const int index = rd->percent;
+        rd->percent = -1;
+        rd->naked = index == '%';
+        return index;
+    }
+    if (*rd->k == '\0')
+        return -1;
+    if (*rd->k == '\\') {
+        const size_t n = strspn (rd->k, "\\");
+        rd->k += n; // Skip the backslashes.
+        if ((unsigned char) *rd->k == rd->wildcard) {
+            // The backslashes are immediately followed by a '%'.
+            // Each odd backslash escapes immediately following even
+            // backslash.
+            //
+            // If number of backslashes is odd, then the last backslash
+            // escapes the %. Return half of the backslashes and an escaped
+            // %.
+            //
+            // If the number of backslashes is even, then the % is not
+            // escaped. Return half of the backslashes and the % (not
+            // escaped).
+            rd->nbackslashes = n / 2;
+            rd->percent = n % 2 ? escaped_percent : '%';
+            ++rd->k;
+        } else
+            // The backslashes are not immediately followed by a '%'.
+            // None of these backslashes escapes another backslash or %.
+            // Return them all.
+            rd->nbackslashes = n;
+        return key_next (rd);
+    }
+    rd->naked = (unsigned char) *rd->k == rd->wildcard;
+    if (rd->naked) {
+        ++rd->k;
+        return '%';
+    }
+    if (*rd->k == '%') {
+        // A % of a trie, whose wildcard is another char, takes the index of
+        // the wildcard.
+        ++rd->k;
+        return rd->wildcard;
+    }
+    return (unsigned char) *rd->k++;
+}
+
+// The node indices of a key, see key_path.
+struct key_path {
+    unsigned char *index;
+    int n;
+    int naked; /* The position of the first naked % in index or -1. */
+    unsigned char local[256];
+};
+
+// Store the node indices of KEY, a key of TR, to PATH->INDEX, which has room
+// for strlen (KEY) indices.
+// Return 0 on success, -1 if KEY is malformed.
+static
+int key_path_parse (const struct trie *tr, struct key_path *path, const char *key)
+{
+    struct key_reader rd;
+    int index;
+
+    path->n = 0;
+    path->naked = -1;
+    key_reader_init (&rd, key, tr->wildcard);
+    while ((index = key_next (&rd)) >= 0) {
+        if (rd.naked && path->naked < 0)
+            path->naked = path->n;
+        else if (rd.naked && (tr->flags & trie_multi_wildcard) == 0)
+            return -1;
+        path->index[path->n++] = index;
+    }
+    return 0;
+}
+
+// Return the position of the last naked % of PATH, which has one.
+// Only a naked % has the index of %.
+static
+int key_lastnaked (const struct key_path *path)
+{
+    int k;
+    assert (path->naked >= 0);
+    for (k = path->n - 1; path->index[k] != '%'; --k)
+        ;
+    return k;
+}
+
+// Store the node indices of KEY, a key of TR, to PATH.
+// Return 0 on success, -1 if KEY is malformed.
+// key_path_free frees PATH in either case.
+static
+int key_path (const struct trie *tr, struct key_path *path, const char *key)
+{
+    const size_t klen = strlen (key);
+
+    path->index = path->local;
+    if (klen > sizeof path->local) {
+        path->index = malloc (klen);
+        assert (path->index);
+    }
+    return key_path_parse (tr, path, key);
+}
+
+static
+void key_path_free (struct key_path *path)
+{
+    if (path->index != path->local)
+        free (path->index);
+}
+
+// Add the key with the node indices PATH, which node_push has just pushed,
+// to the statistics of the nodes on its path.
+static
+void node_count_key (uint32_t root, const struct key_path *path, uint32_t lastbit, struct node_allocator *alloc)
+{
+    struct node *node = node_at (alloc, root);
+    int used;
+
+    for (int k = 0;; k += used) {
+        if (node->nkeys < UINT16_MAX)
+            ++node->nkeys;
+        node->lastchars |= lastbit;
+        if (k == path->n)
+            break;
+        node = node_at (alloc, node_step_path (node, path->index + k, path->n - k, &used));
+    }
+}
+
+// Split the segment of the nodeseg referenced by REF after D chars. The rest
+// of the segment after the next char moves to a new nodeseg. The node after
+// the first D chars becomes a node4, which has the next char as its only
+// child, so that another key can leave the segment there.
+static
+void node_split (uint32_t *ref, int d, struct node_allocator *alloc)
+{
+    struct nodeseg *s = (struct nodeseg *) node_at (alloc, *ref), *rest;
+    struct node *branch;
+    uint32_t branchoffs, child = s->child, *slot;
+    const unsigned char c = s->seg[d];
+
+    assert (s->hdr.kind == nodeseg && d < s->len);
+    if (d + 1 < s->len) {
+        const uint32_t restoffs = alloc_node (alloc, nodeseg);
+        rest = (struct nodeseg *) node_at (alloc, restoffs);
+        rest->hdr.nchildren = 1;
+        // No key ends inside a segment.
+        rest->hdr.nkeys = node_at (alloc, child)->nkeys;
+        rest->hdr.lastchars = s->hdr.lastchars;
+        rest->child = child;
+        rest->len = s->len - d - 1;
+        memcpy (rest->seg, s->seg + d + 1, rest->len);
+        child = restoffs;
+    }
+    if (d == 0) {
+        // The nodeseg itself becomes the node4.
+        branchoffs = *ref = node_replace (*ref, node4, alloc);
+        branch = node_at (alloc, branchoffs);
+    } else {
+        branchoffs = alloc_node (alloc, node4);
+        branch = node_at (alloc, branchoffs);
+        branch->nkeys = node_at (alloc, child)->nkeys;
+        branch->lastchars = s->hdr.lastchars;
+        s->len = d;
+        s->child = branchoffs;
+    }
+    slot = node_add_slot (&branchoffs, c, alloc);
+    *slot = child;
+}
+
+// Push the N node indices INDEX of the end of a key, which no other key
+// shares, below the new node referenced by REF. Runs of chars, which can form
+// a segment, are stored in nodesegs.
+// FORK is the number of indices, after which the next key to push will leave
+// this key, or -1. No segment spans the fork, so the next key need not split
+// one.
+// Return the slot, which holds the node at the end of the key.
+static
+uint32_t *node_push_tail (uint32_t *ref, const unsigned char *index, int n, int fork, struct node_allocator *alloc)
+{
+    struct nodeseg *s;
+    int len;
+
+    while (n > 0) {
+        for (len = 0; len < n && len < seg_capacity && len != fork; ++len)
+            if (index[len] == '%' || index[len] == escaped_percent)
+                break;
+        if (len < 2) {
+            ref = node_push_child (ref, index[0], alloc);
+            ++index;
+            --n;
+            --fork;
+            continue;
+        }
+        // The node at REF is new and has no children.
+        *ref = node_replace (*ref, nodeseg, alloc);
+        s = (struct nodeseg *) node_at (alloc, *ref);
+        s->hdr.nchildren = 1;
+        s->len = len;
+        memcpy (s->seg, index, len);
+        s->child = alloc_node (alloc, node4);
+        ref = &s->child;
+        index += len;
+        n -= len;
+        fork -= len;
+    }
+    return ref;
+}
+
+// Add the nodes of the N node indices INDEX of a key, which the first K
+// indices lead to from the node referenced by REF, and which are not there
+// yet, to the tree. FORK is the number of indices the next key to push
+// shares with this key, or -1, see node_push_tail.
+// Return the slot, which holds the node at the end of the key.
+static
+uint32_t *node_push_path (uint32_t *ref, const unsigned char *index, int k, int n, int fork, struct node_allocator *alloc)
+{
+    struct node *node;
+    uint32_t *slot;
+
+    while (k < n) {
+        print (alloc->loglevel, "index = %d\n", index[k]);
+        node = node_at (alloc, *ref);
+        if (node->kind == nodeseg) {
+            const struct nodeseg *s = (const struct nodeseg *) node;
+            int d;
+            for (d = 0; d < s->len && k + d < n && s->seg[d] == index[k+d]; ++d)
+                ;
+            if (d == s->len) {
+                ref = &((struct nodeseg *) node)->child;
+                k += d;
+            } else
+                // The key leaves or ends inside the segment.
+                node_split (ref, d, alloc);
+            continue;
+        }
+        slot = node_slot (node, index[k]);
+        if (slot && *slot) {
+            ref = slot;
+            ++k;
+            continue;
+        }
+        // No other key continues here.
+        ref = node_push_child (ref, index[k], alloc);
+        ref = node_push_tail (ref, index + k + 1, n - k - 1, fork - k - 1, alloc);
+        k = n;
+    }
+    return ref;
+}
+
+// Return the bit of lastchars of the key with the node indices PATH.
+static
+uint32_t key_lastbit (const struct key_path *path)
+{
+    const int n = path->n;
+    if (n == 0)
+        return 0;
+    // Only a naked % has the index of %.
+    if (path->index[n-1] == '%')
+        return any_lastchar;
+    return lastchar_bit (path->index[n-1] == escaped_percent ? '%' : path->index[n-1]);
+}
+
+// Push the key with the node indices PATH to the tree at ROOT and store
+// RESULT_OFFS in the node at its end.
+// Return 0 if the key was pushed, 1 if the key is already present.
+static
+int node_push (uint32_t root, const struct key_path *path, int32_t result_offs, struct node_allocator *alloc)
+{
+    uint32_t *ref = node_push_path (&root, path->index, 0, path->n, -1, alloc);
+    struct node *node = node_at (alloc, *ref);
+
+    if (node->result_offs >= 0)
+        /* This key was already pushed. Fail. */
+        return 1;
+
+    // This key is not present in trie yet.
+    node->result_offs = result_offs;
+    node_count_key (root, path, key_lastbit (path), alloc);
+    return 0;
+}
+
+static
+const struct result **node_find_fuzzy (const struct result **result, const struct node *node, const char *key, const struct trie *tr, int inside_wildcard, int wildcard_spent, int depth)
+{
+    const struct node *next;
+    const char *rest;
+    const struct result **r;
+    struct scan_set set;
+
+
+    print (tr->loglevel, "%*skey = %s, inside wildcard = %d, wildcard spent = %d\n", depth, "", key, inside_wildcard, wildcard_spent);
+    // Ensure recursion is limited to 3.
+    // This function cannot afford deep recursion, because deep recursion would
+    // prevent long keys.
+    assert (depth < 3);
+    assert (wildcard_spent || depth == 0);
+    count_depth (depth);
+    if (inside_wildcard)
+        scan_set_init (&set, node);
+    while (*key) {
+        assert (node);
+        // First see if inside_wildcard.
+        if (inside_wildcard) {
+            // Skip the chars, which no step from the node starts with.
+            key = tr->scan_key (&set, key);
+            if (*key == '\0')
+                break;
+            print (tr->loglevel, "%*strying %c exactly inside wirdcard\n", depth, "", *key);
+            assert (wildcard_spent);
+            // Then see if the node has this character.
+            rest = key;
+            next = node_step (&tr->node_alloc, node, &rest);
+            if (next) {
+                print (tr->loglevel, "%*s%c matches exactly\n", depth, "", *key);
+                // No more inside wildcard.
+                r = node_find_fuzzy (result, next, rest, tr, 0, 1, depth+1);
+                if (r > result)
+                    result = r;
+            }
+            print (tr->loglevel, "%*s%c does not match, continue inside wildcard\n", depth, "", *key);
+            // Continue inside wildcard.
+            // Keep node intact.
+            ++key;
+            continue;
+        }
+        assert (inside_wildcard == 0);
+        // Then see if wildcard was used already.
+        if (wildcard_spent) {
+            // Not inside wildcard and wildcard was used already.
+            // Every character has to match exactly.
+            print (tr->loglevel, "%*strying %c exactly outside wirdcard\n", depth, "", *key);
+            next = node_step (&tr->node_alloc, node, &key);
+            if (next == 0) {
+                // No match.
+                // Need to backtrack and resume from the prior fork and take
+                // the other path.
+                print (tr->loglevel, "%*s%c does not match, wildcard used already, no match\n", depth, "", *key);
+                count (backtracks, 1);
+                return result;
+            }
+            print (tr->loglevel, "%*smatched outside wildcard up to %s, continue matching exactly\n", depth, "", key);
+            node = next;
+            continue;
+        }
+        print (tr->loglevel, "%*ssee if the node has a %%\n", depth, "");
+        // Not inside wildcard and wildcard is still available.
+        // Then see if the node has a wildcard.
+        next = node_child (&tr->node_alloc, node, '%');
+        if (next) {
+            print (tr->loglevel, "%*sfound %%, recursing\n", depth, "");
+            r = node_find_fuzzy (result, next, key+1, tr, 1, 1, depth+1);
+            if (r > result)
+                result = r;
+        }
+
+        print (tr->loglevel, "%*sno %%, matching %c exactly\n", depth, "", *key);
+        // Then see if the node has this character.
+        next = node_step (&tr->node_alloc, node, &key);
+        if (next == 0) {
+            count (backtracks, depth > 0);
+            return result; // No match.
+        }
+        print (tr->loglevel, "%*sno %%, matched exactly up to %s\n", depth, "", key);
+        node = next;
+    }
+    print (tr->loglevel, "%*skey exhausted\n", depth, "");
+    assert (*key == '\0');
+
+    /* If wildcard was not spent, then this is the exact match. Ignore it to
+     * avoid duplication of the exact match in results, because trie_find_all
+     * calls node_find_exact. node_find_fuzzy only finds fuzzy matches. */
+    if (node->result_offs >= 0 && wildcard_spent) {
+        const struct result *res = result_at (tr, node->result_offs);
+        print (tr->loglevel, "%*sfound %s\n", depth, "", res->key);
+        *result++ = res;
+    } else
+        count (backtracks, depth > 0);
+
+    return result;
+}
+
+static
+const struct node *node_find_exact (const struct trie *tr, const struct node *node, const char *key)
+{
+    const struct node *next;
+
+
+    print (tr->loglevel, "key = %s\n", key);
+    while (*key) {
+        assert (node);
+
+        print (tr->loglevel, "matching %c exactly\n", *key);
+        // Then see if the node has this character.
+        next = node_step (&tr->node_alloc, node, &key);
+        if (next == 0)
+            return 0; // No match.
+        print (tr->loglevel, "no %%, matched exactly up to %s\n", key);
+        node = next;
+    }
+    print (tr->loglevel, "key exhausted\n");
+
+    if (node->result_offs >= 0)
+        return node;
+
+    return 0;
+}
+
+// A position of node_find_nfa. DEPTH is the number of chars of the segment of
+// a nodeseg matched so far, 0 for other nodes.
+struct nfa_state {
+    const struct node *node;
+    int depth;
+};
+
+// A list of active positions of node_find_nfa.
+// A short list lives in local, a longer one is moved to the heap.
+struct nfa_states {
+    struct nfa_state *state;
+    int n;
+    int max; /* The capacity of state. */
+    struct nfa_state local[32];
+};
+
+static
+void nfa_states_init (struct nfa_states *st)
+{
+    st->state = st->local;
+    st->n = 0;
+    st->max = sizeof st->local / sizeof *st->local;
+}
+
+static
+void nfa_states_free (struct nfa_states *st)
+{
+    if (st->state != st->local)
+        free (st->state);
+}
+
+static
+void nfa_states_push (struct nfa_states *st, const struct node *node, int depth)
+{
+    if (st->n == st->max) {
+        struct nfa_state *state = malloc (2 * st->max * sizeof *state);
+        assert (state);
+        memcpy (state, st->state, st->n * sizeof *state);
+        nfa_states_free (st);
+        st->state = state;
+        st->max *= 2;
+    }
+    st->state[st->n].node = node;
+    st->state[st->n].depth = depth;
+    ++st->n;
+}
+
+// Return the node of the position, which follows the position NODE, *DEPTH
+// by the char with index INDEX, and store its depth to *DEPTH.
+// Return 0 if there is no such position.
+static
+const struct node *nfa_step (const struct node_allocator *alloc, const struct node *node, int *depth, int index)
+{
+    if (node->kind == nodeseg) {
+        const struct nodeseg *s = (const struct nodeseg *) node;
+        if (s->seg[*depth] != index)
+            return 0;
+        count (nodes, 1);
+        if (++*depth < s->len)
+            return node;
+        *depth = 0;
+        return node_at (alloc, s->child);
+    }
+    return node_child (alloc, node, index);
+}
+
+// Find all matches of KEY in one pass over KEY, without backtracking.
+// Store the exact match, if any, to *FOUND and the fuzzy matches after it, in
+// no particular order. Set *FUZZY to the first fuzzy match and return the end
+// of the matches.
+//
+// node_find_nfa simulates all positions of the trie, which match the chars of
+// KEY read so far, at once. Since a key has at most one naked %, there are
+// three kinds of positions.
+// 1. The position on the exact path of KEY. There is at most one.
+// 2. The % children of the nodes on the exact path, each entered at the char
+//    it started to match. A % matches any char, so once entered, a % stays
+//    active until the end of KEY.
+// 3. The positions below a %, each reached by matching the chars after the
+//    end of the % exactly.
+// A position is a node, or a char inside the segment of a nodeseg.
+// A position of a trie is reached by one path only and a % can end at each
+// char once, so no position is active twice. Each char takes time
+// proportional to the number of active positions. Positions, whose subtree
+// has no key ending with the last char of KEY, are dropped.
+static
+const struct result **node_find_nfa (const struct trie *tr, const char *key, const struct result **found, const struct result ***fuzzy)
+{
+    const size_t klen = strlen (key);
+    const uint32_t lastbit = klen ? lastchar_bit (key[klen-1]) : 0;
+    const struct node *exact = node_at (&tr->node_alloc, tr->root), *next;
+    struct nfa_states wild, below[2], *cur = &below[0], *nxt = &below[1], *tmp;
+    const struct result **r = found;
+    int index, depth, exact_depth = 0;
+
+    nfa_states_init (&wild);
+    nfa_states_init (&below[0]);
+    nfa_states_init (&below[1]);
+    for (const char *k = key; *k; ++k) {
+        index = key_index (*k);
+        print (tr->loglevel, "%c: %d %% active, %d below %%\n", *k, wild.n, cur->n);
+        // Every active % may end before this char.
+        nxt->n = 0;
+        for (int j = 0; j < wild.n; ++j) {
+            depth = 0;
+            next = nfa_step (&tr->node_alloc, wild.state[j].node, &depth, index);
+            if (next && (k[1] == '\0' || may_match (next, lastbit)))
+                nfa_states_push (nxt, next, depth);
+        }
+        for (int j = 0; j < cur->n; ++j) {
+            depth = cur->state[j].depth;
+            next = nfa_step (&tr->node_alloc, cur->state[j].node, &depth, index);
+            if (next && (k[1] == '\0' || may_match (next, lastbit)))
+                nfa_states_push (nxt, next, depth);
+        }
+        tmp = cur, cur = nxt, nxt = tmp;
+        if (exact) {
+            // A % of the exact path starts at this char. A segment has no %.
+            next = node_child (&tr->node_alloc, exact, '%');
+            if (next && may_match (next, lastbit))
+                nfa_states_push (&wild, next, 0);
+            exact = nfa_step (&tr->node_alloc, exact, &exact_depth, index);
+        }
+    }
+    // Exact match always beats fuzzy match.
+    if (exact && exact_depth == 0 && exact->result_offs >= 0)
+        *r++ = result_at (tr, exact->result_offs);
+    *fuzzy = r;
+    for (int j = 0; j < wild.n; ++j)
+        if (wild.state[j].node->result_offs >= 0)
+            *r++ = result_at (tr, wild.state[j].node->result_offs);
+    for (int j = 0; j < cur->n; ++j)
+        if (cur->state[j].depth == 0 && cur->state[j].node->result_offs >= 0)
+            *r++ = result_at (tr, cur->state[j].node->result_offs);
+    nfa_states_free (&below[1]);
+    nfa_states_free (&below[0]);
+    nfa_states_free (&wild);
+    return r;
+}
+
+// A set of positions of node_find_multi, which maps a position to its index
+// in a list of positions. A small set lives in local, a bigger one is moved to
+// the heap.
+struct nfa_set {
+    int *slot; /* -1 if empty. */
+    uint32_t mask;
+    int local[64];
+};
+
+static
+void nfa_set_init (struct nfa_set *set)
+{
+    set->slot = set->local;
+    set->mask = sizeof set->local / sizeof *set->local - 1;
+}
+
+static
+void nfa_set_free (struct nfa_set *set)
+{
+    if (set->slot != set->local)
+        free (set->slot);
+}
+
+// Empty SET and make room for N positions.
+static
+void nfa_set_clear (struct nfa_set *set, int n)
+{
+    if (set->mask + 1 < 2 * (uint32_t) n) {
+        nfa_set_free (set);
+        while (set->mask + 1 < 2 * (uint32_t) n)
+            set->mask = 2 * set->mask + 1;
+        set->slot = malloc ((set->mask + 1) * sizeof *set->slot);
+        assert (set->slot);
+    }
+    memset (set->slot, -1, (set->mask + 1) * sizeof *set->slot);
+}
+
+// Push the position NODE, DEPTH to ST, unless SET, the set of the positions
+// of ST, has it already.
+static
+void nfa_push_unique (struct nfa_states *st, struct nfa_set *set, const struct node *node, int depth)
+{
+    uint32_t h = (uint32_t) (((uintptr_t) node * 0x9e3779b97f4a7c15ull) >> 32) + depth;
+
+    for (h &= set->mask; set->slot[h] >= 0; h = (h + 1) & set->mask)
+        if (st->state[set->slot[h]].node == node && st->state[set->slot[h]].depth == depth)
+            return;
+    set->slot[h] = st->n;
+    nfa_states_push (st, node, depth);
+}
+
+// Run the nfa of node_find_nfa over KEY, a key of a trie_multi_wildcard
+// trie, with the lists of positions BELOW. Store the list of the positions
+// after the last char of KEY to *LAST.
+// Return the node, which KEY leads to exactly, or 0.
+//
+// A key of such a trie can have any number of naked %, so a position below a
+// % can start another %. A position inside a % has depth -1 and stays active
+// with each char, like a position of the list wild of node_find_nfa, and it
+// also steps by the char like the node of the % after its end. Unlike with
+// one %, a position can be reached by several ways of matching the chars read
+// so far to the % of a key, e.g. the position after the b of a%b%c by each b
+// of abbbc. A position is pushed once per char, so the active positions are
+// at most the positions of the trie and each char takes time proportional to
+// their number, as with one %.
+static
+const struct node *node_run_multi (const struct trie *tr, const char *key, struct nfa_states *below, const struct nfa_states **last)
+{
+    const size_t klen = strlen (key);
+    const uint32_t lastbit = klen ? lastchar_bit (key[klen-1]) : 0;
+    const struct node *exact = node_at (&tr->node_alloc, tr->root), *next, *node;
+    struct nfa_states *cur = &below[0], *nxt = &below[1], *tmp;
+    struct nfa_set set;
+    int index, depth, exact_depth = 0;
+
+    nfa_set_init (&set);
+    for (const char *k = key; *k; ++k) {
+        index = key_index (*k);
+        print (tr->loglevel, "%c: %d positions\n", *k, cur->n);
+        nxt->n = 0;
+        // A position adds at most 3 positions, the exact one adds 1.
+        nfa_set_clear (&set, 3 * cur->n + 1);
+        if (exact) {
+            // A % of the exact path starts at this char. A segment has no %.
+            next = node_child (&tr->node_alloc, exact, '%');
+            if (next && may_match (next, lastbit))
+                nfa_push_unique (nxt, &set, next, -1);
+            exact = nfa_step (&tr->node_alloc, exact, &exact_depth, index);
+        }
+        for (int j = 0; j < cur->n; ++j) {
+            node = cur->state[j].node;
+            depth = cur->state[j].depth;
+            if (depth < 0) {
+                // The % goes on with this char or ends before it.
+                nfa_push_unique (nxt, &set, node, -1);
+                depth = 0;
+            }
+            if (depth == 0) {
+                next = node_child (&tr->node_alloc, node, '%');
+                if (next && may_match (next, lastbit))
+                    nfa_push_unique (nxt, &set, next, -1);
+            }
+            next = nfa_step (&tr->node_alloc, node, &depth, index);
+            if (next && (k[1] == '\0' || may_match (next, lastbit)))
+                nfa_push_unique (nxt, &set, next, depth);
+        }
+        tmp = cur, cur = nxt, nxt = tmp;
+    }
+    nfa_set_free (&set);
+    *last = cur;
+    return exact && exact_depth == 0 ? exact : 0;
+}
+
+// Find all matches of KEY, a key of a trie_multi_wildcard trie, like
+// node_find_nfa.
+static
+const struct result **node_find_multi (const struct trie *tr, const char *key, const struct result **found, const struct result ***fuzzy)
+{
+    struct nfa_states below[2];
+    const struct nfa_states *last;
+    const struct node *exact;
+    const struct result **r = found;
+
+    nfa_states_init (&below[0]);
+    nfa_states_init (&below[1]);
+    exact = node_run_multi (tr, key, below, &last);
+    // Exact match always beats fuzzy match.
+    if (exact && exact->result_offs >= 0)
+        *r++ = result_at (tr, exact->result_offs);
+    *fuzzy = r;
+    for (int j = 0; j < last->n; ++j)
+        if (last->state[j].depth <= 0 && last->state[j].node->result_offs >= 0)
+            *r++ = result_at (tr, last->state[j].node->result_offs);
+    nfa_states_free (&below[1]);
+    nfa_states_free (&below[0]);
+    return r;
+}
+
+// Return 1 if KEY matches a key of a trie_multi_wildcard trie, 0 otherwise.
+static
+int node_has_multi (const struct trie *tr, const char *key)
+{
+    struct nfa_states below[2];
+    const struct nfa_states *last;
+    const struct node *exact;
+    int rc;
+
+    nfa_states_init (&below[0]);
+    nfa_states_init (&below[1]);
+    exact = node_run_multi (tr, key, below, &last);
+    rc = exact && exact->result_offs >= 0;
+    for (int j = 0; !rc && j < last->n; ++j)
+        rc = last->state[j].depth <= 0 && last->state[j].node->result_offs >= 0;
+    nfa_states_free (&below[1]);
+    nfa_states_free (&below[0]);
+    return rc;
+}
+
+// Return 1 if the first PREFIXLEN nodes of PATTERN, a key of TR, match the
+// first PREFIXLEN chars of KEY.
+static
+int prefix_matches (const struct trie *tr, const char *pattern, const char *key, int prefixlen)
+{
+    struct key_reader rd;
+
+    key_reader_init (&rd, pattern, tr->wildcard);
+    for (int k = 0; k < prefixlen; ++k)
+        if (key_next (&rd) != key_index (key[k]))
+            return 0;
+    return 1;
+}
+
+// Find all matches of KEY with the suffix index, if this is cheaper than the
+// backtracking or nfa engine. Return 0 otherwise.
+// Store the exact match, if any, to *FOUND and the fuzzy matches after it, in
+// no particular order. Set *FUZZY to the first fuzzy match and return the end
+// of the matches.
+//
+// The engines scan the rest of KEY after the start of each % on the exact path
+// of KEY. The suffix index lists the patterns, whose suffix matches the end of
+// KEY, and only their prefixes are compared with KEY. The patterns which end
+// with the naked % are not in the index and are found on the exact path.
+static
+const struct result **node_find_suffix (const struct trie *tr, const char *key, const struct result **found, const struct result ***fuzzy)
+{
+    const size_t klen = strlen (key);
+    const struct node *node, *pct;
+    const struct result **r = found + 1;
+    uint32_t local[256], *hash = local;
+    size_t k, d, scan_cost = 0;
+    const char *s;
+    int32_t offs;
+
+    if (klen == 0)
+        return 0;
+    for (node = node_at (&tr->node_alloc, tr->root), s = key; node && *s;) {
+        if (node_child (&tr->node_alloc, node, '%'))
+            scan_cost += klen - (s - key);
+        node = node_step (&tr->node_alloc, node, &s);
+    }
+    // A candidate of the suffix index costs a compare of the hashes of the
+    // prefixes.
+    node = node_child (&tr->node_alloc, node_at (&tr->node_alloc, tr->suffix_root), key_index (key[klen-1]));
+    if (scan_cost <= (node ? node->nkeys : 0))
+        return 0;
+    print (tr->loglevel, "finding matches of %s with the suffix index\n", key);
+
+    // hash[k] is the hash of the first k chars of KEY.
+    if (klen + 1 > sizeof local / sizeof *local) {
+        hash = malloc ((klen + 1) * sizeof *hash);
+        assert (hash);
+    }
+    hash[0] = prefix_hash_init;
+    for (k = 0; k < klen; ++k)
+        hash[k+1] = prefix_hash (hash[k], key_index (key[k]));
+
+    // The naked % matches at least one char, a suffix is at most klen-1
+    // chars.
+    for (d = 1; node && d < klen; ++d) {
+        for (offs = node->result_offs; offs >= 0; offs = tr->suffix_link[offs].next) {
+            const struct result *res = result_at (tr, offs);
+            assert ((size_t) res->suffixlen == d);
+            if ((size_t) res->prefixlen + d < klen
+                && tr->suffix_link[offs].prefix_hash == hash[res->prefixlen]
+                && prefix_matches (tr, res->key, key, res->prefixlen))
+                *r++ = res;
+        }
+        node = node_child (&tr->node_alloc, node, key_index (key[klen-d-1]));
+    }
+    for (node = node_at (&tr->node_alloc, tr->root), s = key; node && *s;) {
+        pct = node_child (&tr->node_alloc, node, '%');
+        if (pct && pct->result_offs >= 0)
+            *r++ = result_at (tr, pct->result_offs);
+        node = node_step (&tr->node_alloc, node, &s);
+    }
+    if (hash != local)
+        free (hash);
+    // Exact match always beats fuzzy match.
+    if (node && node->result_offs >= 0) {
+        *found = result_at (tr, node->result_offs);
+        *fuzzy = found + 1;
+    } else {
+        memmove (found, found + 1, (r - found - 1) * sizeof *found);
+        --r;
+        *fuzzy = found;
+    }
+    return r;
+}
+
+// Return a negative number if A is a more specific match than B.
+// Return a positive number otherwise.
+static
+int resultcmp (const struct trie *tr, const struct result *a, const struct result *b)
+{
+    print (tr->loglevel, "xkey = %s, ykey = %s\n", a->key, b->key);
+
+    // The longest key is the most specific match.
+    if (a->len > b->len)
+        return -1;
+    if (a->len < b->len)
+        return 1;
+
+    /* If the keys are of equal length return the one that was pushed first. */
+    assert (a->order >= 0);
+    assert (b->order >= 0);
+    assert (a->order != b->order);
+    if (a->order < b->order)
+        return -1;
+    return 1;
+}
+
+// Return the end of the run of results, which starts at BEGIN and are in the
+// order of resultcmp.
+static
+const struct result **run_end (const struct trie *tr, const struct result **begin, const struct result **end)
+{
+    if (begin == end)
+        return end;
+    for (++begin; begin < end && resultcmp (tr, begin[-1], begin[0]) < 0; ++begin)
+        ;
+    return begin;
+}
+
+// Merge runs [A, B) and [B, C) to OUT.
+// Return the end of the merged run.
+static
+const struct result **merge_runs (const struct trie *tr, const struct result **a, const struct result **b, const struct result **c, const struct result **out)
+{
+    const struct result **mid = b;
+    while (a < mid && b < c)
+        *out++ = resultcmp (tr, *b, *a) < 0 ? *b++ : *a++;
+    while (a < mid)
+        *out++ = *a++;
+    while (b < c)
+        *out++ = *b++;
+    return out;
+}
+
+// Sort results [BEGIN, END) in the order of resultcmp.
+// node_find_fuzzy finds the matches of each wildcard on the path of the key
+// from the shortest stem to the longest. These matches come in the order of
+// resultcmp already and form a run. sort_results merges the runs pairwise
+// until one run is left. This takes O(m log r) for m matches and r runs and
+// O(m) for one run.
+// SCRATCH has room for END - BEGIN results.
+static
+void sort_results (const struct trie *tr, const struct result **begin, const struct result **end, const struct result **scratch)
+{
+    const struct result **src = begin, **dst = scratch, **tmp;
+    const size_t n = end - begin;
+
+    count (sorted, n);
+    while (run_end (tr, src, src + n) < src + n) {
+        const struct result **run = src, **out = dst;
+        while (run < src + n) {
+            const struct result **mid = run_end (tr, run, src + n);
+            const struct result **last = run_end (tr, mid, src + n);
+            out = merge_runs (tr, run, mid, last, out);
+            count (merges, 1);
+            run = last;
+        }
+        tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+    if (src != begin)
+        memcpy (begin, src, n * sizeof *begin);
+}
+
+static
+int node_has_prefer_exact_match (const struct node *node, const char *key,
+    const struct trie *tr, int inside_wildcard,
+    int wildcard_spent, int depth)
+{
+    const struct node *next;
+    const char *rest = key;
+
+    count_depth (depth);
+    if (*key == '\0') {
+        print (tr->loglevel, "%*skey exhausted, result_offs = %d\n", depth, "", node->result_offs);
+        if (node->result_offs >= 0) {
+            const struct result *res = result_at (tr, node->result_offs);
+            print (tr->loglevel, "%*sfound %s\n", depth, "", res->key);
+            return 1;
+        }
+        count (backtracks, depth > 0);
+        return 0;
+    }
+
+    next = node_step (&tr->node_alloc, node, &rest);
+    print (tr->loglevel, "%*skey=%s, inside_wildcard=%d, wildcard_spent=%d, next[%c]=%p\n", depth, "", key, inside_wildcard, wildcard_spent, *key, next);
+    if (next && node_has_prefer_exact_match (next, rest, tr, 0, wildcard_spent, depth+1)) {
+        print (tr->loglevel, "%*s%c is found\n", depth, "", *key);
+        return 1;
+    }
+    if (inside_wildcard) {
+        struct scan_set set;
+        print (tr->loglevel, "%*smatched %c to %%\n", depth, "", *key);
+        // Skip the chars, which no step from the node starts with.
+        scan_set_init (&set, node);
+        return node_has_prefer_exact_match (node, tr->scan_key (&set, key+1), tr, 1, wildcard_spent, depth+1);
+    }
+    if (wildcard_spent) {
+        print (tr->loglevel, "%*s%% was already used, backtrack key\n", depth, "");
+        count (backtracks, 1);
+        return 0;
+    }
+    next = node_child (&tr->node_alloc, node, '%');
+    print (tr->loglevel, "%*snext[%%]=%p\n", depth, "", next);
+    if (next == 0) {
+        print (tr->loglevel, "%*sbacktrack key\n", depth, "");
+        count (backtracks, depth > 0);
+        return 0;
+    }
+    print (tr->loglevel, "%*smatching %c to %%\n", depth, "", *key);
+    return node_has_prefer_exact_match (next, key+1, tr, 1, 1, depth+1);
+}
+
+static
+int node_has_prefer_fuzzy_match (const struct node *node, const char *key, const struct trie *tr, int inside_wildcard, int wildcard_spent, int depth)
+{
+    const struct node *next;
+    const char *rest;
+    struct scan_set set;
+
+
+    print (tr->loglevel, "%*skey = %s, inside wildcard = %d, wildcard spent = %d\n", depth, "", key, inside_wildcard, wildcard_spent);
+    // Ensure recursion is limited to 3.
+    // This function cannot afford deep recursion, because deep recursion would
+    // prevent long keys.
+    assert (depth < 3);
+    assert (wildcard_spent || depth == 0);
+    count_depth (depth);
+    if (inside_wildcard)
+        scan_set_init (&set, node);
+    while (*key) {
+        assert (node);
+        // First see if inside_wildcard.
+        if (inside_wildcard) {
+            // Skip the chars, which no step from the node starts with.
+            key = tr->scan_key (&set, key);
+            if (*key == '\0')
+                break;
+            print (tr->loglevel, "%*strying %c exactly inside wirdcard\n", depth, "", *key);
+            assert (wildcard_spent);
+            // Then see if the node has this character.
+            rest = key;
+            next = node_step (&tr->node_alloc, node, &rest);
+            if (next) {
+                print (tr->loglevel, "%*s%c matches\n", depth, "", *key);
+                // No more inside wildcard.
+                if (node_has_prefer_fuzzy_match (next, rest, tr, 0, 1, depth+1))
+                    return 1;
+            }
+            print (tr->loglevel, "%*s%c does not match, continue inside wildcard\n", depth, "", *key);
+            // Continue inside wildcard.
+            // Keep node intact.
+            ++key;
+            continue;
+        }
+        assert (inside_wildcard == 0);
+        // Then see if wildcard was used already.
+        if (wildcard_spent) {
+            // Not inside wildcard and wildcard was used already.
+            // Every character has to match exactly.
+            print (tr->loglevel, "%*strying %c exactly outside wirdcard\n", depth, "", *key);
+            next = node_step (&tr->node_alloc, node, &key);
+            if (next == 0) {
+                // No match.
+                // Need to backtrack and resume from the prior fork and take
+                // the other path.
+                print (tr->loglevel, "%*s%c does not match, wildcard used already, no match\n", depth, "", *key);
+                count (backtracks, 1);
+                return 0;
+            }
+            print (tr->loglevel, "%*smatched outside wildcard up to %s, continue matching exactly\n", depth, "", key);
+            node = next;
+            continue;
+        }
+        print (tr->loglevel, "%*ssee if the node has a %%\n", depth, "");
+        // Not inside wildcard and wildcard is still available.
+        // Then see if the node has a wildcard.
+        next = node_child (&tr->node_alloc, node, '%');
+        if (next) {
+            print (tr->loglevel, "%*sfound %%, recursing\n", depth, "");
+            if (node_has_prefer_fuzzy_match (next, key+1, tr, 1, 1, depth+1))
+                return 1;
+        }
+        print (tr->loglevel, "%*sno %%, matching %c exactly\n", depth, "", *key);
+        // Then see if the node has this character.
+        next = node_step (&tr->node_alloc, node, &key);
+        if (next == 0) {
+            count (backtracks, depth > 0);
+            return 0; // No match.
+        }
+        print (tr->loglevel, "%*sno %%, matched exactly up to %s\n", depth, "", key);
+        node = next;
+    }
+    print (tr->loglevel, "%*skey exhausted\n", depth, "");
+
+    if (*key == '\0' && node->result_offs >= 0) {
+        const struct result *res = result_at (tr, node->result_offs);
+        print (tr->loglevel, "%*sfound %s\n", depth, "", res->key);
+        return 1;
+    }
+    count (backtracks, depth > 0);
+    return 0;
+}
+
+// Return 1 if a key in the subtree of NODE, which has no naked %, matches KEY
+// exactly. Return 0 otherwise.
+static
+int node_has_exact (const struct trie *tr, const struct node *node, const char *key, uint32_t lastbit)
+{
+    while (*key) {
+        if (!may_match (node, lastbit))
+            return 0;
+        node = node_step (&tr->node_alloc, node, &key);
+        if (node == 0)
+            return 0;
+    }
+    return node->result_offs >= 0;
+}
+
+// Return 1 if the naked % at NODE matches one or more chars of KEY, such that
+// a key in the subtree of NODE matches the rest of KEY exactly.
+// Return 0 otherwise.
+// The first char of KEY is matched to the % already.
+static
+int node_has_wildcard (const struct trie *tr, const struct node *node, const char *key, uint32_t lastbit)
+{
+    struct scan_set set;
+
+    scan_set_init (&set, node);
+    for (key = tr->scan_key (&set, key); *key; key = tr->scan_key (&set, key + 1))
+        if (node_has_exact (tr, node, key, lastbit)) {
+            print (tr->loglevel, "%% matches up to %s\n", key);
+            return 1;
+        } else
+            count (backtracks, 1);
+    // The % matches the rest of KEY.
+    return node->result_offs >= 0;
+}
+
+// Return nonzero if node_has_auto should look for a match of the % child
+// FUZZY of a node before it looks for a match of the child EXACT.
+// The smaller subtree is searched first, because it is cheaper to search,
+// when it has no match.
+static
+int prefer_fuzzy (const struct node *fuzzy, const struct node *exact, const char *rest, uint32_t lastbit)
+{
+    if (exact == 0)
+        return 1;
+    if (*rest ? !may_match (exact, lastbit) : exact->result_offs < 0)
+        return 1;
+    return fuzzy->nkeys <= exact->nkeys;
+}
+
+// Return 1 if KEY is present in node.
+// Return 0 otherwise.
+// node_has_auto chooses at each node on the path of KEY whether to match the
+// next char to the % child first or to match it exactly first, using the
+// statistics of the subtrees. It skips subtrees, which have no key ending
+// with the last char of KEY or with a naked %.
+// It walks the path of KEY exactly and looks for fuzzy matches of the
+// preferred % children on the way. If there is no exact match, then it walks
+// the path again and looks for fuzzy matches of the deferred % children.
+static
+int node_has_auto (const struct trie *tr, const struct node *root, const char *key)
+{
+    const size_t klen = strlen (key);
+    const uint32_t lastbit = klen ? lastchar_bit (key[klen-1]) : 0;
+    const struct node *node, *fuzzy, *exact;
+    const char *k, *rest;
+    int ndeferred = 0;
+
+    for (node = root, k = key; *k; k = rest, node = exact) {
+        fuzzy = node_child (&tr->node_alloc, node, '%');
+        rest = k;
+        exact = node_step (&tr->node_alloc, node, &rest);
+        if (fuzzy && may_match (fuzzy, lastbit)) {
+            if (prefer_fuzzy (fuzzy, exact, rest, lastbit)) {
+                print (tr->loglevel, "trying %% at %s\n", k);
+                if (node_has_wildcard (tr, fuzzy, k+1, lastbit))
+                    return 1;
+            } else
+                ++ndeferred;
+        }
+        if (exact == 0 || (*rest && !may_match (exact, lastbit)))
+            break;
+        // Fetch the % child of the next node along with the next node.
+        fuzzy = node_child (&tr->node_alloc, exact, '%');
+        if (fuzzy)
+            __builtin_prefetch (fuzzy);
+    }
+    if (*k == '\0' && node->result_offs >= 0)
+        return 1;
+
+    for (node = root, k = key; ndeferred > 0; k = rest, node = exact) {
+        assert (*k);
+        fuzzy = node_child (&tr->node_alloc, node, '%');
+        rest = k;
+        exact = node_step (&tr->node_alloc, node, &rest);
+        if (fuzzy && may_match (fuzzy, lastbit) && !prefer_fuzzy (fuzzy, exact, rest, lastbit)) {
+            print (tr->loglevel, "trying deferred %% at %s\n", k);
+            if (node_has_wildcard (tr, fuzzy, k+1, lastbit))
+                return 1;
+            --ndeferred;
+        }
+    }
+    return 0;
+}
+
+// Return 1 if KEY is present in node.
+// Return 0 otherwise.
+// node_has_prefer_fuzzy_match nodes matching each
+// character of the key to wildcard % first. If this fuzzy match fails, then
+// node_has_prefer_fuzzy_match nodes matching the character exactly.
+// node_has_prefer_exact_match does the opposite. node_has_prefer_exact_match
+// nodes matching each character of the key exactly first. If this exact match
+// fails, then node_has_prefer_exact_match nodes matching the character fuzzy.
+// Both functions return the same result. The difference is in how fast the
+// result is found. node_has_prefer_exact_match performs better on some
+// contents of node, node_has_prefer_fuzzy_match performs better on other
+// contents of node. node_has_auto chooses per node.
+static
+int node_has (const struct trie *tr, const struct node *node, const char *key, int prefer_fuzzy_match)
+{
+    int rc;
+    print (tr->loglevel, "looking for %s\n", key);
+    if (prefer_fuzzy_match == trie_prefer_auto)
+        rc = node_has_auto (tr, node, key);
+    else if (prefer_fuzzy_match)
+        rc = node_has_prefer_fuzzy_match (node, key, tr, 0, 0, 0);
+    else
+        rc = node_has_prefer_exact_match (node, key, tr, 0, 0, 0);
+    print (tr->loglevel, "%sfound %s\n", rc ? "" : "not ", key);
+    return rc;
+}
+
+
+
+// Return the wildcard of a trie of FLAGS, see TRIE_WILDCARD.
+static
+int flags_wildcard (int flags)
+{
+    const int wildcard = flags >> trie_wildcard_shift & 0xff;
+    assert (wildcard != '\\');
+    return wildcard ? wildcard : '%';
+}
+
+// A trie opened with trie_open_mmap or frozen with trie_freeze cannot be
+// modified.
+static
+int read_only (const struct trie *tr)
+{
+    return tr->image || tr->frozen;
+}
+
+// MAXKEYS is the expected number of keys to be pushed to this trie.
+// MAXCHARS is the expected number of characters (equals the number of nodes)
+// to be pushed to this trie.
+// Both are hints, which only size the internal tables. The trie grows as keys
+// are pushed.
+void *trie_init (int maxkeys, int maxchars, int loglevel, int flags)
+{
+    struct trie *trie;
+
+    assert (maxkeys >= 0);
+    assert (maxchars >= 0);
+    trie = calloc (1, sizeof *trie);
+    assert (trie);
+    trie->loglevel = loglevel;
+    // The suffix index holds the keys with one %.
+    if (flags & trie_multi_wildcard)
+        flags = (flags | trie_engine_nfa) & ~trie_suffix_index;
+    trie->flags = flags;
+    trie->wildcard = flags_wildcard (flags);
+    trie->scan_key = choose_scan_key (flags);
+    trie->generation = 1;
+    stats_init (trie);
+    print (trie->loglevel, "trie = %p\n", trie);
+    alloc_init (&trie->node_alloc, maxchars, loglevel);
+    // The first node is the root node.
+    trie->root = alloc_node (&trie->node_alloc, node256);
+    assert (trie->root == 0);
+    print (trie->loglevel, "trie->root = %u, sizeof (struct node4) = %zu, sizeof (struct node256) = %zu\n", trie->root, node_size[node4], node_size[node256]);
+    trie->maxchunks = maxkeys / results_per_chunk + 1;
+    trie->results = malloc (trie->maxchunks * sizeof *trie->results);
+    assert (trie->results);
+    trie->maxfound = found_size (maxkeys);
+    trie->found = malloc (trie->maxfound * sizeof *trie->found);
+    assert (trie->found);
+    if (flags & trie_suffix_index)
+        trie->suffix_root = alloc_node (&trie->node_alloc, node4);
+    return trie;
+}
+
+int trie_free (void *trie)
+{
+    struct trie *tr = trie;
+    struct key_block *block, *prev;
+    for (int k = 0; k < tr->nchunks; ++k)
+        free (tr->results[k]);
+    free (tr->results);
+    free (tr->found);
+    free (tr->suffix_link);
+    free (tr->free_results);
+    if (tr->cache) {
+        for (int k = 0; k < cache_slots; ++k)
+            free (tr->cache[k].found);
+        free (tr->cache);
+    }
+    for (block = tr->keys; block; block = prev) {
+        prev = block->prev;
+        free (block);
+    }
+    stats_free (tr);
+    if (tr->image) {
+        // The chunks point to the image.
+        free (tr->node_alloc.chunk);
+        munmap (tr->image, tr->imagesz);
+    } else if (tr->frozen) {
+        // The chunks point to the block.
+        free (tr->node_alloc.chunk);
+        free (tr->frozen);
+    } else
+        alloc_free (&tr->node_alloc);
+    free (trie);
+    return 0;
+}
+
+// Return the index of the result, which alloc_result returns next.
+static
+int32_t next_result (const struct trie *tr)
+{
+    return tr->nfree_results ? tr->free_results[tr->nfree_results - 1] : tr->nresults;
+}
+
+// Allocate the chunks of results, suffix_link and found for N more keys at
+// once, rather than grow them key by key in alloc_result.
+static
+void reserve_results (struct trie *tr, int n)
+{
+    const int need = tr->nresults + (n > tr->nfree_results ? n - tr->nfree_results : 0);
+    const int nchunks = need / results_per_chunk + 1;
+
+    if (nchunks > tr->maxchunks) {
+        tr->maxchunks = nchunks;
+        tr->results = realloc (tr->results, tr->maxchunks * sizeof *tr->results);
+        assert (tr->results);
+    }
+    if (nchunks > tr->nchunks) {
+        for (; tr->nchunks < nchunks; ++tr->nchunks) {
+            tr->results[tr->nchunks] = malloc (results_per_chunk * sizeof **tr->results);
+            assert (tr->results[tr->nchunks]);
+            tr->maxresults += results_per_chunk;
+        }
+        if (tr->flags & trie_suffix_index) {
+            tr->suffix_link = realloc (tr->suffix_link, tr->maxresults * sizeof *tr->suffix_link);
+            assert (tr->suffix_link);
+        }
+    }
+    if (found_size (need) > (size_t) tr->maxfound) {
+        tr->maxfound = found_size (need);
+        tr->found = realloc (tr->found, tr->maxfound * sizeof *tr->found);
+        assert (tr->found);
+    }
+}
+
+// Return a new result to store a pushed key.
+// A result freed by trie_remove is reused first.
+static
+struct result *alloc_result (struct trie *tr)
+{
+    if (tr->nfree_results)
+        return result_at (tr, tr->free_results[--tr->nfree_results]);
+    if (tr->nresults == tr->maxresults) {
+        if (tr->nchunks == tr->maxchunks) {
+            tr->maxchunks *= 2;
+            tr->results = realloc (tr->results, tr->maxchunks * sizeof *tr->results);
+            assert (tr->results);
+        }
+        tr->results[tr->nchunks] = malloc (results_per_chunk * sizeof **tr->results);
+        assert (tr->results[tr->nchunks]);
+        ++tr->nchunks;
+        tr->maxresults += results_per_chunk;
+        if (tr->flags & trie_suffix_index) {
+            tr->suffix_link = realloc (tr->suffix_link, tr->maxresults * sizeof *tr->suffix_link);
+            assert (tr->suffix_link);
+        }
+    }
+    // Every result can be found by a single lookup.
+    if (found_size (tr->nresults + 1) > (size_t) tr->maxfound) {
+        tr->maxfound *= 2;
+        tr->found = realloc (tr->found, tr->maxfound * sizeof *tr->found);
+        assert (tr->found);
+    }
+    return result_at (tr, tr->nresults++);
+}
+
+// Push the literal suffix after the naked % of KEY, the key of result
+// RESULT, reversed to the suffix index and add RESULT to the list of the
+// suffix.
+static
+void suffix_push (struct trie *tr, const struct key_path *path, int32_t result)
+{
+    uint32_t *ref = &tr->suffix_root;
+    struct node *node;
+    uint32_t hash = prefix_hash_init;
+
+    assert (path->naked >= 0);
+    for (int k = 0; k < path->naked; ++k)
+        hash = prefix_hash (hash, path->index[k]);
+    // Count the pattern at the suffix root too, like node_push counts a key at
+    // the root, since suffix_remove takes it back.
+    node = node_at (&tr->node_alloc, tr->suffix_root);
+    if (node->nkeys < UINT16_MAX)
+        ++node->nkeys;
+    for (int k = path->n - 1; k > path->naked; --k) {
+        ref = node_push_child (ref, path->index[k], &tr->node_alloc);
+        node = node_at (&tr->node_alloc, *ref);
+        if (node->nkeys < UINT16_MAX)
+            ++node->nkeys;
+    }
+    node = node_at (&tr->node_alloc, *ref);
+    tr->suffix_link[result].next = node->result_offs;
+    tr->suffix_link[result].prefix_hash = hash;
+    node->result_offs = result;
+}
+
+// Make room for NBYTES of keys in the last key block.
+static
+void reserve_keys (struct trie *tr, size_t nbytes)
+{
+    if (tr->keys_left < nbytes) {
+        const size_t size = nbytes > key_block_size ? nbytes : key_block_size;
+        struct key_block *block = malloc (sizeof *block + size);
+        assert (block);
+        block->prev = tr->keys;
+        tr->keys = block;
+        tr->keys_pos = block->keys;
+        tr->keys_left = size;
+        tr->keys_nbytes += size;
+    }
+}
+
+// Copy KEY of length KLEN, including the null terminator, to the key blocks.
+static
+const char *store_key (struct trie *tr, const char *key, size_t klen)
+{
+    char *k;
+    reserve_keys (tr, klen);
+    k = tr->keys_pos;
+    memcpy (k, key, klen);
+    tr->keys_pos += klen;
+    tr->keys_left -= klen;
+    return k;
+}
+
+// Start a new generation of the keys of TR, which invalidates the entries of
+// the lookup cache. Generation 0 marks an empty entry, so when the counter
+// wraps around, all entries are emptied, rather than matched, and the
+// counting starts over.
+static
+void keys_changed (struct trie *tr)
+{
+    if (++tr->generation != 0)
+        return;
+    if (tr->cache)
+        for (int k = 0; k < cache_slots; ++k)
+            tr->cache[k].generation = 0;
+    tr->generation = 1;
+}
+
+// Store KEY of length LEN, the key with the node indices PATH, and USERDATA
+// to RESULT.
+static
+void result_init (struct result *result, const struct key_path *path, const char *key, size_t len, const void *userdata)
+{
+    result->key = key;
+    result->len = len;
+    if (path->naked >= 0) {
+        // The chars before the first and after the last naked %.
+        result->prefixlen = path->naked;
+        result->suffixlen = path->n - key_lastnaked (path) - 1;
+    } else {
+        result->prefixlen = path->n;
+        result->suffixlen = -1;
+    }
+    result->userdata = (void *) userdata;
+}
+
+int trie_push (void *trie, const char *key, const void *userdata)
+{
+    int rc;
+    struct trie *tr = trie;
+    struct result *result;
+    struct key_path path;
+    size_t klen;
+    int32_t offs;
+
+    if (read_only (tr))
+        return -2;
+    // gmake allows multiple % in a rule, as long as first is naked and the
+    // others are escaped. A key with multiple naked % is malformed, unless
+    // this is a trie_multi_wildcard trie. The caller should print an error
+    // message and terminate.
+    if (key_path (tr, &path, key) < 0) {
+        key_path_free (&path);
+        return -1;
+    }
+    offs = next_result (tr);
+    rc = node_push (tr->root, &path, offs, &tr->node_alloc);
+    if (rc) {
+        key_path_free (&path);
+        return rc;
+    }
+    klen = strlen (key) + 1; // + 1 for null terminator.
+    result = alloc_result (tr);
+    assert (result == result_at (tr, offs));
+    result_init (result, &path, store_key (tr, key, klen), klen - 1, userdata);
+    result->order = tr->order++;
+    ++tr->size;
+    keys_changed (tr);
+    // A pattern, which ends with the naked %, is found by its prefix alone.
+    if (tr->suffix_root && result->suffixlen > 0)
+        suffix_push (tr, &path, offs);
+    key_path_free (&path);
+    print (tr->loglevel, "pushed %s, size = %d\n", key, tr->size);
+    return 0;
+}
+
+// Return the node of the key with the node indices PATH, if the key was
+// pushed, or 0.
+static
+struct node *key_node (const struct trie *tr, const struct key_path *path)
+{
+    const struct node *node = node_at (&tr->node_alloc, tr->root);
+    uint32_t offs;
+    int used;
+
+    for (int k = 0; k < path->n; k += used) {
+        offs = node_step_path (node, path->index + k, path->n - k, &used);
+        if (offs == 0)
+            return 0;
+        node = node_at (&tr->node_alloc, offs);
+    }
+    return node->result_offs >= 0 ? (struct node *) node : 0;
+}
+
+// Remove result RESULT with the node indices PATH from the suffix index.
+// Reverses the suffix in PATH.
+static
+void suffix_remove (struct trie *tr, struct key_path *path, int32_t result)
+{
+    unsigned char *suffix = path->index + path->naked + 1;
+    const int n = path->n - path->naked - 1;
+    struct node *node = node_at (&tr->node_alloc, tr->suffix_root);
+    int32_t *link;
+
+    for (int k = 0; k < n / 2; ++k) {
+        const unsigned char c = suffix[k];
+        suffix[k] = suffix[n-1-k];
+        suffix[n-1-k] = c;
+    }
+    for (int k = 0; k < n; ++k) {
+        node = (struct node *) node_child (&tr->node_alloc, node, suffix[k]);
+        assert (node);
+    }
+    for (link = &node->result_offs; *link != result; link = &tr->suffix_link[*link].next)
+        assert (*link >= 0);
+    *link = tr->suffix_link[result].next;
+    node_remove_path (tr->suffix_root, suffix, n, tr->suffix_link, &tr->node_alloc);
+}
+
+int trie_remove (void *trie, const char *key)
+{
+    struct trie *tr = trie;
+    struct key_path path;
+    struct node *node;
+    struct result *r;
+    int32_t offs;
+
+    if (read_only (tr))
+        return -2;
+    if (key_path (tr, &path, key) < 0) {
+        key_path_free (&path);
+        return -1;
+    }
+    node = key_node (tr, &path);
+    if (node == 0) {
+        key_path_free (&path);
+        return 1;
+    }
+    offs = node->result_offs;
+    node->result_offs = -1;
+    node_remove_path (tr->root, path.index, path.n, 0, &tr->node_alloc);
+    if (tr->suffix_root && path.naked >= 0 && path.naked + 1 < path.n)
+        suffix_remove (tr, &path, offs);
+    key_path_free (&path);
+
+    // The result is reused by the next push. The key stays in the key
+    // blocks until the trie is freed.
+    if (tr->nfree_results == tr->maxfree_results) {
+        tr->maxfree_results = tr->maxfree_results ? 2 * tr->maxfree_results : 16;
+        tr->free_results = realloc (tr->free_results, tr->maxfree_results * sizeof *tr->free_results);
+        assert (tr->free_results);
+    }
+    tr->free_results[tr->nfree_results++] = offs;
+    r = result_at (tr, offs);
+    print (tr->loglevel, "removed %s\n", r->key);
+    r->key = "";
+    r->len = 0;
+    r->userdata = 0;
+    r->order = -1;
+    r->prefixlen = 0;
+    r->suffixlen = -1;
+    --tr->size;
+    keys_changed (tr);
+    return 0;
+}
+
+int trie_replace (void *trie, const char *key, const void *userdata)
+{
+    struct trie *tr = trie;
+    struct key_path path;
+    struct node *node;
+    int rc;
+
+    if (read_only (tr))
+        return -2;
+    rc = key_path (tr, &path, key);
+    node = rc == 0 ? key_node (tr, &path) : 0;
+    key_path_free (&path);
+    if (rc < 0)
+        return -1;
+    if (node) {
+        // The result keeps its order.
+        result_at (tr, node->result_offs)->userdata = (void *) userdata;
+        return 0;
+    }
+    rc = trie_push (trie, key, userdata);
+    return rc == 0 ? 1 : rc;
+}
+
+// A key of trie_build_bulk and trie_build_parallel.
+struct bulk_key {
+    const unsigned char *index; /* The node indices of the key. */
+    int n;
+    int naked; /* See struct key_path. */
+    int input; /* The index of the key in the caller's array, or -1 - g for
+                * the prefix of graft g, see bulk_push. */
+    int32_t result; /* The result of the key or -1, if it was not pushed. */
+    size_t len; /* The length of the key. */
+    uint64_t word; /* The word of the key, which bulk_sort compares. */
+    int wordlen;
+};
+
+// Set the word of bulk key B to its node indices 8 * W to 8 * W + 7 as a big
+// endian number, and its word length to how many of them B has. Past its end
+// a key has zeros, and the word length orders the key before the keys, which
+// continue with escaped percents.
 static
-int print (const char *format, ...)
+void bulk_word (struct bulk_key *b, int w)
 {
-    int retcode;
-    va_list ap;
-    if (g_loglevel == 0)
-        return 0;
+    const int d = 8 * w, len = b->n - d;
+    uint64_t word = 0;
 
-    va_start (ap, format);
-    retcode = vprintf (format, ap);
-    va_end (ap);
-    return retcode;
+    if (len >= 8) {
+        memcpy (&word, b->index + d, 8);
+        word = __builtin_bswap64 (word);
+    } else
+        for (int k = 0; k < 8; ++k)
+            word = word << 8 | (k < len ? b->index[d+k] : 0);
+    b->word = word;
+    b->wordlen = len < 0 ? 0 : len < 8 ? len : 8;
 }
 
-// Unix filenames cannot contain '\0' (slot 0) and '/' (slot 47).
-// Keys which trie accepts can contain a slash though. e.g. "obj/hello.o".
-// This leaves slot 0 for trie's internal purposes.
-// Escaped percent is stored in slot 0.
-enum {asciisz = 128, escaped_percent = 0};
-struct node {
-    struct node *next[asciisz];
-    int16_t result_offs; /* Offset to trie->results_begin.
-                          * When >=0 this node is the end of a word. */
-};
+static
+int bulk_wordcmp (const struct bulk_key *a, const struct bulk_key *b)
+{
+    if (a->word != b->word)
+        return a->word < b->word ? -1 : 1;
+    return a->wordlen - b->wordlen;
+}
 
-struct node_allocator {
-    struct node *pos;
-    struct node *end;
+static
+void bulk_swap (struct bulk_key *a, struct bulk_key *b)
+{
+    const struct bulk_key tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+// Sort the N bulk keys BULK by their node indices, then by their index in the
+// caller's array, so that the first of equal keys is pushed.
+// This is a three way radix quicksort. It partitions a range of keys, which
+// share their first W words, by word W into the keys less than, equal to and
+// greater than a pivot, and the equal keys go on with word W + 1. Unlike a
+// compare of whole keys, it reads each word of the long prefixes, which the
+// keys share, once per word rather than once per compare, and keeps the word
+// in the key, while the less and greater keys go on with the same word.
+// The ranges to sort are on a stack, rather than recursion.
+static
+void bulk_sort (struct bulk_key *bulk, int n)
+{
+    struct range {
+        int lo, hi, w;
+        int load; /* Load word W of the keys. */
+    } *stack;
+    int nstack = 0, maxstack = 64;
+
+    stack = malloc (maxstack * sizeof *stack);
+    assert (stack);
+    stack[nstack++] = (struct range) {0, n, 0, 1};
+    while (nstack > 0) {
+        const struct range r = stack[--nstack];
+        struct bulk_key v;
+        int lt = r.lo, gt = r.hi, tie;
+
+        if (r.hi - r.lo < 2)
+            continue;
+        if (r.load)
+            for (int i = r.lo; i < r.hi; ++i)
+                bulk_word (&bulk[i], r.w);
+        v = bulk[r.lo + (r.hi - r.lo) / 2];
+        // The equal keys end in word W.
+        tie = v.wordlen < 8;
+        for (int i = r.lo; i < gt;) {
+            const int c = bulk_wordcmp (&bulk[i], &v);
+            if (c < 0)
+                bulk_swap (&bulk[lt++], &bulk[i++]);
+            else if (c > 0)
+                bulk_swap (&bulk[i], &bulk[--gt]);
+            else
+                ++i;
+        }
+        if (tie) {
+            // [lt, gt) are equal keys. Sort them by input, by insertion.
+            for (int i = lt + 1; i < gt; ++i)
+                for (int j = i; j > lt && bulk[j-1].input > bulk[j].input; --j)
+                    bulk_swap (&bulk[j-1], &bulk[j]);
+        }
+        if (nstack + 3 > maxstack) {
+            maxstack *= 2;
+            stack = realloc (stack, maxstack * sizeof *stack);
+            assert (stack);
+        }
+        stack[nstack++] = (struct range) {r.lo, lt, r.w, 0};
+        stack[nstack++] = (struct range) {gt, r.hi, r.w, 0};
+        if (!tie)
+            stack[nstack++] = (struct range) {lt, gt, r.w + 1, 1};
+    }
+    free (stack);
+}
+
+// A node on the path of the key, which trie_build_bulk pushed last. POS
+// indices of the key lead to the node. NKEYS and LASTCHARS are the statistics
+// of the keys pushed below the node so far, which are not added to the
+// statistics of the node yet.
+struct bulk_level {
+    uint32_t offs;
+    int pos;
+    uint32_t nkeys;
+    uint32_t lastchars;
 };
 
+// Add the pending statistics of LEVEL[L] to its node and to LEVEL[L-1].
 static
-int alloc_init (struct node_allocator *alloc, struct node *begin, size_t nnodes)
+void bulk_flush (struct bulk_level *level, int l, struct node_allocator *alloc)
 {
-    alloc->pos = begin;
-    alloc->end = begin + nnodes;
-    print ("begin = %p, end = %p\n", alloc->pos, alloc->end);
-    return 0;
+    struct node *node = node_at (alloc, level[l].offs);
+    const uint32_t nkeys = node->nkeys + level[l].nkeys;
+
+    node->nkeys = nkeys < UINT16_MAX ? nkeys : UINT16_MAX;
+    node->lastchars |= level[l].lastchars;
+    if (l > 0) {
+        level[l-1].nkeys += level[l].nkeys;
+        level[l-1].lastchars |= level[l].lastchars;
+    }
+    level[l].nkeys = 0;
+    level[l].lastchars = 0;
 }
 
+// Return the slot, which holds the node of LEVEL[L], on the path of the key
+// with the node indices INDEX. ROOT holds the root.
 static
-struct node* alloc_node (struct node_allocator *alloc)
+uint32_t *bulk_ref (const struct bulk_level *level, int l, const unsigned char *index, uint32_t *root, const struct node_allocator *alloc)
 {
+    const struct node *parent;
+
+    if (l == 0)
+        return root;
+    parent = node_at (alloc, level[l-1].offs);
+    if (parent->kind == nodeseg)
+        return &((struct nodeseg *) parent)->child;
+    return node_slot (parent, index[level[l-1].pos]);
+}
+
+// The subtrie of the keys, which share the node indices PREFIX, which
+// trie_build_parallel built on a thread, and which replaces the node of the
+// prefix. NKEYS is the number of keys of the subtrie.
+struct bulk_graft {
+    const unsigned char *prefix;
+    uint32_t root;
+    uint32_t nkeys;
+};
+
+// Push the sorted bulk keys BULK[LO, HI), whose first DEPTH node indices lead
+// to the node referenced by ROOT, and store the return code of trie_push for
+// each key to RC, if RC is not 0.
+// With TR the result of a pushed key is allocated from TR. Without TR the
+// results are not allocated and a key stores its position in BULK as its
+// result, which trie_build_parallel replaces later.
+// A key with a negative input is the prefix of graft -1 - input of GRAFT,
+// whose subtrie replaces the node of the prefix.
+// Return the number of keys pushed.
+//
+// A key shares the nodes of its prefix with the key before it, and its
+// descent resumes at the deepest of these nodes, which the previous key left
+// on a stack of levels. The statistics of the keys are added to a node once,
+// when the last key below the node is pushed, rather than walk from the root
+// for each key.
+static
+int bulk_push (struct trie *tr, struct node_allocator *alloc, uint32_t *root, int depth,
+               struct bulk_key *bulk, int lo, int hi, int maxn, const struct bulk_graft *graft, int *rc)
+{
+    struct bulk_level *level;
+    struct key_path path;
     struct node *node;
-    assert (alloc->pos < alloc->end);
-    node = alloc->pos++;
-    node->result_offs = -1;
-    return node;
+    uint32_t *ref;
+    int npushed = 0, top = 0, fork = depth, used;
+
+    level = malloc ((maxn + 1) * sizeof *level);
+    assert (level);
+    level[0].offs = *root;
+    level[0].pos = depth;
+    level[0].nkeys = 0;
+    level[0].lastchars = 0;
+    for (int b = lo; b < hi; ++b) {
+        struct bulk_key *bk = &bulk[b];
+        const int lcp = fork;
+
+        // The number of indices the next key shares with this key.
+        fork = -1;
+        if (b + 1 < hi) {
+            const struct bulk_key *next = &bulk[b+1];
+            for (fork = 0; fork < next->n && fork < bk->n && next->index[fork] == bk->index[fork]; ++fork)
+                ;
+        }
+        // Leave the nodes, which this key does not share with the previous
+        // key. The nodes of the shared prefix stay on the stack.
+        while (level[top].pos > lcp) {
+            bulk_flush (level, top, alloc);
+            --top;
+        }
+        // The push may split, grow or replace the node at the top. The
+        // copies keep the statistics of the node, so the pending ones have to
+        // be in the node first.
+        bulk_flush (level, top, alloc);
+        ref = bulk_ref (level, top, bk->index, root, alloc);
+        node_push_path (ref, bk->index, level[top].pos, bk->n, fork, alloc);
+        level[top].offs = *ref;
+        for (int k = level[top].pos; k < bk->n; k += used) {
+            const uint32_t offs = node_step_path (node_at (alloc, level[top].offs),
+                                                  bk->index + k, bk->n - k, &used);
+            assert (offs);
+            ++top;
+            level[top].offs = offs;
+            level[top].pos = k + used;
+            level[top].nkeys = 0;
+            level[top].lastchars = 0;
+        }
+        node = node_at (alloc, level[top].offs);
+        if (bk->input < 0) {
+            // The new leaf at the end of the prefix makes room for the
+            // subtrie, whose keys count to the nodes above.
+            const struct bulk_graft *g = &graft[-1 - bk->input];
+            assert (top > 0 && node->nchildren == 0 && node->result_offs < 0);
+            free_node (alloc, level[top].offs);
+            *bulk_ref (level, top, bk->index, root, alloc) = level[top].offs = g->root;
+            level[top-1].nkeys += g->nkeys;
+            level[top-1].lastchars |= node_at (alloc, g->root)->lastchars;
+            continue;
+        }
+        if (node->result_offs >= 0) {
+            // This key was already pushed, by an earlier call or as an
+            // equal key before it in BULK.
+            if (rc)
+                rc[bk->input] = 1;
+            continue;
+        }
+        if (tr) {
+            bk->result = next_result (tr);
+            alloc_result (tr);
+        } else
+            bk->result = b;
+        node->result_offs = bk->result;
+        path.index = (unsigned char *) bk->index;
+        path.n = bk->n;
+        path.naked = bk->naked;
+        ++level[top].nkeys;
+        level[top].lastchars |= key_lastbit (&path);
+        ++npushed;
+        if (rc)
+            rc[bk->input] = 0;
+    }
+    for (; top >= 0; --top)
+        bulk_flush (level, top, alloc);
+    free (level);
+    return npushed;
 }
 
+// Store the keys KEYS and the userdata USERDATA of the pushed bulk keys
+// BULK[0, N) to their results. The keys fill one key block in the order of
+// their nodes.
 static
-int node_push (struct node *root, const char *key, int16_t result_offs, struct node_allocator *alloc)
+void bulk_store (struct trie *tr, const struct bulk_key *bulk, int n, const char *const *keys, const void *const *userdata)
 {
-    struct node *node = root;
-    int index;
-    int stored_naked_percent = 0;
+    struct key_path path;
+    struct result *result;
+    size_t keybytes = 0;
 
-    for (const char *k = key; *k; ++k) {
-        if (*k == '\\') {
-            // This whole if-block is dedicated to reading this backslash.
-            char c;
-            int index = '\\';
-            size_t n = strspn (k, "\\");
-            print ("*k=%c, n=%lu, n/2=%lu, n%%2=%lu\n", *k, n, n/2, n%2);
-            k += n - 1; // Skip the backslashes.
-            c = *(k+1); // Next char.
-            print ("c=%c\n", c);
-            // gmake allows multiple % in a rule, as long as first is naked and
-            // the others are escaped.
-            if (c == '%') {
-                // This whole if-block is dedicated to reading this percent.
-                if (stored_naked_percent && n % 2 == 0) {
-                    // Malformed key with multiple naked %.
-                    // The caller should print an error message and terminate.
-                    return -1;
-                }
-                // The backslashes are immediately followed by a '%'.
-                // Each odd backslash escapes immediately following even
-                // backslash.
-                //
-                // If number of backslashes is odd, then the last backslash
-                // escapes the %. Push half of the backslashes and an escaped
-                // %.
-                //
-                // If the number of backslashes is even, then the % is not
-                // escaped.  Push half of the backslashes and the % (not
-                // escaped).
-
-                // Push half of the backslashes.
-                for (size_t j = n/2; j > 0; --j) {
-                    if (node->next[index] == 0)
-                        node->next[index] = alloc_node (alloc);
-                    node = node->next[index];
-                }
+    for (int b = 0; b < n; ++b)
+        if (bulk[b].result >= 0)
+            keybytes += bulk[b].len + 1;
+    reserve_keys (tr, keybytes);
+    for (int b = 0; b < n; ++b) {
+        const struct bulk_key *bk = &bulk[b];
+        if (bk->result < 0)
+            continue;
+        path.index = (unsigned char *) bk->index;
+        path.n = bk->n;
+        path.naked = bk->naked;
+        result = result_at (tr, bk->result);
+        result_init (result, &path, store_key (tr, keys[bk->input], bk->len + 1), bk->len,
+                     userdata ? userdata[bk->input] : 0);
+        // The keys are as old as if they were pushed in the order of KEYS.
+        result->order = tr->order + bk->input;
+        if (tr->suffix_root && result->suffixlen > 0)
+            suffix_push (tr, &path, bk->result);
+    }
+}
 
-                // Push escaped or naked %.
-                if (n % 2) {
-                    print ("escaped %%\n");
-                    index = escaped_percent;
-                } else {
-                    print ("naked %%\n");
-                    index = '%';
-                    stored_naked_percent = 1;
-                }
+// trie_build_bulk parses all keys first, sorts them by their node indices and
+// pushes them in this order with bulk_push.
+int trie_build_bulk (void *trie, const char *const *keys, const void *const *userdata, int n, int *rc)
+{
+    struct trie *tr = trie;
+    struct bulk_key *bulk;
+    struct key_path path;
+    unsigned char *indices, *pos;
+    size_t nindices = 0;
+    uint32_t root = tr->root;
+    int nbulk = 0, maxn = 0, npushed;
 
-                if (node->next[index] == 0)
-                    node->next[index] = alloc_node (alloc);
-                node = node->next[index];
-                ++k; // Advance k, because we pushed the %.
-                print ("next k = %c\n", *k);
-                continue;
-            }
-            // The backslashes are not immediately followed by a '%'.
-            // None of these backslashes escapes another backslash or %. Push
-            // them all.
-            for (; n > 0; --n) {
-                if (node->next[index] == 0)
-                    node->next[index] = alloc_node (alloc);
-                node = node->next[index];
-            }
+    if (read_only (tr)) {
+        for (int k = 0; rc && k < n; ++k)
+            rc[k] = -2;
+        return -2;
+    }
+    bulk = malloc ((n > 0 ? n : 1) * sizeof *bulk);
+    assert (bulk);
+    // A key has at most as many node indices as chars.
+    for (int k = 0; k < n; ++k) {
+        bulk[k].len = strlen (keys[k]);
+        nindices += bulk[k].len;
+    }
+    indices = malloc (nindices ? nindices : 1);
+    assert (indices);
+    pos = indices;
+    for (int k = 0; k < n; ++k) {
+        path.index = pos;
+        if (key_path_parse (tr, &path, keys[k]) < 0) {
+            if (rc)
+                rc[k] = -1;
             continue;
         }
-        // Not a backslash.
-        if (*k == '%') {
-            if (stored_naked_percent == 1)
-                // Malformed key with multiple naked %.
-                // The caller should print an error message and terminate.
-                return -1;
-            stored_naked_percent = 1;
+        bulk[nbulk].len = bulk[k].len;
+        bulk[nbulk].index = pos;
+        bulk[nbulk].n = path.n;
+        bulk[nbulk].naked = path.naked;
+        bulk[nbulk].input = k;
+        bulk[nbulk].result = -1;
+        if (path.n > maxn)
+            maxn = path.n;
+        pos += path.n;
+        ++nbulk;
+    }
+    bulk_sort (bulk, nbulk);
+    reserve_results (tr, nbulk);
+    npushed = bulk_push (tr, &tr->node_alloc, &root, 0, bulk, 0, nbulk, maxn, 0, rc);
+    bulk_store (tr, bulk, nbulk, keys, userdata);
+    tr->order += n;
+    tr->size += npushed;
+    keys_changed (tr);
+    print (tr->loglevel, "pushed %d of %d keys in bulk, size = %d\n", npushed, n, tr->size);
+    free (bulk);
+    free (indices);
+    return npushed;
+}
+
+// Move the chunks of allocator FROM behind the chunks of ALLOC and free FROM.
+// Return the offset, which the nodes of FROM have in ALLOC, added to their
+// offsets in FROM. The nodes keep the offsets of FROM, the caller relocates
+// them. The free lists of FROM are relocated and added to those of ALLOC.
+static
+uint32_t alloc_append (struct node_allocator *alloc, struct node_allocator *from)
+{
+    uint32_t base;
+
+    // The rest of the last chunk of ALLOC is not used.
+    if (alloc->pos & (chunk_units - 1)) {
+        const uint64_t next = (alloc->pos | (chunk_units - 1)) + 1;
+        // Zero the tail, so that trie_save does not write garbage.
+        memset (node_at (alloc, alloc->pos), 0, (next - alloc->pos) * node_align);
+        alloc->pos = next;
+    }
+    assert (alloc->pos == (uint64_t) alloc->nchunks << chunk_shift);
+    // An offset has to fit in 32 bits.
+    assert (alloc->pos + from->pos <= (uint64_t) UINT32_MAX + 1);
+    base = (uint32_t) alloc->pos;
+    if (alloc->nchunks + from->nchunks > alloc->maxchunks) {
+        alloc->maxchunks = alloc->nchunks + from->nchunks;
+        alloc->chunk = realloc (alloc->chunk, alloc->maxchunks * sizeof *alloc->chunk);
+        assert (alloc->chunk);
+    }
+    memcpy (alloc->chunk + alloc->nchunks, from->chunk, from->nchunks * sizeof *from->chunk);
+    alloc->nchunks += from->nchunks;
+    alloc->pos += from->pos;
+    for (int kind = 0; kind < nkinds; ++kind) {
+        uint32_t *link = &from->free[kind];
+        while (*link) {
+            *link += base;
+            link = &((struct free_node *) node_at (alloc, *link))->next;
         }
-        index = *k;
-        if (node->next[index] == 0)
-            node->next[index] = alloc_node (alloc);
-        node = node->next[index];
+        *link = alloc->free[kind];
+        alloc->free[kind] = from->free[kind];
     }
-    if (node->result_offs >= 0)
-        /* This key was already pushed. Fail. */
-        return 1;
+    free (from->chunk);
+    return base;
+}
 
-    // This key is not present in trie yet.
-    node->result_offs = result_offs;
+// The state of trie_build_parallel, which its threads share.
+struct parallel_build {
+    struct trie *tr;
+    const char *const *keys;
+    const void *const *userdata;
+    int *rc;
+    int n;
+    int nshards;
+    int depth; /* The keys are sharded by their first depth node indices. */
+    struct bulk_key *bulk; /* The parsed keys, by input. */
+    int *shard; /* The shard of each key, nshards for a key shorter than
+                 * depth, -1 for a malformed key. */
+};
+
+// The keys of a thread of trie_build_parallel and their nodes.
+struct bulk_shard {
+    struct parallel_build *pb;
+    int id;
+    int lo, hi; /* The keys to parse. */
+    unsigned char *indices; /* The node indices of the keys lo to hi. */
+    struct bulk_key *bulk; /* The keys of this shard, sorted. */
+    int nbulk;
+    int maxn;
+    struct node_allocator alloc; /* The nodes of this shard. */
+    struct bulk_graft *graft; /* A subtrie per prefix of depth indices. */
+    int ngraft;
+    int npushed;
+    size_t keybytes; /* The bytes of the pushed keys. */
+    uint32_t base; /* See alloc_append. */
+    int32_t resbase; /* The result of the first pushed key. */
+    char *keys; /* The key block of the pushed keys. */
+};
+
+// Return the number of node indices, by whose prefix trie_build_parallel
+// shards the N KEYS to NSHARDS threads.
+// A sample of the keys is sorted. The depth is the least one, at which
+// neither the largest group of the sampled keys with a common prefix nor the
+// sampled keys shorter than the depth, which the calling thread pushes
+// alone, exceed a quarter of the share of a thread. Otherwise, the depth is
+// the one, at which the larger of the two is the least.
+static
+int bulk_depth (const struct trie *tr, const char *const *keys, int n, int nshards)
+{
+    enum {nsample_max = 4096};
+    const int nsample = n < nsample_max ? n : nsample_max;
+    struct bulk_key *sample;
+    struct key_path path;
+    unsigned char *indices, *pos;
+    size_t nindices = 0;
+    int m = 0, maxn = 0, best = 1, bestcost = INT32_MAX, target, *lcp, *nlen;
+
+    sample = malloc ((nsample ? nsample : 1) * sizeof *sample);
+    assert (sample);
+    for (int i = 0; i < nsample; ++i)
+        nindices += strlen (keys[(long) i * n / nsample]);
+    pos = indices = malloc (nindices ? nindices : 1);
+    assert (indices);
+    for (int i = 0; i < nsample; ++i) {
+        path.index = pos;
+        if (key_path_parse (tr, &path, keys[(long) i * n / nsample]) < 0)
+            continue;
+        sample[m].index = pos;
+        sample[m].n = path.n;
+        sample[m].input = i;
+        if (path.n > maxn)
+            maxn = path.n;
+        pos += path.n;
+        ++m;
+    }
+    bulk_sort (sample, m);
+    // lcp[i] is the number of indices sample i shares with sample i - 1.
+    // nlen[d] is the number of samples of d indices.
+    lcp = calloc (m + 1, sizeof *lcp);
+    nlen = calloc (maxn + 1, sizeof *nlen);
+    assert (lcp && nlen);
+    for (int i = 0; i < m; ++i) {
+        ++nlen[sample[i].n];
+        if (i > 0)
+            while (lcp[i] < sample[i].n && lcp[i] < sample[i-1].n
+                   && sample[i].index[lcp[i]] == sample[i-1].index[lcp[i]])
+                ++lcp[i];
+    }
+    target = m / (4 * nshards) > 0 ? m / (4 * nshards) : 1;
+    for (int d = 1, nshort = nlen[0]; d <= maxn && nshort < bestcost; nshort += nlen[d++]) {
+        int group = 0, maxgroup = 0;
+        // The samples with a common prefix of D indices are adjacent.
+        for (int i = 0; i < m; ++i) {
+            if (sample[i].n < d)
+                group = 0;
+            else if (group > 0 && lcp[i] >= d)
+                ++group;
+            else
+                group = 1;
+            if (group > maxgroup)
+                maxgroup = group;
+        }
+        if ((maxgroup > nshort ? maxgroup : nshort) < bestcost) {
+            bestcost = maxgroup > nshort ? maxgroup : nshort;
+            best = d;
+        }
+        if (bestcost <= target)
+            break;
+    }
+    free (nlen);
+    free (lcp);
+    free (indices);
+    free (sample);
+    return best;
+}
+
+// Parse the keys LO to HI of the shard and choose their shards.
+static
+void *bulk_parse_thread (void *arg)
+{
+    struct bulk_shard *s = arg;
+    const struct parallel_build *pb = s->pb;
+    struct key_path path;
+    unsigned char *pos;
+    size_t nindices = 0;
+
+    for (int k = s->lo; k < s->hi; ++k) {
+        pb->bulk[k].len = strlen (pb->keys[k]);
+        nindices += pb->bulk[k].len;
+    }
+    s->indices = pos = malloc (nindices ? nindices : 1);
+    assert (s->indices);
+    for (int k = s->lo; k < s->hi; ++k) {
+        struct bulk_key *bk = &pb->bulk[k];
+        uint32_t hash = prefix_hash_init;
+
+        path.index = pos;
+        if (key_path_parse (pb->tr, &path, pb->keys[k]) < 0) {
+            pb->shard[k] = -1;
+            if (pb->rc)
+                pb->rc[k] = -1;
+            continue;
+        }
+        bk->index = pos;
+        bk->n = path.n;
+        bk->naked = path.naked;
+        bk->input = k;
+        bk->result = -1;
+        pos += path.n;
+        if (path.n < pb->depth) {
+            pb->shard[k] = pb->nshards;
+            continue;
+        }
+        for (int d = 0; d < pb->depth; ++d)
+            hash = prefix_hash (hash, path.index[d]);
+        pb->shard[k] = hash % pb->nshards;
+    }
     return 0;
 }
 
+// Sort the keys of the shard and push the keys of each prefix of depth
+// indices to a subtrie of their own in the allocator of the shard.
 static
-const struct result **node_find_fuzzy (const struct result **result, const struct node *node, const char *key, const struct result *results_begin, int inside_wildcard, int wildcard_spent, int depth)
+void *bulk_build_thread (void *arg)
 {
-    const struct node *next;
-    int index;
-    const struct result **r;
+    struct bulk_shard *s = arg;
+    const struct parallel_build *pb = s->pb;
+    const int depth = pb->depth;
+    int hi;
 
+    for (int k = 0; k < pb->n; ++k)
+        s->nbulk += pb->shard[k] == s->id;
+    if (s->nbulk == 0)
+        return 0;
+    s->bulk = malloc (s->nbulk * sizeof *s->bulk);
+    s->graft = malloc (s->nbulk * sizeof *s->graft);
+    assert (s->bulk && s->graft);
+    s->nbulk = 0;
+    for (int k = 0; k < pb->n; ++k)
+        if (pb->shard[k] == s->id) {
+            s->bulk[s->nbulk++] = pb->bulk[k];
+            if (pb->bulk[k].n > s->maxn)
+                s->maxn = pb->bulk[k].n;
+        }
+    bulk_sort (s->bulk, s->nbulk);
+    alloc_init (&s->alloc, s->nbulk, pb->tr->loglevel);
+    // Offset 0 means no child. The first node only holds offset 0, so that
+    // no node of a subtrie has it.
+    alloc_node (&s->alloc, node4);
+    for (int lo = 0; lo < s->nbulk; lo = hi) {
+        struct bulk_graft *g = &s->graft[s->ngraft++];
+        for (hi = lo + 1; hi < s->nbulk && memcmp (s->bulk[hi].index, s->bulk[lo].index, depth) == 0; ++hi)
+            ;
+        g->prefix = s->bulk[lo].index;
+        g->root = alloc_node (&s->alloc, node4);
+        g->nkeys = bulk_push (0, &s->alloc, &g->root, depth, s->bulk, lo, hi, s->maxn, 0, pb->rc);
+        s->npushed += g->nkeys;
+    }
+    for (int b = 0; b < s->nbulk; ++b)
+        if (s->bulk[b].result >= 0)
+            s->keybytes += s->bulk[b].len + 1;
+    return 0;
+}
 
-    print ("%*skey = %s, inside wildcard = %d, wildcard spent = %d\n", depth, "", key, inside_wildcard, wildcard_spent);
-    // Ensure recursion is limited to 3.
-    // This function cannot afford deep recursion, because deep recursion would
-    // prevent long keys.
-    assert (depth < 3);
-    assert (wildcard_spent || depth == 0);
-    for (; *key; ++key) {
-        assert (node);
-        // First see if inside_wildcard.
-        if (inside_wildcard) {
-            print ("%*strying %c exactly inside wirdcard\n", depth, "", *key);
-            assert (wildcard_spent);
-            // Then see if the node has this character.
-            index = *key == '%' ? escaped_percent : *key;
-            next = node->next[index];
-            if (next) {
-                print ("%*s%c matches exactly\n", depth, "", *key);
-                // No more inside wildcard.
-                r = node_find_fuzzy (result, next, key+1, results_begin, 0, 1, depth+1);
-                if (r > result)
-                    result = r;
+// Number the results of the pushed keys of the shard from resbase, relocate
+// the nodes of the shard, which moved to the allocator of the trie, and
+// store the keys and the userdata to the results.
+static
+void *bulk_relocate_thread (void *arg)
+{
+    struct bulk_shard *s = arg;
+    const struct parallel_build *pb = s->pb;
+    const struct node_allocator *alloc = &pb->tr->node_alloc;
+    uint32_t local[64], *stack = local, child;
+    int nstack = 0, maxstack = sizeof local / sizeof *local;
+    int32_t next = s->resbase;
+    struct key_path path;
+    struct result *result;
+    char *keys = s->keys;
+
+    for (int b = 0; b < s->nbulk; ++b)
+        if (s->bulk[b].result >= 0)
+            s->bulk[b].result = next++;
+    for (int g = 0; g < s->ngraft; ++g) {
+        stack[nstack++] = s->graft[g].root;
+        s->graft[g].root += s->base;
+        while (nstack > 0) {
+            struct node *node = node_at (alloc, stack[--nstack] + s->base);
+            // A node holds the position of its key in bulk.
+            if (node->result_offs >= 0)
+                node->result_offs = s->bulk[node->result_offs].result;
+            for (int k = 0; (child = node_next_child (node, &k)); ++k) {
+                *node_child_slot (node, k) = child + s->base;
+                if (nstack == maxstack) {
+                    uint32_t *bigger = malloc (2 * maxstack * sizeof *bigger);
+                    assert (bigger);
+                    memcpy (bigger, stack, nstack * sizeof *stack);
+                    if (stack != local)
+                        free (stack);
+                    stack = bigger;
+                    maxstack *= 2;
+                }
+                stack[nstack++] = child;
             }
-            print ("%*s%c does not match, continue inside wildcard\n", depth, "", *key);
-            // Continue inside wildcard.
-            // Keep node intact.
+        }
+    }
+    if (stack != local)
+        free (stack);
+    for (int b = 0; b < s->nbulk; ++b) {
+        const struct bulk_key *bk = &s->bulk[b];
+        if (bk->result < 0)
+            continue;
+        path.index = (unsigned char *) bk->index;
+        path.n = bk->n;
+        path.naked = bk->naked;
+        result = result_at (pb->tr, bk->result);
+        memcpy (keys, pb->keys[bk->input], bk->len + 1);
+        result_init (result, &path, keys, bk->len, pb->userdata ? pb->userdata[bk->input] : 0);
+        result->order = pb->tr->order + bk->input;
+        keys += bk->len + 1;
+    }
+    return 0;
+}
+
+// Run FN for each of the N SHARDS, each on a thread of its own, the first one
+// on the calling thread.
+static
+void run_shards (struct bulk_shard *shards, int n, void *(*fn) (void *))
+{
+    pthread_t *tid = malloc (n * sizeof *tid);
+    int rc;
+
+    assert (tid);
+    for (int k = 1; k < n; ++k) {
+        rc = pthread_create (&tid[k], 0, fn, &shards[k]);
+        assert (rc == 0);
+    }
+    fn (&shards[0]);
+    for (int k = 1; k < n; ++k) {
+        rc = pthread_join (tid[k], 0);
+        assert (rc == 0);
+    }
+    free (tid);
+}
+
+// trie_build_parallel shards the keys by the prefix of their first depth node
+// indices, see bulk_depth, so that all keys, which share the prefix, go to
+// one shard. The threads parse the keys, each a range of KEYS, then each
+// thread sorts the keys of its shard and builds a subtrie of the keys of each
+// prefix, like trie_build_bulk, in an allocator of its own. The chunks of the
+// allocators move to the allocator of the trie, and the threads relocate the
+// nodes of their shards. At last, the calling thread pushes the keys shorter
+// than depth and the prefixes, and a subtrie replaces the node at the end of
+// its prefix. The order of a key is its index in KEYS, wherever it is pushed.
+int trie_build_parallel (void *trie, const char *const *keys, const void *const *userdata, int n, int nthreads, int *rc)
+{
+    struct trie *tr = trie;
+    struct parallel_build pb;
+    struct bulk_shard *shards;
+    struct bulk_key *top;
+    struct bulk_graft *graft;
+    struct key_path path;
+    uint32_t root = tr->root;
+    size_t keybytes = 0;
+    int ntop = 0, ngraft = 0, maxn = 0, npushed = 0;
+
+    if (nthreads > n)
+        nthreads = n;
+    // The subtries replace nodes, which no other key uses.
+    if (nthreads < 2 || tr->size > 0 || read_only (tr))
+        return trie_build_bulk (trie, keys, userdata, n, rc);
+    pb.tr = tr;
+    pb.keys = keys;
+    pb.userdata = userdata;
+    pb.rc = rc;
+    pb.n = n;
+    pb.nshards = nthreads;
+    pb.depth = bulk_depth (tr, keys, n, nthreads);
+    pb.bulk = malloc (n * sizeof *pb.bulk);
+    pb.shard = malloc (n * sizeof *pb.shard);
+    shards = calloc (nthreads, sizeof *shards);
+    assert (pb.bulk && pb.shard && shards);
+    for (int t = 0; t < nthreads; ++t) {
+        shards[t].pb = &pb;
+        shards[t].id = t;
+        shards[t].lo = (long) n * t / nthreads;
+        shards[t].hi = (long) n * (t + 1) / nthreads;
+    }
+    run_shards (shards, nthreads, bulk_parse_thread);
+    run_shards (shards, nthreads, bulk_build_thread);
+
+    // The pushed keys of the shards take fresh results and the first bytes of
+    // one key block, shard after shard.
+    reserve_results (tr, n + tr->nfree_results);
+    for (int t = 0; t < nthreads; ++t)
+        keybytes += shards[t].keybytes;
+    for (int k = 0; k < n; ++k)
+        if (pb.shard[k] == nthreads)
+            keybytes += pb.bulk[k].len + 1;
+    reserve_keys (tr, keybytes);
+    for (int t = 0; t < nthreads; ++t) {
+        struct bulk_shard *s = &shards[t];
+        if (s->nbulk == 0)
             continue;
+        s->base = alloc_append (&tr->node_alloc, &s->alloc);
+        free_node (&tr->node_alloc, s->base);
+        s->resbase = tr->nresults;
+        tr->nresults += s->npushed;
+        s->keys = tr->keys_pos;
+        tr->keys_pos += s->keybytes;
+        tr->keys_left -= s->keybytes;
+        npushed += s->npushed;
+        ngraft += s->ngraft;
+    }
+    run_shards (shards, nthreads, bulk_relocate_thread);
+
+    // The keys shorter than depth and the prefixes of the subtries.
+    top = malloc ((n + ngraft) * sizeof *top);
+    graft = malloc ((ngraft ? ngraft : 1) * sizeof *graft);
+    assert (top && graft);
+    for (int k = 0; k < n; ++k)
+        if (pb.shard[k] == nthreads) {
+            top[ntop++] = pb.bulk[k];
+            if (pb.bulk[k].n > maxn)
+                maxn = pb.bulk[k].n;
         }
-        assert (inside_wildcard == 0);
-        // Then see if wildcard was used already.
-        if (wildcard_spent) {
-            // Not inside wildcard and wildcard was used already.
-            // Every character has to match exactly.
-            print ("%*strying %c exactly outside wirdcard\n", depth, "", *key);
-            index = *key == '%' ? escaped_percent : *key;
-            next = node->next[index];
-            if (next == 0) {
-                // No match.
-                // Need to backtrack and resume from the prior fork and take
-                // the other path.
-                print ("%*s%c does not match, wildcard used already, no match\n", depth, "", *key);
-                return result;
+    ngraft = 0;
+    for (int t = 0; t < nthreads; ++t)
+        for (int g = 0; g < shards[t].ngraft; ++g) {
+            graft[ngraft] = shards[t].graft[g];
+            top[ntop].index = graft[ngraft].prefix;
+            top[ntop].n = pb.depth;
+            top[ntop].naked = -1;
+            top[ntop].input = -1 - ngraft;
+            top[ntop].result = -1;
+            top[ntop].len = 0;
+            ++ntop;
+            ++ngraft;
+        }
+    if (pb.depth > maxn)
+        maxn = pb.depth;
+    bulk_sort (top, ntop);
+    npushed += bulk_push (tr, &tr->node_alloc, &root, 0, top, 0, ntop, maxn, graft, rc);
+    bulk_store (tr, top, ntop, keys, userdata);
+    if (tr->suffix_root)
+        for (int t = 0; t < nthreads; ++t)
+            for (int b = 0; b < shards[t].nbulk; ++b) {
+                const struct bulk_key *bk = &shards[t].bulk[b];
+                if (bk->result < 0 || result_at (tr, bk->result)->suffixlen <= 0)
+                    continue;
+                path.index = (unsigned char *) bk->index;
+                path.n = bk->n;
+                path.naked = bk->naked;
+                suffix_push (tr, &path, bk->result);
             }
-            print ("%*s%c matches outside wildcard, continue matching exactly\n", depth, "", *key);
-            node = next;
+    tr->order += n;
+    tr->size += npushed;
+    keys_changed (tr);
+    print (tr->loglevel, "pushed %d of %d keys on %d threads at depth %d, size = %d\n",
+           npushed, n, nthreads, pb.depth, tr->size);
+    for (int t = 0; t < nthreads; ++t) {
+        free (shards[t].graft);
+        free (shards[t].bulk);
+        free (shards[t].indices);
+    }
+    free (graft);
+    free (top);
+    free (shards);
+    free (pb.shard);
+    free (pb.bulk);
+    return npushed;
+}
+
+// trie_freeze lays the nodes out in one block. The top levels, up to
+// freeze_hot_bytes of nodes, come first in breadth first order, so that the
+// nodes, which every lookup visits, share a few pages and lines. Each subtree
+// below them follows in depth first order, so that a descent moves forward in
+// memory and the first child of a small node is often on the line of the node.
+// A node of at most a line does not straddle two lines. The next node4 fills
+// the rest of a line, which a node skips this way. Like alloc_node, no node
+// straddles two chunks.
+enum {freeze_hot_bytes = 32 * 1024, cache_line = 64,
+      line_units = cache_line / node_align};
+
+int trie_freeze (void *trie)
+{
+    struct trie *tr = trie;
+    struct node_allocator *alloc = &tr->node_alloc;
+    // Every node takes at least the units of a node4.
+    const size_t maxnodes = alloc->pos / (node_size[node4] / node_align) + 1;
+    uint32_t *order, *stack, *newoffs, child;
+    size_t norder = 0, nhot, nstack = 0, nbytes;
+    uint64_t nunits = 0, hole = 0, holeunits = 0;
+    uint32_t nchunks;
+    char **chunk, *block;
+
+    if (read_only (tr))
+        return 1;
+    order = malloc (maxnodes * sizeof *order);
+    assert (order);
+    stack = malloc (maxnodes * sizeof *stack);
+    assert (stack);
+    // Indexed by the old offset of a node.
+    newoffs = malloc (alloc->pos * sizeof *newoffs);
+    assert (newoffs);
+
+    // The root stays at offset 0.
+    order[norder++] = tr->root;
+    if (tr->suffix_root)
+        order[norder++] = tr->suffix_root;
+    nbytes = 0;
+    for (nhot = 0; nhot < norder && nbytes < freeze_hot_bytes; ++nhot) {
+        const struct node *node = node_at (alloc, order[nhot]);
+        nbytes += node_size[node->kind];
+        for (int k = 0; (child = node_next_child (node, &k)); ++k)
+            order[norder++] = child;
+    }
+    // order[nhot, norder) are the roots of the subtrees below the top levels.
+    // They go on the stack, the first one on top.
+    for (size_t k = norder; k > nhot; --k)
+        stack[nstack++] = order[k-1];
+    norder = nhot;
+    while (nstack > 0) {
+        const struct node *node = node_at (alloc, order[norder++] = stack[--nstack]);
+        const size_t first = nstack;
+        for (int k = 0; (child = node_next_child (node, &k)); ++k)
+            stack[nstack++] = child;
+        // The first child goes on top.
+        for (size_t a = first, b = nstack; a + 1 < b; ++a, --b) {
+            const uint32_t tmp = stack[a];
+            stack[a] = stack[b-1];
+            stack[b-1] = tmp;
+        }
+    }
+
+    for (size_t k = 0; k < norder; ++k) {
+        const uint32_t units = node_size[node_at (alloc, order[k])->kind] / node_align;
+        if (units <= holeunits) {
+            newoffs[order[k]] = (uint32_t) hole;
+            hole += units;
+            holeunits -= units;
             continue;
         }
-        print ("%*ssee if the node has a %%\n", depth, "");
-        // Not inside wildcard and wildcard is still available.
-        // Then see if the node has a wildcard.
-        next = node->next['%'];
+        if (units <= line_units && nunits % line_units + units > line_units) {
+            hole = nunits;
+            nunits = (nunits | (line_units - 1)) + 1;
+            holeunits = nunits - hole;
+        }
+        if ((nunits & (chunk_units - 1)) + units > chunk_units)
+            nunits = (nunits | (chunk_units - 1)) + 1;
+        newoffs[order[k]] = (uint32_t) nunits;
+        nunits += units;
+    }
+    // The gaps are zeroed, so that trie_save does not write garbage.
+    nbytes = (nunits * node_align + cache_line - 1) / cache_line * cache_line;
+    block = aligned_alloc (cache_line, nbytes);
+    assert (block);
+    memset (block, 0, nbytes);
+    for (size_t k = 0; k < norder; ++k) {
+        const struct node *node = node_at (alloc, order[k]);
+        struct node *copy = (struct node *) (block + (size_t) newoffs[order[k]] * node_align);
+        memcpy (copy, node, node_size[node->kind]);
+        for (int i = 0; (child = node_next_child (node, &i)); ++i)
+            *node_child_slot (copy, i) = newoffs[child];
+    }
+    nchunks = (nunits + chunk_units - 1) / chunk_units;
+    chunk = malloc (nchunks * sizeof *chunk);
+    assert (chunk);
+    for (uint32_t k = 0; k < nchunks; ++k)
+        chunk[k] = block + (size_t) k * chunk_units * node_align;
+
+    print (tr->loglevel, "froze %zu nodes, %zu of them in the top levels, to %zu bytes from %zu bytes\n",
+           norder, nhot, nbytes, (size_t) alloc->pos * node_align);
+    if (tr->suffix_root)
+        tr->suffix_root = newoffs[tr->suffix_root];
+    alloc_free (alloc);
+    alloc->chunk = chunk;
+    alloc->nchunks = alloc->maxchunks = nchunks;
+    alloc->pos = nunits;
+    memset (alloc->free, 0, sizeof alloc->free);
+    tr->frozen = block;
+    free (newoffs);
+    free (stack);
+    free (order);
+    return 0;
+}
+
+static
+int integrity (const struct result **result, const char *key)
+{
+    const struct result *r, **begin = result;
+    const size_t klen = strlen (key);
+
+    for (; *result; ++result) {
+        r = *result;
+        if (r->suffixlen < 0) {
+            // An exact match. Exact match always beats fuzzy match.
+            assert (result == begin);
+            assert ((size_t) r->prefixlen == klen);
+        } else
+            // The naked % matches at least one char.
+            assert ((size_t) (r->prefixlen + r->suffixlen) < klen);
+    }
+    return 1;
+}
+
+// A key to look up in a trie, whose wildcard W is not %, with W and % swapped,
+// so that its chars compare to the node indices like in a trie of %.
+struct swapped_key {
+    char *key; /* 0 if the key is not swapped. */
+    char local[256];
+};
+
+// Return KEY as TR looks it up. swapped_key_free frees SK.
+static
+const char *swap_key (struct swapped_key *sk, const struct trie *tr, const char *key)
+{
+    size_t klen;
+
+    sk->key = 0;
+    if (tr->wildcard == '%')
+        return key;
+    klen = strlen (key);
+    sk->key = klen < sizeof sk->local ? sk->local : malloc (klen + 1);
+    assert (sk->key);
+    for (size_t k = 0; k <= klen; ++k)
+        if ((unsigned char) key[k] == tr->wildcard)
+            sk->key[k] = '%';
+        else
+            sk->key[k] = key[k] == '%' ? tr->wildcard : key[k];
+    return sk->key;
+}
+
+static
+void swapped_key_free (struct swapped_key *sk)
+{
+    if (sk->key != sk->local)
+        free (sk->key);
+}
+
+const struct result **trie_find_all_r (const void *trie, const char *key, const struct result **found)
+{
+    const struct trie *tr = trie;
+    const struct result **r, **begin = found;
+    const struct result **scratch = found + tr->nresults + 1;
+    const char *del = "", *orig = key;
+    const struct node *next;
+    struct swapped_key sk;
+
+    stats_begin ();
+    key = swap_key (&sk, tr, key);
+    if (tr->suffix_root && (r = node_find_suffix (tr, key, found, &begin)))
+        ;
+    else if (tr->flags & trie_multi_wildcard)
+        r = node_find_multi (tr, key, found, &begin);
+    else if (tr->flags & trie_engine_nfa)
+        r = node_find_nfa (tr, key, found, &begin);
+    else {
+        // Exact match always beats fuzzy match.
+        next = node_find_exact (tr, node_at (&tr->node_alloc, tr->root), key);
         if (next) {
-            print ("%*sfound %%, recursing\n", depth, "");
-            r = node_find_fuzzy (result, next, key+1, results_begin, 1, 1, depth+1);
-            if (r > result)
-                result = r;
+            *begin++ = result_at (tr, next->result_offs);
+            print (tr->loglevel, "found exact match %s\n", (*found)->key);
+            assert (strcmp ((*found)->key, orig) == 0 || strchr (orig, tr->wildcard));
         }
 
-        print ("%*sno %%, matching %c exactly\n", depth, "", *key);
-        // Then see if the node has this character.
-        index = *key == '%' ? escaped_percent : *key;
-        next = node->next[index];
-        if (next == 0)
-            return result; // No match.
-        print ("%*sno %%, %c matches exactly\n", depth, "", *key);
-        node = next;
+        print (tr->loglevel, "finding fuzzy matches of %s\n", key);
+        r = node_find_fuzzy (begin, node_at (&tr->node_alloc, tr->root), key, tr, 0, 0, 0);
     }
-    print ("%*skey exhausted\n", depth, "");
-    assert (*key == '\0');
+    /* If there is exact match, then 'begin' points to element 1 and the exact
+     * match is located in element 0. Sort starting from 'begin' to ensure the
+     * exact match stays in element 0. */
+    sort_results (tr, begin, r, scratch);
+    *r = 0; // Null terminator.
+    stats_end (tr, r - found);
+    if (trace_enabled && tr->loglevel) {
+        print (tr->loglevel, "sorted results ");
+        for (r = found; *r; ++r, del = ", ")
+            print (tr->loglevel, "%s%s", del, (*r)->key);
+        print (tr->loglevel, "\n");
+    }
+    assert (integrity (found, key));
+    swapped_key_free (&sk);
+    return found;
+}
 
-    /* If wildcard was not spent, then this is the exact match. Ignore it to
-     * avoid duplication of the exact match in results, because trie_find_all
-     * calls node_find_exact. node_find_fuzzy only finds fuzzy matches. */
-    if (node->result_offs >= 0 && wildcard_spent) {
-        const struct result *res = results_begin + node->result_offs;
-        print ("%*sfound %s\n", depth, "", res->key);
-        *result++ = res;
+// Store the matches FOUND of KEY to the cache entry E, unless they take
+// more than cache_entry_max bytes.
+static
+void cache_store (struct trie *tr, struct cache_entry *e, const char *key, size_t klen, uint32_t hash, const struct result **found)
+{
+    const struct result **r;
+    size_t nfound, sz;
+
+    for (r = found; *r; ++r)
+        ;
+    nfound = r - found + 1; // + 1 for null terminator.
+    sz = nfound * sizeof *found + klen + 1;
+    if (sz > cache_entry_max) {
+        e->generation = 0;
+        return;
+    }
+    if (sz > e->size) {
+        free (e->found);
+        e->found = malloc (sz);
+        assert (e->found);
+        e->size = sz;
+    }
+    memcpy (e->found, found, nfound * sizeof *found);
+    e->key = memcpy (e->found + nfound, key, klen + 1);
+    e->hash = hash;
+    e->generation = tr->generation;
+}
+
+const struct result **trie_find_all (void *trie, const char *key)
+{
+    struct trie *tr = trie;
+    struct cache_entry *e;
+    const char *s;
+    uint32_t hash = prefix_hash_init;
+
+    if ((tr->flags & trie_lookup_cache) == 0)
+        return trie_find_all_r (trie, key, tr->found);
+    if (tr->cache == 0) {
+        tr->cache = calloc (cache_slots, sizeof *tr->cache);
+        assert (tr->cache);
     }
+    for (s = key; *s; ++s)
+        hash = prefix_hash (hash, (unsigned char) *s);
+    e = &tr->cache[hash % cache_slots];
+    if (e->generation == tr->generation && e->hash == hash && strcmp (e->key, key) == 0) {
+        ++tr->cache_hits;
+        return e->found;
+    }
+    ++tr->cache_misses;
+    trie_find_all_r (trie, key, tr->found);
+    cache_store (tr, e, key, s - key, hash, tr->found);
+    return tr->found;
+}
 
-    return result;
+void trie_cache_stats (const void *trie, size_t *hits, size_t *misses)
+{
+    const struct trie *tr = trie;
+    *hits = tr->cache_hits;
+    *misses = tr->cache_misses;
+}
+
+size_t trie_found_size (const void *trie)
+{
+    const struct trie *tr = trie;
+    return found_size (tr->nresults);
 }
 
-static
-const struct node *node_find_exact (const struct node *node, const char *key)
+const char *trie_stem (const struct result *r, const char *key, size_t keylen, size_t *stemlen)
 {
-    const struct node *next;
-    int index;
+    if (r->suffixlen < 0)
+        return 0;
+    assert ((size_t) (r->prefixlen + r->suffixlen) < keylen);
+    *stemlen = keylen - r->prefixlen - r->suffixlen;
+    return key + r->prefixlen;
+}
 
+const struct result *trie_find (void *trie, const char *key)
+{
+    return *trie_find_all (trie, key);
+}
 
-    print ("key = %s\n", key);
-    for (; *key; ++key) {
-        assert (node);
+const struct result *trie_find_r (const void *trie, const char *key, const struct result **found)
+{
+    return *trie_find_all_r (trie, key, found);
+}
 
-        print ("matching %c exactly\n", *key);
-        // Then see if the node has this character.
-        index = *key == '%' ? escaped_percent : *key;
-        next = node->next[index];
-        if (next == 0)
-            return 0; // No match.
-        print ("no %%, %c matches exactly\n", *key);
-        node = next;
-    }
-    print ("key exhausted\n");
+// A key of a batch lookup.
+struct batch_key {
+    // The first 16 chars of the key, zero padded, as big endian numbers,
+    // which order like the chars.
+    uint64_t prefix[2];
+    const char *key;
+    size_t klen;
+    int index; // The index of the key in the caller's array.
+};
 
-    if (node->result_offs >= 0)
-        return node;
+static
+void batch_key_init (struct batch_key *b, const char *key, int index)
+{
+    b->key = key;
+    b->klen = strlen (key);
+    b->index = index;
+    b->prefix[0] = b->prefix[1] = 0;
+    for (size_t k = 0; k < 16 && k < b->klen; ++k)
+        b->prefix[k/8] |= (uint64_t) (unsigned char) key[k] << (56 - k%8*8);
+}
 
+// Order batch keys by their first 16 chars.
+// The order of the rest does not matter for correctness, and this compare
+// does not chase the key pointers.
+static
+int batch_keycmp (const void *x, const void *y)
+{
+    const struct batch_key *a = x, *b = y;
+    if (a->prefix[0] != b->prefix[0])
+        return a->prefix[0] < b->prefix[0] ? -1 : 1;
+    if (a->prefix[1] != b->prefix[1])
+        return a->prefix[1] < b->prefix[1] ? -1 : 1;
     return 0;
 }
 
+// Return the length of the common prefix of A and B.
 static
-int resultcmp (const void *x, const void *y)
+size_t common_prefix (const char *a, const char *b)
 {
-    const struct result *a = *(const struct result **) x;
-    const struct result *b = *(const struct result **) y;
-    const char *xkey = a->key, *ykey = b->key;
-    size_t xlen, ylen;
-
-
-    print ("xkey = %s, ykey = %s\n", xkey, ykey);
-
-    xlen = strlen (xkey);
-    ylen = strlen (ykey);
-
-    // x and y are reversed, because the longest key is the most specific
-    // match.
-    if (xlen < ylen)
-        return 1;
-    if (ylen < xlen)
-        return -1;
-
-    /* If the keys are of equal length return the one that was pushed first. */
-    assert (a->order >= 0);
-    assert (b->order >= 0);
-    assert (a->order != b->order);
-    if (a->order < b->order)
-        return -1;
-    return 1;
+    size_t k;
+    for (k = 0; a[k] && a[k] == b[k]; ++k)
+        ;
+    return k;
 }
 
+// Continue the exact descent of KEY from PATH[DEPTH].
+// PATH[k] is the node reached by the first k chars of KEY, or 0 if the first
+// k chars end inside a segment.
+// Return the number of chars of KEY the descent consumed.
 static
-int node_has_prefer_exact_match (const struct node *node, const char *key,
-    const struct result *results_begin, int inside_wildcard,
-    int wildcard_spent, int depth)
+size_t path_descend (const struct trie *tr, const char *key, size_t klen, const struct node **path, size_t depth)
 {
     const struct node *next;
-    int index;
-
-    if (*key == '\0') {
-        print ("%*skey exhausted, result_offs = %d\n", depth, "", node->result_offs);
-        if (node->result_offs >= 0) {
-            const struct result *res = results_begin + node->result_offs;
-            print ("%*sfound %s\n", depth, "", res->key);
-            return 1;
-        }
-        return 0;
-    }
+    const char *k;
 
-    index = *key == '%' ? escaped_percent : *key;
-    next = node->next[index];
-    print ("%*skey=%s, inside_wildcard=%d, wildcard_spent=%d, next[%c]=%p\n", depth, "", key, inside_wildcard, wildcard_spent, *key, next);
-    if (next && node_has_prefer_exact_match (next, key+1, results_begin, 0, wildcard_spent, depth+1)) {
-        print ("%*s%c is found\n", depth, "", *key);
-        return 1;
-    }
-    if (inside_wildcard) {
-        print ("%*smatched %c to %%\n", depth, "", *key);
-        return node_has_prefer_exact_match (node, key+1, results_begin, 1, wildcard_spent, depth+1);
-    }
-    if (wildcard_spent) {
-        print ("%*s%% was already used, backtrack key\n", depth, "");
-        return 0;
-    }
-    next = node->next['%'];
-    print ("%*snext[%%]=%p\n", depth, "", next);
-    if (next == 0) {
-        print ("%*sbacktrack key\n", depth, "");
-        return 0;
+    while (depth < klen) {
+        k = key + depth;
+        next = node_step (&tr->node_alloc, path[depth], &k);
+        if (next == 0)
+            break;
+        while (++depth < (size_t) (k - key))
+            path[depth] = 0;
+        path[depth] = next;
     }
-    print ("%*smatching %c to %%\n", depth, "", *key);
-    return node_has_prefer_exact_match (next, key+1, results_begin, 1, 1, depth+1);
+    return depth;
 }
 
+// Find all matches of KEY on PATH, the exact descent of KEY of DEPTH chars.
+// This is what trie_find_all_r does, except that the nodes along the path,
+// which node_find_exact and the outermost loop of node_find_fuzzy visit, are
+// given.
 static
-int node_has_prefer_fuzzy_match (const struct node *node, const char *key, const struct result *results_begin, int inside_wildcard, int wildcard_spent, int depth)
+const struct result **find_all_on_path (const struct trie *tr, const char *key, size_t klen, const struct node **path, size_t depth, const struct result **found)
 {
+    const struct result **r, **begin = found;
+    const struct result **scratch = found + tr->nresults + 1;
     const struct node *next;
-    int index;
 
+    // Exact match always beats fuzzy match.
+    if (depth == klen && path[depth]->result_offs >= 0)
+        *begin++ = result_at (tr, path[depth]->result_offs);
 
-    print ("%*skey = %s, inside wildcard = %d, wildcard spent = %d\n", depth, "", key, inside_wildcard, wildcard_spent);
-    // Ensure recursion is limited to 3.
-    // This function cannot afford deep recursion, because deep recursion would
-    // prevent long keys.
-    assert (depth < 3);
-    assert (wildcard_spent || depth == 0);
-    for (; *key; ++key) {
-        assert (node);
-        // First see if inside_wildcard.
-        if (inside_wildcard) {
-            print ("%*strying %c exactly inside wirdcard\n", depth, "", *key);
-            assert (wildcard_spent);
-            // Then see if the node has this character.
-            index = *key == '%' ? escaped_percent : *key;
-            next = node->next[index];
-            if (next) {
-                print ("%*s%c matches\n", depth, "", *key);
-                // No more inside wildcard.
-                if (node_has_prefer_fuzzy_match (next, key+1, results_begin, 0, 1, depth+1))
-                    return 1;
-            }
-            print ("%*s%c does not match, continue inside wildcard\n", depth, "", *key);
-            // Continue inside wildcard.
-            // Keep node intact.
-            continue;
-        }
-        assert (inside_wildcard == 0);
-        // Then see if wildcard was used already.
-        if (wildcard_spent) {
-            // Not inside wildcard and wildcard was used already.
-            // Every character has to match exactly.
-            print ("%*strying %c exactly outside wirdcard\n", depth, "", *key);
-            index = *key == '%' ? escaped_percent : *key;
-            next = node->next[index];
-            if (next == 0) {
-                // No match.
-                // Need to backtrack and resume from the prior fork and take
-                // the other path.
-                print ("%*s%c does not match, wildcard used already, no match\n", depth, "", *key);
-                return 0;
+    // A % at any node along the path matches a part of the rest of the key.
+    r = begin;
+    for (size_t k = 0; k <= depth && k < klen; ++k) {
+        next = path[k] ? node_child (&tr->node_alloc, path[k], '%') : 0;
+        if (next)
+            r = node_find_fuzzy (r, next, key+k+1, tr, 1, 1, 1);
+    }
+    sort_results (tr, begin, r, scratch);
+    *r = 0; // Null terminator.
+    assert (integrity (found, key));
+    return r;
+}
+
+int trie_find_all_batch (const void *trie, const char *const *keys, int n, const struct result ***lists, const struct result **out, size_t outsize)
+{
+    const struct trie *tr = trie;
+    const struct result **found, **end;
+    const struct node **path, *next;
+    struct batch_key *batch;
+    size_t maxklen = 0, depth = 0, resume, used = 0, nfound;
+    int k;
+
+    // The descent along the path of a key is for one % per key and compares
+    // the chars of the key as they are, so the other tries look up each key
+    // on its own.
+    if (tr->flags & trie_engine_nfa || tr->wildcard != '%') {
+        found = malloc (found_size (tr->nresults) * sizeof *found);
+        assert (found);
+        for (k = 0; k < n; ++k) {
+            for (end = trie_find_all_r (tr, keys[k], found); *end; ++end)
+                ;
+            nfound = end - found + 1;
+            if (used + nfound > outsize) {
+                used = (size_t) -1;
+                break;
             }
-            print ("%*s%c matches outside wildcard, continue matching exactly\n", depth, "", *key);
-            node = next;
-            continue;
-        }
-        print ("%*ssee if the node has a %%\n", depth, "");
-        // Not inside wildcard and wildcard is still available.
-        // Then see if the node has a wildcard.
-        next = node->next['%'];
-        if (next) {
-            print ("%*sfound %%, recursing\n", depth, "");
-            if (node_has_prefer_fuzzy_match (next, key+1, results_begin, 1, 1, depth+1))
-                return 1;
+            memcpy (out + used, found, nfound * sizeof *found);
+            lists[k] = out + used;
+            used += nfound;
         }
-        print ("%*sno %%, matching %c exactly\n", depth, "", *key);
-        // Then see if the node has this character.
-        index = *key == '%' ? escaped_percent : *key;
-        next = node->next[index];
-        if (next == 0)
-            return 0; // No match.
-        print ("%*sno %%, %c matches exactly\n", depth, "", *key);
-        node = next;
+        free (found);
+        return used == (size_t) -1 ? -1 : (int) used;
     }
-    print ("%*skey exhausted\n", depth, "");
 
-    if (*key == '\0' && node->result_offs >= 0) {
-        const struct result *res = results_begin + node->result_offs;
-        print ("%*sfound %s\n", depth, "", res->key);
-        return 1;
+    batch = malloc ((n > 0 ? n : 1) * sizeof *batch);
+    assert (batch);
+    for (k = 0; k < n; ++k) {
+        batch_key_init (&batch[k], keys[k], k);
+        if (batch[k].klen > maxklen)
+            maxklen = batch[k].klen;
     }
-
-    return 0;
+    // Sorted keys which share a prefix are adjacent, and the descent of a key
+    // resumes where the descent of the previous key left the shared prefix.
+    qsort (batch, n, sizeof *batch, batch_keycmp);
+    path = malloc ((maxklen + 1) * sizeof *path);
+    assert (path);
+    found = malloc (found_size (tr->nresults) * sizeof *found);
+    assert (found);
+    path[0] = node_at (&tr->node_alloc, tr->root);
+    for (k = 0; k < n; ++k) {
+        const struct batch_key *b = &batch[k];
+        stats_begin ();
+        depth = path_descend (tr, b->key, b->klen, path, depth);
+        if (k + 1 < n) {
+            // Start the first node of the next key, which is not shared with
+            // this key, on its way to the cache, while this key is searched
+            // for wildcards.
+            resume = common_prefix (b->key, batch[k+1].key);
+            if (resume > depth)
+                resume = depth;
+            while (path[resume] == 0)
+                --resume;
+            if (resume < batch[k+1].klen) {
+                const int c = batch[k+1].key[resume];
+                next = node_child (&tr->node_alloc, path[resume], key_index (c));
+                if (next)
+                    __builtin_prefetch (next);
+            }
+        } else
+            resume = 0;
+        end = find_all_on_path (tr, b->key, b->klen, path, depth, found);
+        stats_end (tr, end - found);
+        nfound = end - found + 1;
+        if (used + nfound > outsize) {
+            used = (size_t) -1;
+            break;
+        }
+        memcpy (out + used, found, nfound * sizeof *found);
+        lists[b->index] = out + used;
+        used += nfound;
+        depth = resume;
+    }
+    free (found);
+    free (path);
+    free (batch);
+    return used == (size_t) -1 ? -1 : (int) used;
 }
 
-// Return 1 if KEY is present in node.
-// Return 0 otherwise.
-// node_has_prefer_fuzzy_match nodes matching each
-// character of the key to wildcard % first. If this fuzzy match fails, then
-// node_has_prefer_fuzzy_match nodes matching the character exactly.
-// node_has_prefer_exact_match does the opposite. node_has_prefer_exact_match
-// nodes matching each character of the key exactly first. If this exact match
-// fails, then node_has_prefer_exact_match nodes matching the character fuzzy.
-// Both functions return the same result. The difference is in how fast the
-// result is found. node_has_prefer_exact_match performs better on some
-// contents of node, node_has_prefer_fuzzy_match performs better on other
-// contents of node.
-static
-int node_has (const struct node *node, const char *key, const struct result *results_begin, int prefer_fuzzy_match)
+int trie_has (const void *trie, const char *key, int prefer_fuzzy_match)
 {
+    const struct trie *tr = trie;
+    struct swapped_key sk;
     int rc;
-    print ("looking for %s\n", key);
-    if (prefer_fuzzy_match)
-        rc = node_has_prefer_fuzzy_match (node, key, results_begin, 0, 0, 0);
+
+    stats_begin ();
+    key = swap_key (&sk, tr, key);
+    if (tr->flags & trie_multi_wildcard)
+        rc = node_has_multi (tr, key);
     else
-        rc = node_has_prefer_exact_match (node, key, results_begin, 0, 0, 0);
-    print ("%sfound %s\n", rc ? "" : "not ", key);
+        rc = node_has (tr, node_at (&tr->node_alloc, tr->root), key, prefer_fuzzy_match);
+    swapped_key_free (&sk);
+    stats_end (tr, rc);
     return rc;
 }
 
+int trie_size (const void *trie)
+{
+    const struct trie *tr = trie;
+    return tr->size;
+}
+
+// A node on the path of a trie iterator and the index of its next child to
+// visit. The index is -1 until the result of the node is visited.
+struct iter_frame {
+    uint32_t offs;
+    int index;
+};
 
+// A trie iterator keeps the path from the node of its first key to the
+// current node on an explicit stack. The stack only grows when the iterator
+// descends deeper than ever before.
+struct trie_iter {
+    const struct trie *tr;
+    struct iter_frame *stack;
+    int depth; // The number of frames on the stack.
+    int maxdepth; // The capacity of the stack.
+    int limit; // The number of keys left to return, or -1 for all.
+};
 
+// Return an iterator over the keys below the node at OFFS, which returns at
+// most LIMIT keys. With EMPTY the iterator returns no keys.
 static
-char *node_print_imp (const struct node *node, char *buf, ssize_t buflen, off_t off)
+struct trie_iter *iter_begin (const struct trie *tr, uint32_t offs, int limit, int empty)
 {
-    if (node->result_offs >= 0) {
-        buf[off] = '\0';
-        printf ("%s\n", buf);
-    }
-    for (size_t k = 0; k < asciisz; ++k)
-        if (node->next[k]) {
-            // Add extra 8 chars, because off+1 is passed to node_print_imp at
-            // the end of this if check and if node->result_offs is set, then
-            // buf[off] is assigned '\0'.
-            if (buflen <= off + 8) {
-                while (buflen <= off + 8)
-                    buflen *= 2;
-                assert(buflen > off + 8);
-                buf = realloc (buf, buflen);
-            }
-            assert(buflen > off + 8);
-            buf[off] = (char) k;
-            buf = node_print_imp (node->next[k], buf, buflen, off+1);
-        }
-    return buf;
+    struct trie_iter *it = malloc (sizeof *it);
+    assert (it);
+    it->tr = tr;
+    it->maxdepth = 64;
+    it->stack = malloc (it->maxdepth * sizeof *it->stack);
+    assert (it->stack);
+    it->stack[0].offs = offs;
+    it->stack[0].index = -1;
+    it->depth = !empty;
+    it->limit = limit < 0 ? -1 : limit;
+    return it;
 }
 
-static
-int node_print (const struct node *node)
+void *trie_iter_begin (const void *trie)
 {
-//TODO: use a bigger initial value. e.g. 128.
-    const size_t n = 2;
-    char *buf = malloc (n);
-    buf = node_print_imp (node, buf, n, 0);
-    free (buf);
-    return 0;
+    const struct trie *tr = trie;
+    return iter_begin (tr, tr->root, -1, 0);
 }
 
-struct trie {
-    struct node *root;
-    struct result *results_begin; /* trie_push stores the pushed keys and userdata here. */
-    struct result *results_end;
-    const struct result **found; /* trie_find stores the found matching records here. */
-    char *keys_begin; /* trie_push stores the pushed keys here. */
-    char *keys_end;
-    int size; // The number of keys in this trie.
-    int order;
-    struct node_allocator node_alloc;
-};
-
-// MAXKEYS is the max number of keys that can be pushed to this trie.
-// MAXCHARS is the max number of characters (equals the number of nodes) that
-// can be pushed to this trie.
-void *trie_init (int maxkeys, int maxchars, int loglevel)
+// Store to *OFFS the node, below which are the keys, whose node indices
+// start with the N indices INDEX. If the indices end inside a segment, this is
+// the child of the segment, because the keys below the segment have all of
+// its chars.
+// Return 0 if no key starts with INDEX.
+static
+int node_find_prefix (const struct trie *tr, const unsigned char *index, int n, uint32_t *offs)
 {
-    struct trie *trie;
-    const size_t nbytes = sizeof (struct node) * maxchars + sizeof (struct trie);
-    const int nnodes = maxchars - 1; // Minus the root node.
-
-    g_loglevel = loglevel;
+    const struct node *node;
+    int k = 0;
 
-    assert (maxchars > 0);
-    print ("allocating %zu bytes for %d nodes\n", nbytes, nnodes);
-    trie = calloc (1, nbytes);
-    print ("trie = %p\n", trie);
-    assert (trie);
-    trie->root = (struct node *) (trie + 1);
-    trie->root->result_offs = -1;
-    print ("trie->root = %p, sizeof (struct node) = %zu, sizeof (*trie->root) = %zu, first node = %p\n", trie->root, sizeof (struct node), sizeof (*trie->root), trie->root + 1);
-    // The first node is the root node.
-    // The first available node is right next to root.
-    alloc_init (&trie->node_alloc, trie->root + 1, nnodes);
-    trie->results_begin = trie->results_end = malloc (maxkeys * sizeof *trie->results_begin);
-    print ("results_begin = %p\n", trie->results_begin);
-    trie->found = malloc (maxkeys * sizeof *trie->found);
-    trie->keys_begin = trie->keys_end = malloc (maxchars * sizeof *trie->keys_begin);
-    return trie;
+    *offs = tr->root;
+    while (k < n) {
+        node = node_at (&tr->node_alloc, *offs);
+        if (node->kind == nodeseg) {
+            const struct nodeseg *s = (const struct nodeseg *) node;
+            for (int d = 0; d < s->len && k < n; ++d, ++k)
+                if (s->seg[d] != index[k])
+                    return 0;
+            *offs = s->child;
+            continue;
+        }
+        *offs = node_next (node, index[k++]);
+        if (*offs == 0)
+            return 0;
+    }
+    return 1;
 }
 
-int trie_free (void *trie)
+void *trie_prefix_iter (const void *trie, const char *prefix, int limit)
 {
     const struct trie *tr = trie;
-    free (tr->results_begin);
-    free (tr->found);
-    free (tr->keys_begin);
-    free (trie);
-    return 0;
+    struct key_path path;
+    uint32_t offs;
+    int found;
+
+    // A prefix with more naked wildcards than a key can have starts no key.
+    found = key_path (tr, &path, prefix) == 0 && node_find_prefix (tr, path.index, path.n, &offs);
+    key_path_free (&path);
+    return iter_begin (tr, found ? offs : tr->root, limit, !found);
 }
 
-int trie_push (void *trie, const char *key, const void *userdata)
+const struct result *trie_iter_next (void *iter)
 {
-    int rc;
-    struct trie *tr = trie;
-    struct result *result = tr->results_end;
-    size_t klen;
+    struct trie_iter *it = iter;
+    const struct trie *tr = it->tr;
+    struct iter_frame *f;
+    const struct node *node;
+    uint32_t child;
 
-    rc = node_push (tr->root, key, result - tr->results_begin, &tr->node_alloc);
-    if (rc)
-        return rc;
-    klen = strlen (key) + 1; // + 1 for null terminator.
-    memcpy (tr->keys_end, key, klen);
-    result->key = tr->keys_end;
-    result->userdata = (void*) userdata;
-    result->order = tr->order++;
-    tr->keys_end += klen;
-    ++tr->results_end;
-    ++tr->size;
-    print ("pushed %s, size = %d\n", key, tr->size);
+    if (it->limit == 0)
+        return 0;
+    while (it->depth > 0) {
+        f = &it->stack[it->depth - 1];
+        node = node_at (&tr->node_alloc, f->offs);
+        if (f->index < 0) {
+            // A key precedes all keys it is a prefix of.
+            f->index = 0;
+            if (node->result_offs >= 0) {
+                if (it->limit > 0)
+                    --it->limit;
+                return result_at (tr, node->result_offs);
+            }
+        }
+        child = node_next_child (node, &f->index);
+        if (child == 0) {
+            --it->depth;
+            continue;
+        }
+        ++f->index;
+        if (it->depth == it->maxdepth) {
+            it->maxdepth *= 2;
+            it->stack = realloc (it->stack, it->maxdepth * sizeof *it->stack);
+            assert (it->stack);
+        }
+        f = &it->stack[it->depth++];
+        f->offs = child;
+        f->index = -1;
+    }
     return 0;
 }
 
-static
-int integrity (const struct result **result, const char *key)
+void trie_iter_end (void *iter)
 {
-    const struct result *r;
-    const size_t klen = strlen (key);
-    int nexact = 0; /* The number of results that match the key exactly. */
+    struct trie_iter *it = iter;
+    if (it == 0)
+        return;
+    free (it->stack);
+    free (it);
+}
 
-    for (; *result; ++result) {
-        r = *result;
-        const size_t rlen = strlen (r->key);
-        assert (klen >= rlen || strchr (r->key, '\\'));
-        assert (nexact == 0 || strchr (r->key, '%'));
-        nexact += strcmp (key, r->key) == 0;
-    }
-    assert (nexact == 0 || nexact == 1);
-    return 1;
+int trie_print (const void *trie)
+{
+    void *it = trie_iter_begin (trie);
+    const struct result *r;
+    while ((r = trie_iter_next (it)))
+        printf ("%s\n", r->key);
+    trie_iter_end (it);
+    return 0;
 }
 
-const struct result **trie_find_all (void *trie, const char *key)
+size_t trie_memory (const void *trie)
 {
-    struct trie *tr = trie;
-    const struct result **r, **begin = tr->found;
-    const char *del = "";
-    const struct node *next;
+    const struct trie *tr = trie;
+    return (size_t) tr->node_alloc.pos * node_align
+           + (size_t) tr->maxresults * sizeof (struct result)
+           + (tr->suffix_link ? (size_t) tr->maxresults * sizeof *tr->suffix_link : 0)
+           + tr->keys_nbytes;
+}
 
-    // Exact match always beats fuzzy match.
-    next = node_find_exact (tr->root, key);
-    if (next) {
-        *begin++ = tr->results_begin + next->result_offs;
-        print ("found exact match %s\n", (*tr->found)->key);
-        assert (strcmp ((*tr->found)->key, key) == 0 || strchr (key, '%'));
-    }
+// The layout of the file written by trie_save.
+// The header is followed by the node arena, the results and the keys.
+// The node arena is written as is. Chunk K starts at K * chunk_units units
+// from the beginning of the arena. This lets trie_open_mmap point the chunks
+// to the mapped image.
+// A key is written with the null terminator and is referenced by its offset
+// from the beginning of the keys.
+// Bump image_version when the layout of the image or of the nodes changes.
+enum {image_version = 8, image_byteorder = 0x01020304};
+static const char image_magic[8] = "trie\0img";
 
-    print ("finding fuzzy matches of %s\n", key);
-    r = node_find_fuzzy (begin, tr->root, key, tr->results_begin, 0, 0, 0);
-    /* If there is exact match, then 'begin' points to element 1 and the exact
-     * match is located in element 0. Sort starting from 'begin' to ensure the
-     * exact match stays in element 0. */
-    qsort (begin, r - begin, sizeof *r, resultcmp);
-    *r = 0; // Null terminator.
-    print ("sorted results ");
-    for (r = tr->found; *r; ++r, del = ", ")
-        print ("%s%s", del, (*r)->key);
-    print ("\n");
-    assert (integrity (tr->found, key));
-    return tr->found;
-}
+struct image_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteorder;
+    uint32_t node_align;
+    uint32_t chunk_units;
+    uint64_t nunits; /* The size of the node arena in units. */
+    uint64_t nodes; /* The file offset of the node arena. */
+    uint64_t nresults;
+    uint64_t results; /* The file offset of the results. */
+    uint64_t keys_nbytes;
+    uint64_t keys; /* The file offset of the keys. */
+    int32_t size;
+    int32_t order;
+    uint32_t suffix_root; /* 0 if the trie has no suffix index. */
+    uint32_t key_flags; /* The flags, which the keys were parsed with. */
+};
 
-const struct result *trie_find (void *trie, const char *key)
+// The flags of trie_init, which the nodes of the keys depend on.
+enum {key_flags = trie_multi_wildcard | 0xff << trie_wildcard_shift};
+
+struct image_result {
+    uint64_t key; /* The offset of the key from the beginning of the keys. */
+    uint64_t userdata;
+    int32_t order;
+    int32_t len;
+    int32_t prefixlen;
+    int32_t suffixlen;
+    int32_t suffix_next;
+    uint32_t prefix_hash;
+};
+
+// Write TRIE to file PATH.
+// The image is written to a temporary file in the directory of PATH, which
+// is then renamed to PATH. The processes, which mapped the old file, including
+// this one, if TRIE was mapped from PATH, keep it, rather than see it truncated
+// and rewritten. A failed write leaves PATH as it was. The file keeps the mode
+// of the file it replaces. A new file gets mode 0644.
+// Return 0 on success.
+// Return -1 on failure and set errno.
+int trie_save (const void *trie, const char *path)
 {
-    return *trie_find_all (trie, key);
+    const struct trie *tr = trie;
+    const struct node_allocator *alloc = &tr->node_alloc;
+    struct image_header hdr;
+    struct stat st;
+    FILE *f;
+    uint64_t koffs;
+    char *tmp;
+    int rc, fd, err;
+
+    memset (&hdr, 0, sizeof hdr);
+    memcpy (hdr.magic, image_magic, sizeof hdr.magic);
+    hdr.version = image_version;
+    hdr.byteorder = image_byteorder;
+    hdr.node_align = node_align;
+    hdr.chunk_units = chunk_units;
+    hdr.nunits = alloc->pos;
+    hdr.nodes = sizeof hdr;
+    hdr.nresults = tr->nresults;
+    hdr.results = hdr.nodes + hdr.nunits * node_align;
+    hdr.keys = hdr.results + hdr.nresults * sizeof (struct image_result);
+    hdr.size = tr->size;
+    hdr.order = tr->order;
+    hdr.suffix_root = tr->suffix_root;
+    hdr.key_flags = tr->flags & key_flags;
+    for (int k = 0; k < tr->nresults; ++k)
+        hdr.keys_nbytes += result_at (tr, k)->len + 1;
+
+    tmp = malloc (strlen (path) + sizeof ".XXXXXX");
+    assert (tmp);
+    strcpy (tmp, path);
+    strcat (tmp, ".XXXXXX");
+    fd = mkstemp (tmp);
+    if (fd < 0) {
+        free (tmp);
+        return -1;
+    }
+    f = fdopen (fd, "w");
+    if (f == 0) {
+        err = errno;
+        close (fd);
+        unlink (tmp);
+        free (tmp);
+        errno = err;
+        return -1;
+    }
+    rc = fchmod (fd, stat (path, &st) == 0 ? st.st_mode & 07777 : 0644);
+    if (rc == 0)
+        rc = fwrite (&hdr, sizeof hdr, 1, f) == 1 ? 0 : -1;
+    for (uint32_t k = 0; rc == 0 && k < alloc->nchunks; ++k) {
+        uint64_t nunits = alloc->pos - (uint64_t) k * chunk_units;
+        if (nunits > chunk_units)
+            nunits = chunk_units;
+        if (fwrite (alloc->chunk[k], node_align, nunits, f) != nunits)
+            rc = -1;
+    }
+    koffs = 0;
+    for (int k = 0; rc == 0 && k < tr->nresults; ++k) {
+        const struct result *r = result_at (tr, k);
+        struct image_result ir;
+        memset (&ir, 0, sizeof ir);
+        ir.key = koffs;
+        ir.userdata = (uintptr_t) r->userdata;
+        ir.order = r->order;
+        ir.len = r->len;
+        ir.prefixlen = r->prefixlen;
+        ir.suffixlen = r->suffixlen;
+        // Only the patterns with a suffix are linked to the suffix index.
+        ir.suffix_next = -1;
+        if (tr->suffix_root && r->suffixlen > 0) {
+            ir.suffix_next = tr->suffix_link[k].next;
+            ir.prefix_hash = tr->suffix_link[k].prefix_hash;
+        }
+        koffs += r->len + 1;
+        if (fwrite (&ir, sizeof ir, 1, f) != 1)
+            rc = -1;
+    }
+    for (int k = 0; rc == 0 && k < tr->nresults; ++k) {
+        const struct result *r = result_at (tr, k);
+        if (fwrite (r->key, r->len + 1, 1, f) != 1)
+            rc = -1;
+    }
+    if (rc == 0 && (fflush (f) || fsync (fd)))
+        rc = -1;
+    err = errno;
+    if (fclose (f) && rc == 0) {
+        rc = -1;
+        err = errno;
+    }
+    if (rc == 0 && rename (tmp, path)) {
+        rc = -1;
+        err = errno;
+    }
+    if (rc)
+        unlink (tmp);
+    free (tmp);
+    errno = err;
+    print (tr->loglevel, "saved %d keys to %s, rc = %d\n", tr->size, path, rc);
+    return rc;
 }
 
-int trie_has (const void *trie, const char *key, int prefer_fuzzy_match)
+static
+int image_valid (const struct image_header *hdr, size_t imagesz)
 {
-    const struct trie *tr = trie;
-    return node_has (tr->root, key, tr->results_begin, prefer_fuzzy_match);
+    const uint64_t rsz = sizeof (struct image_result);
+    return imagesz >= sizeof *hdr
+        && memcmp (hdr->magic, image_magic, sizeof hdr->magic) == 0
+        && hdr->version == image_version
+        && hdr->byteorder == image_byteorder
+        && hdr->node_align == node_align
+        && hdr->chunk_units == chunk_units
+        && hdr->nunits >= node_size[node256] / node_align
+        && hdr->nunits <= (uint64_t) UINT32_MAX + 1
+        && hdr->nodes == sizeof *hdr
+        && hdr->results == hdr->nodes + hdr->nunits * node_align
+        && hdr->suffix_root < hdr->nunits
+        && (hdr->key_flags & ~(uint32_t) key_flags) == 0
+        && (hdr->key_flags >> trie_wildcard_shift & 0xff) != '\\'
+        && hdr->nresults <= INT32_MAX
+        && hdr->keys == hdr->results + hdr->nresults * rsz
+        && hdr->keys + hdr->keys_nbytes == imagesz;
 }
 
-int trie_size (const void *trie)
+// Return 1 if result IR of the image with header HDR, whose keys start at KEYS,
+// refers to a null terminated key of the image and to results of the image.
+static
+int image_result_valid (const struct image_header *hdr, const char *keys, const struct image_result *ir)
 {
-    const struct trie *tr = trie;
-    return tr->size;
+    return ir->len >= 0
+        && ir->key < hdr->keys_nbytes
+        && (uint64_t) ir->len < hdr->keys_nbytes - ir->key
+        && keys[ir->key + ir->len] == '\0'
+        && ir->prefixlen >= 0
+        && ir->suffixlen >= -1
+        && (int64_t) ir->prefixlen + ir->suffixlen <= ir->len
+        && (hdr->suffix_root == 0
+            || ir->suffix_next == -1
+            || (ir->suffix_next >= 0 && (uint64_t) ir->suffix_next < hdr->nresults));
 }
 
-int trie_print (const void *trie)
+// Map the image written by trie_save to memory and return a read-only trie.
+// The nodes and the keys are used in place. Only the results are copied,
+// because struct result holds pointers.
+// The header and each result are checked, so that a truncated image or a
+// corrupt result fails. The nodes are trusted, i.e. the offsets of the
+// children and the results, which a node refers to, are not checked.
+// Return 0 on failure and set errno.
+void *trie_open_mmap (const char *path, int loglevel, int flags)
 {
-    const struct trie *tr = trie;
-    return node_print (tr->root);
+    struct trie *trie;
+    struct stat st;
+    const struct image_header *hdr;
+    const struct image_result *ir;
+    char *image;
+    int fd;
+
+    fd = open (path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    if (fstat (fd, &st) < 0) {
+        close (fd);
+        return 0;
+    }
+    if ((size_t) st.st_size < sizeof *hdr) {
+        close (fd);
+        errno = EINVAL;
+        return 0;
+    }
+    image = mmap (0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if (image == MAP_FAILED)
+        return 0;
+    hdr = (const struct image_header *) image;
+    if (!image_valid (hdr, st.st_size)) {
+        munmap (image, st.st_size);
+        errno = EINVAL;
+        return 0;
+    }
+
+    trie = calloc (1, sizeof *trie);
+    assert (trie);
+    trie->loglevel = loglevel;
+    // The keys are parsed like the saved ones.
+    flags = (flags & ~key_flags) | (hdr->key_flags & key_flags);
+    if (flags & trie_multi_wildcard)
+        flags |= trie_engine_nfa;
+    // The suffix index is there, if it was saved.
+    trie->flags = hdr->suffix_root ? flags | trie_suffix_index : flags & ~trie_suffix_index;
+    trie->wildcard = flags_wildcard (flags);
+    trie->scan_key = choose_scan_key (flags);
+    trie->generation = 1;
+    stats_init (trie);
+    trie->suffix_root = hdr->suffix_root;
+    trie->node_alloc.loglevel = loglevel;
+    trie->image = image;
+    trie->imagesz = st.st_size;
+    trie->root = 0;
+    trie->size = hdr->size;
+    trie->order = hdr->order;
+
+    trie->node_alloc.pos = hdr->nunits;
+    trie->node_alloc.nchunks = (hdr->nunits + chunk_units - 1) / chunk_units;
+    trie->node_alloc.maxchunks = trie->node_alloc.nchunks;
+    trie->node_alloc.chunk = malloc (trie->node_alloc.nchunks * sizeof *trie->node_alloc.chunk);
+    assert (trie->node_alloc.chunk);
+    for (uint32_t k = 0; k < trie->node_alloc.nchunks; ++k)
+        trie->node_alloc.chunk[k] = image + hdr->nodes + (size_t) k * chunk_units * node_align;
+
+    trie->maxchunks = hdr->nresults / results_per_chunk + 1;
+    trie->results = malloc (trie->maxchunks * sizeof *trie->results);
+    assert (trie->results);
+    trie->maxfound = found_size (0);
+    trie->found = malloc (trie->maxfound * sizeof *trie->found);
+    assert (trie->found);
+    ir = (const struct image_result *) (image + hdr->results);
+    for (uint64_t k = 0; k < hdr->nresults; ++k) {
+        struct result *r;
+        if (!image_result_valid (hdr, image + hdr->keys, &ir[k])) {
+            print (trie->loglevel, "result %lu of %s is corrupt\n", (unsigned long) k, path);
+            trie_free (trie);
+            errno = EINVAL;
+            return 0;
+        }
+        r = alloc_result (trie);
+        r->key = image + hdr->keys + ir[k].key;
+        r->userdata = (void *) (uintptr_t) ir[k].userdata;
+        r->order = ir[k].order;
+        r->len = ir[k].len;
+        r->prefixlen = ir[k].prefixlen;
+        r->suffixlen = ir[k].suffixlen;
+        if (trie->suffix_root) {
+            trie->suffix_link[k].next = ir[k].suffix_next;
+            trie->suffix_link[k].prefix_hash = ir[k].prefix_hash;
+        }
+    }
+    print (trie->loglevel, "mapped %d keys from %s at %p\n", trie->size, path, image);
+    return trie;
 }
@@ -1,20 +1,202 @@
 #ifndef _TRIE_H_
 #define _TRIE_H_
 
+#include <stddef.h>
+
 struct result {
     const char *key; /* This is the key that was passed to node_push intact
                       * with all escaping backslashes preserved. */
     void *userdata; /* The userdata that was passed to trie_push. */
     int order; /* Used for sorting. */
+    int len; /* strlen (key). Used for sorting. */
+    int prefixlen; /* The number of chars of a matching key, which are matched
+                    * by the part of key before the naked %. */
+    int suffixlen; /* The number of chars of a matching key, which are matched
+                    * by the part of key after the naked %.
+                    * -1 if key has no naked %. */
 };
 
-void *trie_init (int maxkeys, int maxchars, int loglevel);
+// FLAGS is 0 or a combination of the following.
+// trie_engine_nfa makes trie_find_all and friends match all the positions of
+// the trie in one pass over the key, rather than backtrack, which bounds the
+// time of a lookup by the length of the key times the number of positions
+// which match the key so far.
+// trie_suffix_index makes trie_push also index the part of a pattern after
+// the naked % by its reversed chars. trie_find_all then looks up a key by its
+// suffix, when the prefix has many % to scan the key from.
+// trie_lookup_cache makes trie_find_all and trie_find keep the matches of the
+// last keys looked up, up to a fixed size, until the keys of the trie change.
+// trie_scalar_scan makes the lookups skip the chars of a key, which a % has
+// to match, one by one, rather than with the vector instructions of the cpu.
+// This is for testing and comparison.
+// trie_multi_wildcard lets a key have any number of naked %, e.g. lib%/%.o.
+// Each naked % matches one or more chars. The lookups of such a trie use the
+// nfa engine, which keeps the positions, which the chars of the key read so
+// far lead to, unique and bounds the time of a lookup like for one %.
+// trie_suffix_index is ignored, the suffix index holds keys with one %.
+// TRIE_WILDCARD (C) makes byte C the wildcard of the keys instead of %, e.g.
+// TRIE_WILDCARD ('*'). A backslash escapes C like it escapes %, and % is an
+// ordinary char. C cannot be a backslash or '\0'.
+enum {trie_engine_nfa = 1, trie_suffix_index = 2, trie_lookup_cache = 4,
+      trie_scalar_scan = 8, trie_multi_wildcard = 16, trie_wildcard_shift = 8};
+#define TRIE_WILDCARD(c) ((int) (unsigned char) (c) << trie_wildcard_shift)
+void *trie_init (int maxkeys, int maxchars, int loglevel, int flags);
 int trie_free (void *trie);
+// Return 0 if KEY was pushed.
+// Return 1 if KEY is already present.
+// Return -1 if KEY is malformed, i.e. has more than one naked % and TRIE
+// is not a trie_multi_wildcard trie.
+// Return -2 if TRIE is read-only.
 int trie_push (void *trie, const char *key, const void *userdata);
+// Remove KEY, which was pushed, and free the nodes, which only KEY used.
+// A key pushed again after it was removed is younger than every other key.
+// Return 0 if KEY was removed.
+// Return 1 if KEY is not present.
+// Return -1 if KEY is malformed.
+// Return -2 if TRIE is read-only.
+int trie_remove (void *trie, const char *key);
+// Replace the userdata of KEY, if KEY is present, or push KEY otherwise.
+// A replaced key keeps its age.
+// Return 0 if the userdata of KEY was replaced.
+// Return 1 if KEY was pushed.
+// Return -1 if KEY is malformed.
+// Return -2 if TRIE is read-only.
+int trie_replace (void *trie, const char *key, const void *userdata);
+// Push the N KEYS with USERDATA[k], or with null userdata if USERDATA is 0,
+// as if trie_push was called for each key in the order of KEYS. Store the
+// return code of trie_push for KEYS[k] to RC[k], if RC is not 0.
+// The keys are sorted once and each key descends from where it leaves the
+// key before it, rather than from the root. The results and the key storage
+// are allocated once for all keys.
+// Return the number of keys pushed.
+// Return -2 if TRIE is read-only.
+int trie_build_bulk (void *trie, const char *const *keys, const void *const *userdata, int n, int *rc);
+// Push the N KEYS like trie_build_bulk, on NTHREADS threads.
+// The keys are sharded by a prefix of their first chars, whose length is
+// chosen from a sample of the keys, so that the keys of a prefix go to one
+// thread. Each thread builds the subtries of its prefixes with nodes of its
+// own, and the calling thread links the subtries to the trie. The trie finds
+// the same matches in the same order, as if trie_push was called for each key
+// in the order of KEYS.
+// A trie, which already has keys, or NTHREADS less than 2, is built by
+// trie_build_bulk on the calling thread.
+// Return the number of keys pushed.
+// Return -2 if TRIE is read-only.
+int trie_build_parallel (void *trie, const char *const *keys, const void *const *userdata, int n, int nthreads, int *rc);
+// Lay out the nodes of TRIE anew for lookups and make TRIE read-only.
+// The nodes move to one block, the top levels first, breadth first, then
+// each subtree below them, depth first, so that the nodes which most lookups
+// visit share the lines of the cpu cache. A small node does not straddle two
+// 64 byte lines. The nodes of removed keys are dropped. The results stay.
+// trie_push, trie_remove, trie_replace and trie_build_bulk of a frozen trie
+// return -2. trie_save of a frozen trie saves the new layout.
+// Return 0 if TRIE was frozen.
+// Return 1 if TRIE is already read-only.
+int trie_freeze (void *trie);
+// trie_find_all returns a null terminated array of the matches of KEY, most
+// specific first. The array is owned by TRIE and is valid until the next call
+// to trie_find_all, trie_find, trie_push, trie_remove, trie_replace,
+// trie_build_bulk or trie_build_parallel.
+// trie_find returns the most specific match of KEY or 0.
 const struct result *trie_find (void *trie, const char *key);
 const struct result **trie_find_all (void *trie, const char *key);
+// Store the number of lookups of trie_find_all and trie_find, which the
+// lookup cache answered, to *HITS and the number of the others to *MISSES.
+void trie_cache_stats (const void *trie, size_t *hits, size_t *misses);
+// Re-entrant versions of trie_find and trie_find_all, which store the matches
+// to FOUND. FOUND is an array of at least trie_found_size (trie) elements,
+// owned by the caller.
+// Any number of threads can call trie_find_all_r, trie_find_r and trie_has on
+// one trie at the same time, as long as no thread modifies the trie.
+const struct result *trie_find_r (const void *trie, const char *key, const struct result **found);
+const struct result **trie_find_all_r (const void *trie, const char *key, const struct result **found);
+size_t trie_found_size (const void *trie);
+// The work of the lookups of a trie, see trie_stats.
+// A histogram has a bucket per power of 2. Bucket 0 counts the lookups of 0,
+// bucket b counts the lookups of 2^(b-1) to 2^b - 1, the last bucket counts
+// the larger ones too.
+enum {trie_stats_buckets = 16};
+struct trie_stats {
+    size_t lookups; /* The keys looked up by trie_find_all_r, trie_find_r,
+                     * trie_has and trie_find_all_batch, and by trie_find_all
+                     * and trie_find, unless the lookup cache answered. */
+    size_t nodes; /* The steps from a node to a child. */
+    size_t backtracks; /* The paths of the backtracking search, which ended
+                        * without a match. */
+    size_t matches; /* The matches found. */
+    size_t sorted; /* The matches sorted by specificity. */
+    size_t merges; /* The runs of matches merged by the sort. */
+    int max_depth; /* The deepest recursion of the backtracking search. */
+    size_t nodes_hist[trie_stats_buckets]; /* Lookups by steps. */
+    size_t matches_hist[trie_stats_buckets]; /* Lookups by matches. */
+    size_t sorted_hist[trie_stats_buckets]; /* Lookups by matches sorted. */
+};
+// Store the counts of the lookups of TRIE since trie_init or trie_open_mmap
+// to STATS and return 0.
+// The lookups count only if trie.c is compiled with TRIE_STATS defined.
+// Otherwise, the counting is compiled out, and trie_stats zeroes STATS and
+// returns -1.
+// The threads which look up keys in one trie at the same time add their
+// counts atomically, once per key.
+int trie_stats (const void *trie, struct trie_stats *stats);
+// Find all matches of each of the N KEYS, like trie_find_all_r.
+// Store the null terminated matches of KEYS[k] to OUT, one list after
+// another, and point LISTS[k] at the list of KEYS[k].
+// Return the number of elements of OUT used, or -1 if OUTSIZE elements are
+// not enough.
+// With the default engine and the % wildcard, the keys are sorted to look up
+// their common prefixes once. The other tries look up each key on its own,
+// like trie_find_all_r.
+int trie_find_all_batch (const void *trie, const char *const *keys, int n, const struct result ***lists, const struct result **out, size_t outsize);
+// Return the stem, i.e. the part of KEY of length KEYLEN matched by the naked %
+// of R, which was found by trie_find_all for KEY. Store the length of the stem
+// to *STEMLEN.
+// Return 0 if R has no naked %.
+const char *trie_stem (const struct result *r, const char *key, size_t keylen, size_t *stemlen);
+// Return 1 if KEY matches a key of TRIE, 0 otherwise.
+// PREFER_FUZZY_MATCH chooses the search, all find the same answer.
+// trie_prefer_exact matches each char exactly first, trie_prefer_fuzzy
+// matches each char to a % first. Each is slow on some tries.
+// trie_prefer_auto chooses per node from statistics of the trie.
+enum {trie_prefer_exact, trie_prefer_fuzzy, trie_prefer_auto};
 int trie_has (const void *trie, const char *key, int prefer_fuzzy_match);
 int trie_size (const void *trie);
+// Print the keys of this trie, one per line, in the order of trie_iter_next.
 int trie_print (const void *trie);
+// Iterate over the keys of TRIE.
+// trie_iter_next returns the result of the next key or 0 after the last key.
+// The keys come in byte order, except that an escaped % sorts before any
+// other char. A key comes before the keys it is a prefix of. With
+// TRIE_WILDCARD (C), an escaped C sorts first and % sorts like C.
+// The iterator neither recurses nor allocates per key. It is invalid after
+// TRIE is modified. trie_iter_end frees the iterator.
+void *trie_iter_begin (const void *trie);
+// Iterate over the keys of TRIE, which start with PREFIX, in the order of
+// trie_iter_begin, and stop after LIMIT keys, unless LIMIT is negative.
+// PREFIX is read like a key of trie_push, so "obj/" lists "obj/%.o" and "obj/%"
+// lists "obj/%.o" too, while "obj/\%" lists the keys with an escaped %.
+// The iterator descends to the node of PREFIX once and then visits the keys
+// below it lazily, like trie_iter_begin.
+void *trie_prefix_iter (const void *trie, const char *prefix, int limit);
+const struct result *trie_iter_next (void *iter);
+void trie_iter_end (void *iter);
+// Return the number of bytes used by nodes, results and keys of this trie.
+size_t trie_memory (const void *trie);
+// Write TRIE to file PATH. Return 0 on success, -1 on failure.
+// PATH is replaced by a new file, so that the tries mapped from the old one
+// stay valid, and is left as it was on failure.
+int trie_save (const void *trie, const char *path);
+// Map the file written by trie_save and return a read-only trie.
+// The mapped pages are shared by all processes which open the same file.
+// The userdata of a loaded result is the value saved. It is only meaningful
+// to a process other than the one which saved the trie, if it is not a
+// pointer, e.g. an index.
+// Return 0 on failure and set errno, to EINVAL if the file is not a trie image,
+// is truncated or has a result, whose key or lengths are out of bounds. The
+// nodes of the image are trusted and are not checked.
+// The trie has to be freed with trie_free.
+// FLAGS are the flags of trie_init. The wildcard and trie_multi_wildcard are
+// those of the saved trie.
+void *trie_open_mmap (const char *path, int loglevel, int flags);
 
 #endif
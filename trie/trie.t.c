@@ -7,6 +7,18 @@
 #include <stdio.h>
 #include <time.h>
 #include <sys/time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// The flags, which the tests pass to trie_init, select the matching engine,
+// the suffix index and the lookup cache. Every test runs with each set of flags.
+static int trie_flags;
+static const int flag_sets[] = {0, trie_engine_nfa, trie_suffix_index,
+                                trie_engine_nfa | trie_suffix_index,
+                                trie_lookup_cache};
 
 static
 void gettime(struct timeval *result)
@@ -28,6 +40,21 @@ suseconds_t timediff (const struct timeval *start, const struct timeval *stop)
     return result;
 }
 
+// Print the peak virtual memory size and the peak resident set size of this
+// process.
+static
+void print_peak_memory (void)
+{
+    char line[256];
+    FILE *f = fopen ("/proc/self/status", "r");
+    if (f == 0)
+        return;
+    while (fgets (line, sizeof line, f))
+        if (strncmp (line, "VmPeak:", 7) == 0 || strncmp (line, "VmHWM:", 6) == 0)
+            printf ("%s", line);
+    fclose (f);
+}
+
 static
 char random_printable_char ()
 {
@@ -59,20 +86,182 @@ void randomize_trie (void *trie, int maxklen, int nkeys)
     }
 }
 
+static
+void random_key (char *key, int maxklen, unsigned *seed)
+{
+    int k, klen = rand_r (seed) % maxklen;
+    if (klen < 8)
+        klen = 8;
+    for (k = 0; k < klen - 1; ++k)
+        key[k] = (char) (rand_r (seed) % 94 + 32);
+    key[k] = '\0';
+}
+
+// Return 1 if PATTERN, which has no backslash, matches KEY, 0 otherwise.
+static
+int pattern_matches (const char *pattern, const char *key)
+{
+    const char *pct = strchr (pattern, '%');
+    size_t plen, slen, klen = strlen (key);
+
+    if (pct == 0)
+        return strcmp (pattern, key) == 0;
+    plen = pct - pattern;
+    slen = strlen (pct + 1);
+    // The % matches at least one char.
+    return plen + slen < klen && strncmp (pattern, key, plen) == 0
+           && strcmp (pct + 1, key + klen - slen) == 0;
+}
+
+// Store the chars of PATTERN, a key of a trie of wildcard W, to TOK, and -1
+// for each naked W. Return the number of them.
+static
+int glob_parse (const char *pattern, char w, int *tok)
+{
+    int n = 0;
+    for (const char *p = pattern; *p;) {
+        if (*p == '\\') {
+            const size_t nb = strspn (p, "\\");
+            p += nb;
+            if (*p == w) {
+                for (size_t k = 0; k < nb / 2; ++k)
+                    tok[n++] = '\\';
+                tok[n++] = nb % 2 ? (unsigned char) w : -1;
+                ++p;
+            } else
+                for (size_t k = 0; k < nb; ++k)
+                    tok[n++] = '\\';
+            continue;
+        }
+        tok[n++] = *p == w ? -1 : (unsigned char) *p;
+        ++p;
+    }
+    return n;
+}
+
+// Return 1 if PATTERN, a key of a trie of wildcard W with any number of naked
+// W, matches KEY, 0 otherwise. Each naked W matches at least one char.
+static
+int glob_matches (const char *pattern, const char *key, char w)
+{
+    enum {maxlen = 64};
+    const int klen = strlen (key);
+    int tok[maxlen], ntok;
+    // m[j] is set, if the tokens so far match the first j chars of KEY.
+    char m[maxlen+1] = {1}, next[maxlen+1], any;
+
+    assert (klen <= maxlen && strlen (pattern) <= maxlen);
+    ntok = glob_parse (pattern, w, tok);
+    for (int t = 0; t < ntok; ++t) {
+        next[0] = 0;
+        any = 0;
+        for (int j = 1; j <= klen; ++j)
+            if (tok[t] < 0) {
+                // A naked W extends a match by one or more chars.
+                any |= m[j-1];
+                next[j] = any;
+            } else
+                next[j] = m[j-1] && (unsigned char) key[j-1] == tok[t];
+        memcpy (m, next, klen + 1);
+    }
+    return m[klen];
+}
+
+// Store a random key of up to MAXKLEN-1 chars of ALPHABET to KEY.
+static
+void random_alphabet_key (char *key, int maxklen, const char *alphabet, unsigned *seed)
+{
+    const int n = strlen (alphabet);
+    int k, klen = rand_r (seed) % maxklen;
+    for (k = 0; k < klen; ++k)
+        key[k] = alphabet[rand_r (seed) % n];
+    key[k] = '\0';
+}
+
+// Assert that TRIE and OTHER find the same matches of TARGET in the same order
+// and that trie_has of either agrees with each preference.
+static
+void compare_lookups (void *trie, void *other, const char *target)
+{
+    const struct result **all = trie_find_all (trie, target);
+    const struct result **oall = trie_find_all (other, target);
+
+    for (; *all && *oall; ++all, ++oall)
+        ASSERT (strcmp ((*all)->key, (*oall)->key) == 0, "target = %s, key = %s, other key = %s\n",
+                target, (*all)->key, (*oall)->key);
+    ASSERT (*all == 0 && *oall == 0, "target = %s\n", target);
+    for (int m = 0; m < 3; ++m)
+        ASSERT (trie_has (trie, target, m) == trie_has (other, target, m),
+                "target = %s, prefer fuzzy = %d\n", target, m);
+}
+
+struct lookup_job {
+    const void *trie;
+    const char **keys; /* Look up these keys, if not null. */
+    const struct result **expected; /* The expected trie_find_r of keys. */
+    int nlookups;
+    unsigned seed;
+    long nfound;
+    int nmismatches;
+};
+
+// Look up job->keys or random keys in job->trie with the re-entrant
+// functions.
+static
+void *lookup_thread (void *arg)
+{
+    struct lookup_job *job = arg;
+    const struct result **found;
+    char key[64];
+
+    found = malloc (trie_found_size (job->trie) * sizeof *found);
+    assert (found);
+    for (int k = 0; k < job->nlookups; ++k) {
+        if (job->keys) {
+            const char *target = job->keys[k % 8];
+            const struct result *r = trie_find_r (job->trie, target, found);
+            job->nmismatches += r != job->expected[k % 8];
+            job->nmismatches += trie_has (job->trie, target, k % 2) != (r != 0);
+            continue;
+        }
+        random_key (key, sizeof key, &job->seed);
+        job->nfound += trie_find_all_r (job->trie, key, found)[0] != 0;
+    }
+    free (found);
+    return 0;
+}
+
+// Run NTHREADS threads of lookup_thread.
+static
+void run_lookup_threads (struct lookup_job *jobs, int nthreads)
+{
+    pthread_t tid[nthreads];
+    int rc;
+
+    for (int k = 0; k < nthreads; ++k) {
+        rc = pthread_create (&tid[k], 0, lookup_thread, &jobs[k]);
+        assert (rc == 0);
+    }
+    for (int k = 0; k < nthreads; ++k) {
+        rc = pthread_join (tid[k], 0);
+        assert (rc == 0);
+    }
+}
+
 static
 int run_test (long test, int argc, char *argv[])
 {
     int rc, size, retcode;
     const struct result *found;
-    void *trie;
+    void *trie, *it;
     const char userdata[] = "hello, world";
 
-    printf ("test %ld\n", test);
+    printf ("test %ld, flags %d\n", test, trie_flags);
     retcode = 0;
 
     const int maxklen = 64; // Max length of a key.
     const int nkeys = argc > 2 ? atoi (argv[2]) : 16;
-    trie = trie_init (nkeys, maxklen * nkeys, 1);
+    trie = trie_init (nkeys, maxklen * nkeys, 1, trie_flags);
     size = trie_size (trie);
     ASSERT (size == 0, "size = %d\n", size);
 
@@ -86,8 +275,16 @@ int run_test (long test, int argc, char *argv[])
         rc = trie_has (trie, "hello.o", 1);
         ASSERT (rc == 0);
 
+        rc = trie_has (trie, "hello.o", trie_prefer_auto);
+        ASSERT (rc == 0);
+
         found = trie_find (trie, "hello.o");
         ASSERT (found == 0, "found = %p\n", found);
+
+        it = trie_iter_begin (trie);
+        found = trie_iter_next (it);
+        ASSERT (found == 0, "found = %p\n", found);
+        trie_iter_end (it);
         break;
     case 1:
         // Test explicit match.
@@ -99,6 +296,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc);
         rc = trie_has (trie, "hello", 1);
         ASSERT (rc);
+        rc = trie_has (trie, "hello", trie_prefer_auto);
+        ASSERT (rc);
 
         found = trie_find (trie, "hello");
         ASSERT (found, "found = %p\n", found);
@@ -111,6 +310,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc == 0);
         rc = trie_has (trie, "", 1);
         ASSERT (rc == 0);
+        rc = trie_has (trie, "", trie_prefer_auto);
+        ASSERT (rc == 0);
         found = trie_find (trie, "");
         ASSERT (found == 0, "found = %p\n", found);
         trie_push (trie, "", userdata);
@@ -118,6 +319,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc);
         rc = trie_has (trie, "", 1);
         ASSERT (rc);
+        rc = trie_has (trie, "", trie_prefer_auto);
+        ASSERT (rc);
         found = trie_find (trie, "");
         ASSERT (found, "found = %p\n", found);
         ASSERT (found->key && *found->key == '\0', "found->key = %s\n", found->key);
@@ -143,6 +346,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc == 0);
         rc = trie_has (trie, "hello", 1);
         ASSERT (rc == 0);
+        rc = trie_has (trie, "hello", trie_prefer_auto);
+        ASSERT (rc == 0);
         found = trie_find (trie, "hello");
         ASSERT (found == 0, "found = %p\n", found);
 
@@ -150,6 +355,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc);
         rc = trie_has (trie, "hell", 1);
         ASSERT (rc);
+        rc = trie_has (trie, "hell", trie_prefer_auto);
+        ASSERT (rc);
         found = trie_find (trie, "hell");
         ASSERT (found, "found = %p\n", found);
         ASSERT (strcmp (found->key, "hell") == 0, "found->key = %s\n", found->key);
@@ -161,6 +368,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc);
         rc = trie_has (trie, "hello", 1);
         ASSERT (rc);
+        rc = trie_has (trie, "hello", trie_prefer_auto);
+        ASSERT (rc);
         found = trie_find (trie, "hello");
         ASSERT (found, "found = %p\n", found);
         ASSERT (strcmp (found->key, "hello") == 0, "found->key = %s\n", found->key);
@@ -181,6 +390,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc);
         rc = trie_has (trie, "hello", 1);
         ASSERT (rc);
+        rc = trie_has (trie, "hello", trie_prefer_auto);
+        ASSERT (rc);
         found = trie_find (trie, "hello");
         ASSERT (found, "found = %p\n", found);
         ASSERT (strcmp (found->key, "%lo") == 0, "found->key = %s\n", found->key);
@@ -197,6 +408,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc == 0);
         rc = trie_has (trie, "hello.g", 1);
         ASSERT (rc == 0);
+        rc = trie_has (trie, "hello.g", trie_prefer_auto);
+        ASSERT (rc == 0);
         found = trie_find (trie, "hello.g");
         ASSERT (found == 0, "found = %p\n", found);
         break;
@@ -208,6 +421,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc);
         rc = trie_has (trie, "hello.o", 1);
         ASSERT (rc);
+        rc = trie_has (trie, "hello.o", trie_prefer_auto);
+        ASSERT (rc);
         found = trie_find (trie, "hello.o");
         ASSERT (found, "found = %p\n", found);
         ASSERT (strcmp (found->key, "hello.o") == 0, "found->key = %s\n", found->key);
@@ -219,6 +434,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc == 0);
         rc = trie_has (trie, "", 1);
         ASSERT (rc == 0);
+        rc = trie_has (trie, "", trie_prefer_auto);
+        ASSERT (rc == 0);
         found = trie_find (trie, "");
         ASSERT (found == 0, "found = %p\n", found);
 
@@ -231,6 +448,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc == 0);
         rc = trie_has (trie, "", 1);
         ASSERT (rc == 0);
+        rc = trie_has (trie, "", trie_prefer_auto);
+        ASSERT (rc == 0);
         found = trie_find (trie, "");
         ASSERT (found == 0, "found = %p\n", found);
 
@@ -238,6 +457,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc);
         rc = trie_has (trie, "hello.o", 1);
         ASSERT (rc);
+        rc = trie_has (trie, "hello.o", trie_prefer_auto);
+        ASSERT (rc);
         found = trie_find (trie, "hello.o");
         ASSERT (found, "found = %p\n", found);
         ASSERT (strcmp (found->key, "%") == 0, "found->key = %s\n", found->key);
@@ -249,6 +470,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc == 0);
         rc = trie_has (trie, "", 1);
         ASSERT (rc == 0);
+        rc = trie_has (trie, "", trie_prefer_auto);
+        ASSERT (rc == 0);
         found = trie_find (trie, "");
         ASSERT (found == 0, "found = %p\n", found);
 
@@ -261,6 +484,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc == 0);
         rc = trie_has (trie, "hello.o", 1);
         ASSERT (rc == 0);
+        rc = trie_has (trie, "hello.o", trie_prefer_auto);
+        ASSERT (rc == 0);
         found = trie_find (trie, "hello.o");
         ASSERT (found == 0, "found = %p\n", found);
 
@@ -268,6 +493,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc);
         rc = trie_has (trie, "hello.oo", 1);
         ASSERT (rc);
+        rc = trie_has (trie, "hello.oo", trie_prefer_auto);
+        ASSERT (rc);
         found = trie_find (trie, "hello.oo");
         ASSERT (found, "found = %p\n", found);
         ASSERT (strcmp (found->key, "hello.o%") == 0, "found->key = %s\n", found->key);
@@ -288,6 +515,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc);
         rc = trie_has (trie, "hello.o", 1);
         ASSERT (rc);
+        rc = trie_has (trie, "hello.o", trie_prefer_auto);
+        ASSERT (rc);
         found = trie_find (trie, "hello.o");
         ASSERT (found, "found = %p\n", found);
         ASSERT (strcmp (found->key, "h%llo.o") == 0, "found->key = %s\n", found->key);
@@ -307,6 +536,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc);
         rc = trie_has (trie, "hello.o", 1);
         ASSERT (rc);
+        rc = trie_has (trie, "hello.o", trie_prefer_auto);
+        ASSERT (rc);
         found = trie_find (trie, "hello.o");
         ASSERT (found, "found = %p\n", found);
         ASSERT (strcmp (found->key, "hello.o") == 0, "found->key = %s\n", found->key);
@@ -324,6 +555,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc);
         rc = trie_has (trie, "hello.o", 1);
         ASSERT (rc);
+        rc = trie_has (trie, "hello.o", trie_prefer_auto);
+        ASSERT (rc);
         found = trie_find (trie, "hello.o");
         ASSERT (found, "found = %p\n", found);
         ASSERT (strcmp (found->key, "hell%.o") == 0, "found->key = %s\n", found->key);
@@ -333,6 +566,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc);
         rc = trie_has (trie, "hello.o", 1);
         ASSERT (rc);
+        rc = trie_has (trie, "hello.o", trie_prefer_auto);
+        ASSERT (rc);
         found = trie_find (trie, "hello.o");
         ASSERT (found, "found = %p\n", found);
         ASSERT (strcmp (found->key, "hell%.o") == 0, "found->key = %s\n", found->key);
@@ -345,7 +580,7 @@ int run_test (long test, int argc, char *argv[])
         const size_t keysz = 64 * 1024 + 5;
 
         trie_free (trie);
-        trie = trie_init (2, 2*keysz, 0);
+        trie = trie_init (2, 2*keysz, 0, trie_flags);
 
         key = malloc(keysz);
         ASSERT (key);
@@ -357,6 +592,8 @@ int run_test (long test, int argc, char *argv[])
 //        ASSERT (rc == 0);
         rc = trie_has (trie, key, 1);
         ASSERT (rc == 0);
+        rc = trie_has (trie, key, trie_prefer_auto);
+        ASSERT (rc == 0);
         found = trie_find (trie, key);
         ASSERT (found == 0, "found = %p\n", found);
 
@@ -366,6 +603,8 @@ int run_test (long test, int argc, char *argv[])
 //        ASSERT (rc);
         rc = trie_has (trie, key, 1);
         ASSERT (rc);
+        rc = trie_has (trie, key, trie_prefer_auto);
+        ASSERT (rc);
         found = trie_find (trie, key);
         ASSERT (found, "found = %p\n", found);
         ASSERT (strcmp (found->key, "y%y") == 0, "found->key = %s\n", found->key);
@@ -377,6 +616,8 @@ int run_test (long test, int argc, char *argv[])
 //        ASSERT (rc);
         rc = trie_has (trie, key, 1);
         ASSERT (rc);
+        rc = trie_has (trie, key, trie_prefer_auto);
+        ASSERT (rc);
         found = trie_find (trie, key);
         ASSERT (found, "found = %p\n", found);
         ASSERT (strcmp (found->key, "y%y") == 0, "found->key = %s\n", found->key);
@@ -393,6 +634,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc == 0);
         rc = trie_has (trie, "he%lo.o", 1);
         ASSERT (rc == 0);
+        rc = trie_has (trie, "he%lo.o", trie_prefer_auto);
+        ASSERT (rc == 0);
         found = trie_find (trie, "he%lo.o");
         ASSERT (found == 0, "found = %p\n", found);
         break;
@@ -407,6 +650,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc == 0);
         rc = trie_has (trie, "hello.o", 1);
         ASSERT (rc == 0);
+        rc = trie_has (trie, "hello.o", trie_prefer_auto);
+        ASSERT (rc == 0);
         found = trie_find (trie, "hello.o");
         ASSERT (found == 0, "found = %p\n", found);
         break;
@@ -422,6 +667,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc);
         rc = trie_has (trie, "he%lo.o", 1);
         ASSERT (rc);
+        rc = trie_has (trie, "he%lo.o", trie_prefer_auto);
+        ASSERT (rc);
         found = trie_find (trie, "he%lo.o");
         ASSERT (found, "found = %p\n", found);
         ASSERT (strcmp (found->key, "he\\%lo.o") == 0, "found->key =%s\n", found->key);
@@ -439,6 +686,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc == 0);
         rc = trie_has (trie, "he\\%lo.o", 1);
         ASSERT (rc == 0);
+        rc = trie_has (trie, "he\\%lo.o", trie_prefer_auto);
+        ASSERT (rc == 0);
         found = trie_find (trie, "he\\%lo.o");
         ASSERT (found == 0, "found = %p\n", found);
         break;
@@ -454,6 +703,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc == 0);
         rc = trie_has (trie, "he\\%lo.o", 1);
         ASSERT (rc == 0);
+        rc = trie_has (trie, "he\\%lo.o", trie_prefer_auto);
+        ASSERT (rc == 0);
         found = trie_find (trie, "he\\%lo.o");
         ASSERT (found == 0, "found = %p\n", found);
         break;
@@ -469,6 +720,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc);
         rc = trie_has (trie, "he\\alo.o", 1);
         ASSERT (rc);
+        rc = trie_has (trie, "he\\alo.o", trie_prefer_auto);
+        ASSERT (rc);
         found = trie_find (trie, "he\\alo.o");
         ASSERT (found, "found = %p\n", found);
         ASSERT (strcmp (found->key, "he\\\\%lo.o") == 0, "found->key =%s\n", found->key);
@@ -488,6 +741,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc);
         rc = trie_has (trie, "he\\\\alo.o", 1);
         ASSERT (rc);
+        rc = trie_has (trie, "he\\\\alo.o", trie_prefer_auto);
+        ASSERT (rc);
         found = trie_find (trie, "he\\\\alo.o");
         ASSERT (found, "found = %p\n", found);
         ASSERT (strcmp (found->key, "he\\\\\\\\%lo.o") == 0, "found->key =%s\n", found->key);
@@ -506,6 +761,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc == 0);
         rc = trie_has (trie, "he\\aaalo.o", 1);
         ASSERT (rc == 0);
+        rc = trie_has (trie, "he\\aaalo.o", trie_prefer_auto);
+        ASSERT (rc == 0);
         found = trie_find (trie, "he\\aaalo.o");
         ASSERT (found == 0, "found = %p\n", found);
 
@@ -513,6 +770,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc);
         rc = trie_has (trie, "he\\%lo.o", 1);
         ASSERT (rc);
+        rc = trie_has (trie, "he\\%lo.o", trie_prefer_auto);
+        ASSERT (rc);
         found = trie_find (trie, "he\\%lo.o");
         ASSERT (found, "found = %p\n", found);
         ASSERT (strcmp (found->key, "he\\\\\\%lo.o") == 0, "found->key =%s\n", found->key);
@@ -526,6 +785,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc);
         rc = trie_has (trie, "he\\lo.o", 1);
         ASSERT (rc);
+        rc = trie_has (trie, "he\\lo.o", trie_prefer_auto);
+        ASSERT (rc);
         found = trie_find (trie, "he\\lo.o");
         ASSERT (found, "found = %p\n", found);
         ASSERT (strcmp (found->key, "he\\lo.o") == 0, "found->key =%s\n", found->key);
@@ -538,6 +799,8 @@ int run_test (long test, int argc, char *argv[])
         rc = trie_has (trie, "he\\\\lo.o", 0);
         ASSERT (rc);
         rc = trie_has (trie, "he\\\\lo.o", 1);
+        ASSERT (rc);
+        rc = trie_has (trie, "he\\\\lo.o", trie_prefer_auto);
         ASSERT (rc);
          found = trie_find (trie, "he\\\\lo.o");
         ASSERT (found, "found = %p\n", found);
@@ -551,6 +814,8 @@ int run_test (long test, int argc, char *argv[])
         rc = trie_has (trie, "hello.\\", 0);
         ASSERT (rc);
         rc = trie_has (trie, "hello.\\", 1);
+        ASSERT (rc);
+        rc = trie_has (trie, "hello.\\", trie_prefer_auto);
         ASSERT (rc);
          found = trie_find (trie, "hello.\\");
         ASSERT (found, "found = %p\n", found);
@@ -565,6 +830,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc);
         rc = trie_has (trie, "hello.\\\\", 1);
         ASSERT (rc);
+        rc = trie_has (trie, "hello.\\\\", trie_prefer_auto);
+        ASSERT (rc);
         found = trie_find (trie, "hello.\\\\");
         ASSERT (found, "found = %p\n", found);
         ASSERT (strcmp (found->key, "hello.\\\\") == 0, "found->key =%s\n", found->key);
@@ -592,6 +859,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc);
         rc = trie_has (trie, "obj/hello.o", 1);
         ASSERT (rc);
+        rc = trie_has (trie, "obj/hello.o", trie_prefer_auto);
+        ASSERT (rc);
         found = trie_find (trie, "obj/hello.o");
         ASSERT (found, "found = %p\n", found);
         ASSERT (strcmp (found->key, "obj/hello.o") == 0, "found->key =%s\n", found->key);
@@ -606,6 +875,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc == 0);
         rc = trie_has (trie, "hello.o", 1);
         ASSERT (rc == 0);
+        rc = trie_has (trie, "hello.o", trie_prefer_auto);
+        ASSERT (rc == 0);
         found = trie_find (trie, "hello.o");
         ASSERT (found == 0, "found = %p\n", found);
         break;
@@ -618,6 +889,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc);
         rc = trie_has (trie, "obj/hello.o", 1);
         ASSERT (rc);
+        rc = trie_has (trie, "obj/hello.o", trie_prefer_auto);
+        ASSERT (rc);
         found = trie_find (trie, "obj/hello.o");
         ASSERT (found, "found = %p\n", found);
         ASSERT (strcmp (found->key, "obj/%.o") == 0, "found->key =%s\n", found->key);
@@ -642,6 +915,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc);
         rc = trie_has (trie, "obj/hello.o", 1);
         ASSERT (rc);
+        rc = trie_has (trie, "obj/hello.o", trie_prefer_auto);
+        ASSERT (rc);
         found = trie_find (trie, "obj/hello.o");
         ASSERT (found, "found = %p\n", found);
         ASSERT (strcmp (found->key, "obj/hel%o.o") == 0, "found->key =%s\n", found->key);
@@ -656,6 +931,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc == 0);
         rc = trie_has (trie, "obj/hello.o", 1);
         ASSERT (rc == 0);
+        rc = trie_has (trie, "obj/hello.o", trie_prefer_auto);
+        ASSERT (rc == 0);
         found = trie_find (trie, "obj/hello.o");
         ASSERT (found == 0, "found = %p\n", found);
         break;
@@ -670,6 +947,8 @@ int run_test (long test, int argc, char *argv[])
         ASSERT (rc);
         rc = trie_has (trie, "obj/hello.o", 1);
         ASSERT (rc);
+        rc = trie_has (trie, "obj/hello.o", trie_prefer_auto);
+        ASSERT (rc);
         found = trie_find (trie, "obj/hello.o");
         ASSERT (found, "found = %p\n", found);
         ASSERT (strcmp (found->key, "%.o") == 0, "found->key =%s\n", found->key);
@@ -695,11 +974,1308 @@ int run_test (long test, int argc, char *argv[])
 
         rc = trie_has (trie, "hello", 1);
         ASSERT (rc);
+
+        rc = trie_has (trie, "hello", trie_prefer_auto);
+        ASSERT (rc);
         break;
+    case 35: {
+        // Test that a trie saved with trie_save and opened with trie_open_mmap
+        // finds the same keys as the original trie.
+        char path[] = "/tmp/trie.t.XXXXXX";
+        const char *keys[] = {"hello.o", "%.o", "h%.o", "obj/%.o", "he\\%lo.o", "", 0};
+        const char *targets[] = {"hello.o", "hallo.o", "obj/hello.o", "he%lo.o", "x.c", "", 0};
+        void *mapped;
+        const struct result **all, **mall;
+        int fd;
+
+        // Enough keys to fill more than one chunk of nodes.
+        randomize_trie (trie, maxklen, 2000);
+        for (int k = 0; keys[k]; ++k)
+            trie_push (trie, keys[k], keys[k]);
+        fd = mkstemp (path);
+        ASSERT (fd >= 0);
+        close (fd);
+        rc = trie_save (trie, path);
+        ASSERT (rc == 0, "rc = %d\n", rc);
+        mapped = trie_open_mmap (path, 1, trie_flags);
+        ASSERT (mapped);
+        if (mapped == 0) {
+            unlink (path);
+            break;
+        }
+        size = trie_size (mapped);
+        ASSERT (size == trie_size (trie), "size = %d\n", size);
+        for (int k = 0; targets[k]; ++k) {
+            ASSERT (trie_has (mapped, targets[k], 0) == trie_has (trie, targets[k], 0));
+            ASSERT (trie_has (mapped, targets[k], 1) == trie_has (trie, targets[k], 1));
+            all = trie_find_all (trie, targets[k]);
+            mall = trie_find_all (mapped, targets[k]);
+            for (; *all && *mall; ++all, ++mall) {
+                ASSERT (strcmp ((*all)->key, (*mall)->key) == 0, "key = %s, mapped key = %s\n", (*all)->key, (*mall)->key);
+                ASSERT ((*all)->userdata == (*mall)->userdata);
+                ASSERT ((*all)->order == (*mall)->order);
+            }
+            ASSERT (*all == 0 && *mall == 0, "target = %s\n", targets[k]);
+        }
+        found = trie_find (mapped, "hello.o");
+        ASSERT (found && strcmp (found->key, "hello.o") == 0);
+        // A mapped trie is read-only.
+        rc = trie_push (mapped, "bye.o", userdata);
+        ASSERT (rc == -2, "rc = %d\n", rc);
+        size = trie_size (mapped);
+        ASSERT (size == trie_size (trie), "size = %d\n", size);
+
+        // Saving over the mapped file, from another trie and from the mapped
+        // trie itself, leaves the mapping intact.
+        rc = trie_push (trie, "bye.o", userdata);
+        ASSERT (rc == 0, "rc = %d\n", rc);
+        rc = trie_save (trie, path);
+        ASSERT (rc == 0, "rc = %d\n", rc);
+        found = trie_find (mapped, "hello.o");
+        ASSERT (found && strcmp (found->key, "hello.o") == 0);
+        found = trie_find (mapped, "bye.o");
+        ASSERT (found && strcmp (found->key, "%.o") == 0);
+        rc = trie_save (mapped, path);
+        ASSERT (rc == 0, "rc = %d\n", rc);
+        found = trie_find (mapped, "obj/hello.o");
+        ASSERT (found && strcmp (found->key, "obj/%.o") == 0);
+        trie_free (mapped);
+        mapped = trie_open_mmap (path, 1, trie_flags);
+        unlink (path);
+        ASSERT (mapped);
+        if (mapped == 0)
+            break;
+        size = trie_size (mapped);
+        ASSERT (size == trie_size (trie) - 1, "size = %d\n", size);
+        found = trie_find (mapped, "bye.o");
+        ASSERT (found && strcmp (found->key, "%.o") == 0);
+        trie_free (mapped);
+
+        // A save, which fails, leaves no file behind.
+        rc = trie_save (trie, "/nonexistent/trie.img");
+        ASSERT (rc == -1 && errno == ENOENT, "rc = %d\n", rc);
+
+        // A file which is not a trie image.
+        strcpy (path, "/tmp/trie.t.XXXXXX");
+        fd = mkstemp (path);
+        ASSERT (fd >= 0);
+        rc = write (fd, "hello, world\n", 13);
+        ASSERT (rc == 13);
+        close (fd);
+        mapped = trie_open_mmap (path, 1, trie_flags);
+        unlink (path);
+        ASSERT (mapped == 0);
+        break;
+    }
+    case 36: {
+        // Test the stems of the found matches.
+        const char *key = "he%lxx.o";
+        const size_t klen = strlen (key);
+        const struct result **all;
+        const char *stem;
+        size_t stemlen;
+
+        trie_push (trie, "h%.o", userdata);
+        trie_push (trie, "%", userdata);
+        trie_push (trie, "he\\%l%.o", userdata);
+        trie_push (trie, "he%lxx.o%", userdata);
+        trie_push (trie, "he\\%lxx.o", userdata);
+
+        all = trie_find_all (trie, key);
+        ASSERT (all[0] && strcmp (all[0]->key, "he\\%lxx.o") == 0);
+        stem = trie_stem (all[0], key, klen, &stemlen);
+        ASSERT (stem == 0, "stem = %s\n", stem);
+        ASSERT (all[0]->prefixlen == 8, "prefixlen = %d\n", all[0]->prefixlen);
+        ASSERT (all[0]->suffixlen == -1, "suffixlen = %d\n", all[0]->suffixlen);
+
+        ASSERT (all[1] && strcmp (all[1]->key, "he\\%l%.o") == 0);
+        stem = trie_stem (all[1], key, klen, &stemlen);
+        ASSERT (stem == key + 4 && stemlen == 2, "stem = %s, stemlen = %zu\n", stem, stemlen);
+
+        ASSERT (all[2] && strcmp (all[2]->key, "h%.o") == 0);
+        stem = trie_stem (all[2], key, klen, &stemlen);
+        ASSERT (stem == key + 1 && stemlen == 5, "stem = %s, stemlen = %zu\n", stem, stemlen);
+
+        ASSERT (all[3] && strcmp (all[3]->key, "%") == 0);
+        stem = trie_stem (all[3], key, klen, &stemlen);
+        ASSERT (stem == key && stemlen == klen, "stem = %s, stemlen = %zu\n", stem, stemlen);
+        ASSERT (all[4] == 0);
+        break;
+    }
+    case 37: {
+        // Test concurrent lookups in one trie.
+        const char *keys[] = {"hello.o", "hallo.o", "obj/hello.o", "he%lo.o",
+                              "x.c", "", "obj/x.c", "hello.c"};
+        const struct result *expected[8];
+        struct lookup_job jobs[4];
+
+        trie_push (trie, "hello.o", userdata);
+        trie_push (trie, "%.o", userdata);
+        trie_push (trie, "h%.o", userdata);
+        trie_push (trie, "obj/%.o", userdata);
+        trie_push (trie, "he\\%lo.o", userdata);
+        trie_push (trie, "obj/%", userdata);
+        for (int k = 0; k < 8; ++k)
+            expected[k] = trie_find (trie, keys[k]);
+        memset (jobs, 0, sizeof jobs);
+        for (int k = 0; k < 4; ++k) {
+            jobs[k].trie = trie;
+            jobs[k].keys = keys;
+            jobs[k].expected = expected;
+            jobs[k].nlookups = 1000;
+        }
+        run_lookup_threads (jobs, 4);
+        for (int k = 0; k < 4; ++k)
+            ASSERT (jobs[k].nmismatches == 0, "thread %d, nmismatches = %d\n", k, jobs[k].nmismatches);
+        break;
+    }
+    case 38: {
+        // Test trie_find_all_batch.
+        const char *keys[] = {"obj/hello.o", "hello.o", "obj/x.c", "obj/hello.o",
+                              "", "he%lo.o", "obj/he", "hallo.o", "x"};
+        const int n = sizeof keys / sizeof *keys;
+        const struct result **lists[n], *out[64], **all, **list;
+        int used;
+
+        trie_push (trie, "hello.o", userdata);
+        trie_push (trie, "%.o", userdata);
+        trie_push (trie, "h%.o", userdata);
+        trie_push (trie, "obj/%.o", userdata);
+        trie_push (trie, "obj/hello.o", userdata);
+        trie_push (trie, "he\\%lo.o", userdata);
+        trie_push (trie, "obj/%", userdata);
+        trie_push (trie, "%", userdata);
+        used = trie_find_all_batch (trie, keys, n, lists, out, 64);
+        ASSERT (used > n, "used = %d\n", used);
+        for (int k = 0; k < n; ++k) {
+            all = trie_find_all (trie, keys[k]);
+            for (list = lists[k]; *all && *all == *list; ++all, ++list)
+                ;
+            ASSERT (*all == 0 && *list == 0, "key %s\n", keys[k]);
+        }
+        used = trie_find_all_batch (trie, keys, n, lists, out, n);
+        ASSERT (used == -1, "used = %d\n", used);
+        used = trie_find_all_batch (trie, keys, 0, lists, out, 0);
+        ASSERT (used == 0, "used = %d\n", used);
+        break;
+    }
+    case 39: {
+        // Test the trie iterator.
+        char longkey[301];
+        const char *expected[] = {"%.o", "a", "h%.o", "he\\%lo.o", "hell",
+                                  "hello.o", longkey};
+        const int n = sizeof expected / sizeof *expected;
+        const struct result *r;
+        int k;
+
+        memset (longkey, 'x', sizeof longkey - 1);
+        longkey[sizeof longkey - 1] = '\0';
+        for (k = n - 1; k >= 0; --k)
+            trie_push (trie, expected[k], userdata);
+        it = trie_iter_begin (trie);
+        for (k = 0; (r = trie_iter_next (it)); ++k) {
+            ASSERT (k < n, "k = %d\n", k);
+            ASSERT (strcmp (r->key, expected[k]) == 0, "k = %d, key = %s\n", k, r->key);
+        }
+        ASSERT (k == n, "k = %d\n", k);
+        r = trie_iter_next (it);
+        ASSERT (r == 0);
+        trie_iter_end (it);
+        break;
+    }
+    case 40: {
+        // Test that trie_has finds the same answer with every preference on
+        // random patterns and targets of a small alphabet.
+        const char alphabet[] = "ab%";
+        char key[16];
+        unsigned seed = 1;
+        int k, m, len, has[3];
+
+        for (k = 0; k < 2000; ++k) {
+            len = rand_r (&seed) % 9;
+            for (m = 0; m < len; ++m)
+                key[m] = alphabet[rand_r (&seed) % 3];
+            key[len] = '\0';
+            trie_push (trie, key, userdata); // Some keys are malformed.
+        }
+        for (k = 0; k < 2000; ++k) {
+            len = rand_r (&seed) % 12;
+            for (m = 0; m < len; ++m)
+                key[m] = alphabet[rand_r (&seed) % 2];
+            key[len] = '\0';
+            for (m = 0; m < 3; ++m)
+                has[m] = trie_has (trie, key, m);
+            found = trie_find (trie, key);
+            ASSERT (has[trie_prefer_auto] == (found != 0), "key = %s\n", key);
+            ASSERT (has[trie_prefer_exact] == has[trie_prefer_auto], "key = %s\n", key);
+            ASSERT (has[trie_prefer_fuzzy] == has[trie_prefer_auto], "key = %s\n", key);
+        }
+        break;
+    }
+    case 41: {
+        // Test that both engines find the same matches in the same order on
+        // random patterns and targets of a small alphabet.
+        void *other = trie_init (0, 0, 0, trie_flags ^ trie_engine_nfa);
+        char key[16];
+        unsigned seed = 1;
+
+        for (int k = 0; k < 2000; ++k) {
+            random_alphabet_key (key, 9, "ab%\\", &seed);
+            rc = trie_push (trie, key, userdata);
+            ASSERT (trie_push (other, key, userdata) == rc, "key = %s\n", key);
+        }
+        for (int k = 0; k < 2000; ++k) {
+            random_alphabet_key (key, 12, "ab%", &seed);
+            compare_lookups (trie, other, key);
+        }
+        trie_free (other);
+        break;
+    }
+    case 42: {
+        // Test that a trie with the suffix index finds the same matches in the
+        // same order as a trie without one on random patterns and targets of
+        // a small alphabet.
+        void *other = trie_init (0, 0, 0, trie_flags ^ trie_suffix_index);
+        char key[16];
+        unsigned seed = 1;
+
+        for (int k = 0; k < 3000; ++k) {
+            random_alphabet_key (key, 11, "ab/.%\\", &seed);
+            rc = trie_push (trie, key, userdata);
+            ASSERT (trie_push (other, key, userdata) == rc, "key = %s\n", key);
+        }
+        for (int k = 0; k < 3000; ++k) {
+            random_alphabet_key (key, 15, "ab/.%", &seed);
+            compare_lookups (trie, other, key);
+        }
+        trie_free (other);
+        break;
+    }
+    case 43: {
+        // Test trie_remove and trie_replace.
+        const char other[] = "other";
+        const struct result **all;
+        void *it;
+
+        trie_push (trie, "hello.o", userdata);
+        trie_push (trie, "h%.o", userdata);
+        trie_push (trie, "%.o", userdata);
+        trie_push (trie, "hell", userdata);
+        trie_push (trie, "he\\%lo.o", userdata);
+        rc = trie_remove (trie, "hello.o");
+        ASSERT (rc == 0, "rc = %d\n", rc);
+        rc = trie_remove (trie, "hello.o");
+        ASSERT (rc == 1, "rc = %d\n", rc);
+        rc = trie_remove (trie, "hel");
+        ASSERT (rc == 1, "rc = %d\n", rc);
+        rc = trie_remove (trie, "%%");
+        ASSERT (rc == -1, "rc = %d\n", rc);
+        size = trie_size (trie);
+        ASSERT (size == 4, "size = %d\n", size);
+        for (int k = 0; k < 3; ++k) {
+            rc = trie_has (trie, "hell", k);
+            ASSERT (rc);
+        }
+        all = trie_find_all (trie, "hello.o");
+        ASSERT (all[0] && strcmp (all[0]->key, "h%.o") == 0);
+        ASSERT (all[1] && strcmp (all[1]->key, "%.o") == 0);
+        ASSERT (all[2] == 0);
+
+        rc = trie_remove (trie, "h%.o");
+        ASSERT (rc == 0, "rc = %d\n", rc);
+        found = trie_find (trie, "hello.o");
+        ASSERT (found && strcmp (found->key, "%.o") == 0);
+        found = trie_find (trie, "he%lo.o");
+        ASSERT (found && strcmp (found->key, "he\\%lo.o") == 0);
+        rc = trie_remove (trie, "he\\%lo.o");
+        ASSERT (rc == 0, "rc = %d\n", rc);
+        found = trie_find (trie, "he%lo.o");
+        ASSERT (found && strcmp (found->key, "%.o") == 0);
+
+        // A key pushed again is younger than the others of the same length.
+        rc = trie_push (trie, "h%.o", userdata);
+        ASSERT (rc == 0, "rc = %d\n", rc);
+        rc = trie_push (trie, "x%.o", userdata);
+        ASSERT (rc == 0, "rc = %d\n", rc);
+        rc = trie_remove (trie, "h%.o");
+        ASSERT (rc == 0, "rc = %d\n", rc);
+        rc = trie_push (trie, "h%.o", userdata);
+        ASSERT (rc == 0, "rc = %d\n", rc);
+        rc = trie_push (trie, "%x.o", userdata);
+        ASSERT (rc == 0, "rc = %d\n", rc);
+        all = trie_find_all (trie, "hx.o");
+        ASSERT (all[0] && strcmp (all[0]->key, "h%.o") == 0);
+        ASSERT (all[1] && strcmp (all[1]->key, "%x.o") == 0);
+
+        // A replaced key keeps its age.
+        rc = trie_replace (trie, "h%.o", other);
+        ASSERT (rc == 0, "rc = %d\n", rc);
+        rc = trie_replace (trie, "y%.o", other);
+        ASSERT (rc == 1, "rc = %d\n", rc);
+        rc = trie_replace (trie, "%%", other);
+        ASSERT (rc == -1, "rc = %d\n", rc);
+        all = trie_find_all (trie, "hx.o");
+        ASSERT (all[0] && strcmp (all[0]->key, "h%.o") == 0);
+        ASSERT (all[0]->userdata == other);
+        ASSERT (all[1] && strcmp (all[1]->key, "%x.o") == 0);
+        found = trie_find (trie, "yy.o");
+        ASSERT (found && found->userdata == other);
+
+        // Removing every key leaves an empty trie.
+        const char *keys[] = {"hell", "%.o", "x%.o", "h%.o", "%x.o", "y%.o"};
+        for (int k = 0; k < 6; ++k) {
+            rc = trie_remove (trie, keys[k]);
+            ASSERT (rc == 0, "k = %d, rc = %d\n", k, rc);
+        }
+        size = trie_size (trie);
+        ASSERT (size == 0, "size = %d\n", size);
+        it = trie_iter_begin (trie);
+        found = trie_iter_next (it);
+        ASSERT (found == 0);
+        trie_iter_end (it);
+        found = trie_find (trie, "hx.o");
+        ASSERT (found == 0);
+        break;
+    }
+    case 44: {
+        // Test that a trie, from which random keys are removed, finds the
+        // same matches as a trie, to which only the remaining keys are pushed.
+        const char alphabet[] = "ab/.%\\";
+        char keys[1000][16];
+        int pushed[1000], removed[1000] = {0};
+        void *rebuilt = trie_init (0, 0, 0, trie_flags);
+        const struct result **all, **rall;
+        char key[16];
+        unsigned seed = 1;
+        int k, m, len;
+
+        for (k = 0; k < 1000; ++k) {
+            len = rand_r (&seed) % 11;
+            for (m = 0; m < len; ++m)
+                keys[k][m] = alphabet[rand_r (&seed) % 6];
+            keys[k][len] = '\0';
+            pushed[k] = trie_push (trie, keys[k], userdata) == 0;
+        }
+        for (k = 0; k < 1000; ++k)
+            if (pushed[k] && rand_r (&seed) % 2) {
+                rc = trie_remove (trie, keys[k]);
+                ASSERT (rc == 0, "key = %s, rc = %d\n", keys[k], rc);
+                removed[k] = 1;
+            }
+        for (k = 0; k < 1000; ++k)
+            if (pushed[k] && !removed[k])
+                trie_push (rebuilt, keys[k], userdata);
+        size = trie_size (trie);
+        ASSERT (size == trie_size (rebuilt), "size = %d\n", size);
+        for (k = 0; k < 3000; ++k) {
+            len = rand_r (&seed) % 15;
+            for (m = 0; m < len; ++m)
+                key[m] = alphabet[rand_r (&seed) % 5];
+            key[len] = '\0';
+            all = trie_find_all (trie, key);
+            rall = trie_find_all (rebuilt, key);
+            for (; *all && *rall; ++all, ++rall)
+                ASSERT (strcmp ((*all)->key, (*rall)->key) == 0, "key = %s\n", key);
+            ASSERT (*all == 0 && *rall == 0, "key = %s\n", key);
+            for (m = 0; m < 3; ++m)
+                ASSERT (trie_has (trie, key, m) == trie_has (rebuilt, key, m), "key = %s\n", key);
+        }
+        trie_free (rebuilt);
+
+        // Empty the trie, push all keys again and compare with a new trie.
+        for (k = 0; k < 1000; ++k)
+            if (pushed[k] && !removed[k]) {
+                rc = trie_remove (trie, keys[k]);
+                ASSERT (rc == 0, "key = %s, rc = %d\n", keys[k], rc);
+            }
+        size = trie_size (trie);
+        ASSERT (size == 0, "size = %d\n", size);
+        rebuilt = trie_init (0, 0, 0, trie_flags);
+        for (k = 0; k < 1000; ++k)
+            if (pushed[k]) {
+                trie_push (trie, keys[k], userdata);
+                trie_push (rebuilt, keys[k], userdata);
+            }
+        for (k = 0; k < 1000; ++k) {
+            all = trie_find_all (trie, keys[k]);
+            rall = trie_find_all (rebuilt, keys[k]);
+            for (; *all && *rall; ++all, ++rall)
+                ASSERT (strcmp ((*all)->key, (*rall)->key) == 0, "key = %s\n", keys[k]);
+            ASSERT (*all == 0 && *rall == 0, "key = %s\n", keys[k]);
+        }
+        trie_free (rebuilt);
+        break;
+    }
+    case 45: {
+        // Test that the lookup cache is invalidated by trie_push, trie_remove
+        // and trie_replace, and test trie_cache_stats.
+        const char other[] = "other";
+        const struct result **all;
+        size_t hits, misses;
+        const int cached = (trie_flags & trie_lookup_cache) != 0;
+
+        trie_push (trie, "%.o", userdata);
+        trie_push (trie, "a%", userdata);
+        for (int k = 0; k < 3; ++k) {
+            all = trie_find_all (trie, "ab.o");
+            ASSERT (all[0] && strcmp (all[0]->key, "%.o") == 0);
+            ASSERT (all[1] && strcmp (all[1]->key, "a%") == 0);
+            ASSERT (all[2] == 0);
+        }
+        trie_cache_stats (trie, &hits, &misses);
+        ASSERT (hits == 2u * cached && misses == 1u * cached,
+                "hits = %zu, misses = %zu\n", hits, misses);
+
+        trie_push (trie, "ab%", userdata);
+        all = trie_find_all (trie, "ab.o");
+        ASSERT (all[0] && strcmp (all[0]->key, "%.o") == 0);
+        ASSERT (all[1] && strcmp (all[1]->key, "ab%") == 0);
+        ASSERT (all[2] && strcmp (all[2]->key, "a%") == 0);
+        ASSERT (all[3] == 0);
+        rc = trie_replace (trie, "ab%", other);
+        ASSERT (rc == 0, "rc = %d\n", rc);
+        all = trie_find_all (trie, "ab.o");
+        ASSERT (all[1] && all[1]->userdata == other);
+        trie_remove (trie, "ab%");
+        all = trie_find_all (trie, "ab.o");
+        ASSERT (all[0] && strcmp (all[0]->key, "%.o") == 0);
+        ASSERT (all[1] && strcmp (all[1]->key, "a%") == 0);
+        ASSERT (all[2] == 0);
+        trie_replace (trie, "ab.o", other);
+        found = trie_find (trie, "ab.o");
+        ASSERT (found && strcmp (found->key, "ab.o") == 0 && found->userdata == other);
+        trie_cache_stats (trie, &hits, &misses);
+        ASSERT (hits == 3u * cached && misses == 4u * cached,
+                "hits = %zu, misses = %zu\n", hits, misses);
+
+        // More keys than entries and matches, which do not fit an entry.
+        for (int k = 0; k < 20000; ++k) {
+            char key[32];
+            snprintf (key, sizeof key, "b%d", k % 10000);
+            all = trie_find_all (trie, key);
+            ASSERT (all[0] == 0, "key = %s\n", key);
+        }
+        char key[101] = {0}, pattern[101] = {0};
+        memset (key, 'c', 100);
+        for (int k = 1; k <= 80; ++k) {
+            memset (pattern, 'c', k);
+            pattern[k] = '%';
+            trie_push (trie, pattern, userdata);
+        }
+        for (int k = 0; k < 3; ++k) {
+            int n = 0;
+            for (all = trie_find_all (trie, key); *all; ++all)
+                ++n;
+            ASSERT (n == 80, "n = %d\n", n);
+        }
+        break;
+    }
+    case 46: {
+        // Test keys with bytes >= 0x80, e.g. of UTF-8.
+        const struct result **all;
+        const char *stem;
+        size_t stemlen;
+        char key[4] = {0}, prev[4] = {0};
+
+        rc = trie_push (trie, "obj/h\xc3\xa9llo.o", userdata);
+        ASSERT (rc == 0, "rc = %d\n", rc);
+        trie_push (trie, "obj/%.o", userdata);
+        trie_push (trie, "%\xc3\xa9llo.o", userdata);
+        trie_push (trie, "\xc3\xbc" "ber/%", userdata);
+        trie_push (trie, "%.\xe2\x82\xac", userdata);
+        all = trie_find_all (trie, "obj/h\xc3\xa9llo.o");
+        ASSERT (all[0] && strcmp (all[0]->key, "obj/h\xc3\xa9llo.o") == 0);
+        ASSERT (all[1] && strcmp (all[1]->key, "%\xc3\xa9llo.o") == 0);
+        ASSERT (all[2] && strcmp (all[2]->key, "obj/%.o") == 0);
+        ASSERT (all[3] == 0);
+        stem = trie_stem (all[1], "obj/h\xc3\xa9llo.o", 12, &stemlen);
+        ASSERT (stem && stemlen == 5 && memcmp (stem, "obj/h", 5) == 0);
+        found = trie_find (trie, "\xc3\xbc" "ber/a\xc3\xa4");
+        ASSERT (found && strcmp (found->key, "\xc3\xbc" "ber/%") == 0);
+        found = trie_find (trie, "\xc3\xbc");
+        ASSERT (found == 0);
+        found = trie_find (trie, "price.\xe2\x82\xac");
+        ASSERT (found && strcmp (found->key, "%.\xe2\x82\xac") == 0);
+        for (int m = 0; m < 3; ++m) {
+            ASSERT (trie_has (trie, "obj/\xc3\xa9.o", m));
+            ASSERT (trie_has (trie, "\xc3\xbc" "ber/x", m));
+            ASSERT (trie_has (trie, "\xc3\xbc" "be", m) == 0);
+            ASSERT (trie_has (trie, "\xc3", m) == 0);
+        }
+
+        // Every byte after a common first byte, which makes the node of the
+        // first byte grow through all kinds.
+        for (int c = 1; c < 256; ++c) {
+            key[0] = 'x';
+            key[1] = c;
+            rc = trie_push (trie, key, userdata);
+            ASSERT (rc == 0, "c = %d, rc = %d\n", c, rc);
+        }
+        for (int c = 1; c < 256; ++c) {
+            key[1] = c;
+            found = trie_find (trie, key);
+            if (c == '%')
+                continue;
+            ASSERT (found && strcmp (found->key, key) == 0, "c = %d\n", c);
+            for (int m = 0; m < 3; ++m)
+                ASSERT (trie_has (trie, key, m), "c = %d\n", c);
+        }
+        // The iterator returns the bytes in unsigned order.
+        it = trie_iter_begin (trie);
+        while ((found = trie_iter_next (it)))
+            if (found->key[0] == 'x' && found->key[1] != '%') {
+                ASSERT (strcmp (prev, found->key) < 0, "%s, %s\n", prev, found->key);
+                strcpy (prev, found->key);
+            }
+        trie_iter_end (it);
+        ASSERT ((unsigned char) prev[1] == 0xff);
+        for (int c = 0x80; c < 256; ++c) {
+            key[1] = c;
+            rc = trie_remove (trie, key);
+            ASSERT (rc == 0, "c = %d, rc = %d\n", c, rc);
+        }
+        key[1] = '\xe9';
+        found = trie_find (trie, key);
+        ASSERT (found && strcmp (found->key, "x%") == 0);
+        key[1] = 'e';
+        ASSERT (trie_find (trie, key));
+        break;
+    }
+    case 47: {
+        // Test long runs of chars, which keys share or not, against a
+        // reference matcher. Keys over a small alphabet split the runs at
+        // random places, run longer than a segment and end inside runs.
+        enum {nkeys47 = 400, ntargets = 2000, maxklen47 = 120};
+        static char keys[nkeys47][maxklen47];
+        char target[maxklen47];
+        int present[nkeys47] = {0};
+        const struct result **all;
+        unsigned seed = 47;
+        int n, expected;
+
+        for (int k = 0; k < nkeys47; ++k) {
+            random_alphabet_key (keys[k], maxklen47, "ab/", &seed);
+            // A naked % in some keys.
+            if (keys[k][0] && rand_r (&seed) % 3 == 0)
+                keys[k][rand_r (&seed) % strlen (keys[k])] = '%';
+        }
+        for (int round = 0; round < 3; ++round) {
+            for (int k = 0; k < nkeys47; ++k)
+                if (rand_r (&seed) % 2) {
+                    rc = trie_remove (trie, keys[k]);
+                    ASSERT (rc == (present[k] ? 0 : 1), "key = %s, rc = %d\n", keys[k], rc);
+                    for (int j = 0; j < nkeys47; ++j)
+                        present[j] &= strcmp (keys[j], keys[k]) != 0;
+                } else {
+                    rc = trie_push (trie, keys[k], userdata);
+                    // A key can come twice.
+                    if (rc == 0)
+                        for (int j = 0; j < nkeys47; ++j)
+                            present[j] |= strcmp (keys[j], keys[k]) == 0;
+                    ASSERT (rc == 0 || present[k], "key = %s, rc = %d\n", keys[k], rc);
+                }
+            for (int t = 0; t < ntargets; ++t) {
+                if (t < nkeys47)
+                    strcpy (target, keys[t]);
+                else
+                    random_alphabet_key (target, maxklen47, "ab/", &seed);
+                if (strchr (target, '%'))
+                    continue;
+                expected = 0;
+                for (int k = 0; k < nkeys47; ++k)
+                    if (present[k] && pattern_matches (keys[k], target)) {
+                        // Count a key pushed twice once.
+                        int j;
+                        for (j = 0; j < k && strcmp (keys[j], keys[k]); ++j)
+                            ;
+                        expected += j == k;
+                    }
+                n = 0;
+                for (all = trie_find_all (trie, target); *all; ++all, ++n)
+                    ASSERT (pattern_matches ((*all)->key, target), "key = %s, target = %s\n", (*all)->key, target);
+                ASSERT (n == expected, "target = %s, n = %d, expected = %d\n", target, n, expected);
+                for (int m = 0; m < 3; ++m)
+                    ASSERT (trie_has (trie, target, m) == (expected > 0), "target = %s\n", target);
+            }
+            n = 0;
+            it = trie_iter_begin (trie);
+            while ((found = trie_iter_next (it)))
+                ++n;
+            trie_iter_end (it);
+            size = trie_size (trie);
+            ASSERT (n == size, "n = %d, size = %d\n", n, size);
+        }
+        break;
+    }
+    case 48: {
+        // Test that the vector and the scalar scans of a key inside a
+        // wildcard find the same matches in the same order on random
+        // patterns and long targets at every alignment.
+        void *other = trie_init (0, 0, 0, trie_flags ^ trie_scalar_scan);
+        char key[100], *target;
+        unsigned seed = 1;
+        size_t len;
+
+        for (int k = 0; k < 2000; ++k) {
+            random_alphabet_key (key, 9, "ab.%\\\xe9", &seed);
+            rc = trie_push (trie, key, userdata);
+            ASSERT (trie_push (other, key, userdata) == rc, "key = %s\n", key);
+        }
+        for (int k = 0; k < 2000; ++k) {
+            // A target, which ends at the end of its allocation, at any
+            // offset from an aligned address.
+            random_alphabet_key (key, sizeof key, "ab.%\xe9", &seed);
+            len = strlen (key) + 1;
+            target = malloc (k % 32 + len);
+            assert (target);
+            memcpy (target + k % 32, key, len);
+            compare_lookups (trie, other, target + k % 32);
+            free (target);
+        }
+        trie_free (other);
+        break;
+    }
+    case 49: {
+        // Test that trie_stats counts the lookups, their matches and the
+        // work of the backtracking search.
+        const char *keys[] = {"%.o", "obj/%.o", "obj/x.o", "%.c"};
+        const int cached = (trie_flags & trie_lookup_cache) != 0;
+        struct trie_stats st;
+        size_t nodes = 0, matches = 0, sorted = 0;
+        int k;
+
+        for (k = 0; k < (int) (sizeof keys / sizeof *keys); ++k)
+            trie_push (trie, keys[k], userdata);
+        rc = trie_stats (trie, &st);
+        ASSERT (st.lookups == 0, "lookups = %zu\n", st.lookups);
+        if (rc < 0)
+            // The counting is compiled out.
+            break;
+        // The second lookup of obj/a.b.o is answered by the lookup cache,
+        // if there is one, and is not counted.
+        trie_find_all (trie, "obj/a.b.o");
+        trie_find_all (trie, "obj/a.b.o");
+        trie_find_all (trie, "obj/x.o");
+        ASSERT (trie_has (trie, "x.h", trie_prefer_auto) == 0);
+        ASSERT (trie_has (trie, "a.c", trie_prefer_exact) == 1);
+        rc = trie_stats (trie, &st);
+        ASSERT (rc == 0);
+        ASSERT (st.lookups == 5u - cached, "lookups = %zu\n", st.lookups);
+        ASSERT (st.matches == 8u - 2 * cached, "matches = %zu\n", st.matches);
+        ASSERT (st.nodes > 0);
+        ASSERT (st.sorted < st.matches, "sorted = %zu\n", st.sorted);
+        for (k = 0; k < trie_stats_buckets; ++k) {
+            nodes += st.nodes_hist[k];
+            matches += st.matches_hist[k];
+            sorted += st.sorted_hist[k];
+        }
+        ASSERT (nodes == st.lookups && matches == st.lookups && sorted == st.lookups);
+        // A lookup of 3 matches, 2 lookups of 2 matches, unless cached.
+        ASSERT (st.matches_hist[2] == 3u - cached, "matches_hist[2] = %zu\n", st.matches_hist[2]);
+        if (trie_flags == 0) {
+            // The '.' of a.b.o leads below %, where 'b' does not match.
+            ASSERT (st.backtracks > 0);
+            ASSERT (st.max_depth > 0);
+        }
+        // Each thread counts its lookups.
+        struct lookup_job jobs[4];
+        memset (jobs, 0, sizeof jobs);
+        for (k = 0; k < 4; ++k) {
+            jobs[k].trie = trie;
+            jobs[k].nlookups = 100;
+            jobs[k].seed = k + 1;
+        }
+        run_lookup_threads (jobs, 4);
+        trie_stats (trie, &st);
+        ASSERT (st.lookups == 405u - cached, "lookups = %zu\n", st.lookups);
+        break;
+    }
+    case 50: {
+        // Test that trie_build_bulk pushes random keys, with duplicates and
+        // malformed keys, to an empty and to a nonempty trie, like trie_push
+        // in the same order does.
+        enum {nbulk = 3000, nfirst = 500};
+        const char alphabet[] = "ab%\\.";
+        void *other = trie_init (0, 0, 0, trie_flags);
+        char (*keys)[12] = malloc (nbulk * sizeof *keys);
+        const char **kp = malloc (nbulk * sizeof *kp);
+        const void **ud = malloc (nbulk * sizeof *ud);
+        int *brc = malloc (nbulk * sizeof *brc);
+        const struct result *r, *o;
+        char target[16];
+        unsigned seed = 1;
+        int k, npushed = 0;
+
+        assert (keys && kp && ud && brc);
+        for (int pass = 0; pass < 2; ++pass) {
+            const int begin = pass ? nfirst : 0, end = pass ? nbulk : nfirst;
+            for (k = begin; k < end; ++k) {
+                random_alphabet_key (keys[k], 9, alphabet, &seed);
+                kp[k] = keys[k];
+                ud[k] = (const void *) (intptr_t) (k + 1);
+                rc = trie_push (other, keys[k], ud[k]);
+                npushed += rc == 0;
+                brc[k] = 7;
+            }
+            rc = trie_build_bulk (trie, kp + begin, ud + begin, end - begin, brc + begin);
+            ASSERT (rc >= 0);
+            ASSERT (trie_size (trie) == trie_size (other) && trie_size (trie) == npushed,
+                    "size = %d, other size = %d\n", trie_size (trie), trie_size (other));
+        }
+        // Both tries have the same return codes, keys and userdata.
+        trie_free (other);
+        other = trie_init (0, 0, 0, trie_flags);
+        for (k = 0; k < nbulk; ++k)
+            ASSERT (trie_push (other, keys[k], ud[k]) == brc[k], "key = %s, rc = %d\n", keys[k], brc[k]);
+        it = trie_iter_begin (trie);
+        void *oit = trie_iter_begin (other);
+        while ((r = trie_iter_next (it)) && (o = trie_iter_next (oit)))
+            ASSERT (strcmp (r->key, o->key) == 0 && r->userdata == o->userdata
+                    && r->prefixlen == o->prefixlen && r->suffixlen == o->suffixlen,
+                    "key = %s, other key = %s\n", r->key, o->key);
+        ASSERT (r == 0 && trie_iter_next (oit) == 0);
+        trie_iter_end (oit);
+        trie_iter_end (it);
+        // Both tries find the same matches in the same order.
+        for (k = 0; k < 2000; ++k) {
+            random_alphabet_key (target, 12, "ab%.", &seed);
+            compare_lookups (trie, other, target);
+        }
+        // A key pushed after a bulk is younger than the keys of the bulk.
+        ASSERT (trie_push (trie, "%", userdata) == trie_push (other, "%", userdata));
+        ASSERT (trie_push (trie, "b%", userdata) == trie_push (other, "b%", userdata));
+        compare_lookups (trie, other, "ba");
+        trie_free (other);
+        free (brc);
+        free (ud);
+        free (kp);
+        free (keys);
+        break;
+    }
+    case 51: {
+        // Test that a frozen trie finds what it found before it was frozen,
+        // after keys were pushed and removed, and that it is read-only and
+        // can be saved and opened.
+        enum {nkeys51 = 3000, ntargets = 2000};
+        const char alphabet[] = "ab%\\./";
+        char path[] = "/tmp/trie.t.XXXXXX";
+        const char *newkeys[] = {"new"};
+        char (*keys)[16] = malloc (nkeys51 * sizeof *keys);
+        char (*targets)[16] = malloc (ntargets * sizeof *targets);
+        const struct result ***before = malloc (ntargets * sizeof *before);
+        const struct result **all, **b;
+        int (*has)[3] = malloc (ntargets * sizeof *has);
+        void *mapped;
+        size_t mem;
+        unsigned seed = 1;
+        int k, m, size;
+
+        assert (keys && targets && before && has);
+        for (k = 0; k < nkeys51; ++k) {
+            random_alphabet_key (keys[k], 14, alphabet, &seed);
+            trie_push (trie, keys[k], keys[k]);
+        }
+        for (k = 0; k < nkeys51; k += 3)
+            trie_remove (trie, keys[k]);
+        size = trie_size (trie);
+        mem = trie_memory (trie);
+        for (k = 0; k < ntargets; ++k) {
+            random_alphabet_key (targets[k], 14, "ab%./", &seed);
+            all = trie_find_all (trie, targets[k]);
+            for (m = 0; all[m]; ++m)
+                ;
+            before[k] = malloc ((m + 1) * sizeof **before);
+            assert (before[k]);
+            memcpy (before[k], all, (m + 1) * sizeof *all);
+            for (m = 0; m < 3; ++m)
+                has[k][m] = trie_has (trie, targets[k], m);
+        }
+
+        rc = trie_freeze (trie);
+        ASSERT (rc == 0, "rc = %d\n", rc);
+        ASSERT (trie_size (trie) == size);
+        ASSERT (trie_memory (trie) <= mem, "memory = %zu, before = %zu\n", trie_memory (trie), mem);
+        for (k = 0; k < ntargets; ++k) {
+            for (all = trie_find_all (trie, targets[k]), b = before[k]; *all && *b; ++all, ++b)
+                ASSERT (*all == *b, "target = %s\n", targets[k]);
+            ASSERT (*all == 0 && *b == 0, "target = %s\n", targets[k]);
+            for (m = 0; m < 3; ++m)
+                ASSERT (trie_has (trie, targets[k], m) == has[k][m],
+                        "target = %s, prefer fuzzy = %d\n", targets[k], m);
+        }
+        m = 0;
+        it = trie_iter_begin (trie);
+        for (; (found = trie_iter_next (it)); ++m)
+            ASSERT (strcmp (found->userdata, found->key) == 0);
+        trie_iter_end (it);
+        ASSERT (m == size, "m = %d, size = %d\n", m, size);
+
+        ASSERT (trie_freeze (trie) == 1);
+        ASSERT (trie_push (trie, "new", userdata) == -2);
+        ASSERT (trie_remove (trie, keys[1]) == -2);
+        ASSERT (trie_replace (trie, keys[1], userdata) == -2);
+        ASSERT (trie_build_bulk (trie, newkeys, 0, 1, 0) == -2);
+        ASSERT (trie_size (trie) == size);
+
+        // The image of a frozen trie has the frozen layout.
+        rc = mkstemp (path);
+        ASSERT (rc >= 0);
+        close (rc);
+        rc = trie_save (trie, path);
+        ASSERT (rc == 0);
+        mapped = trie_open_mmap (path, 0, trie_flags);
+        ASSERT (mapped);
+        ASSERT (trie_freeze (mapped) == 1);
+        for (k = 0; k < ntargets; ++k) {
+            for (all = trie_find_all (mapped, targets[k]), b = before[k]; *all && *b; ++all, ++b)
+                ASSERT (strcmp ((*all)->key, (*b)->key) == 0, "target = %s\n", targets[k]);
+            ASSERT (*all == 0 && *b == 0, "target = %s\n", targets[k]);
+        }
+        trie_free (mapped);
+        unlink (path);
+        for (k = 0; k < ntargets; ++k)
+            free (before[k]);
+        free (has);
+        free (before);
+        free (targets);
+        free (keys);
+        break;
+    }
+    case 52: {
+        // Test keys with several naked wildcards, and tries, whose wildcard
+        // is not %, against a reference matcher.
+        enum {nkeys52 = 600, ntargets = 1500, maxklen52 = 10, maxtok = 64};
+        static const struct {
+            int flags;
+            char w;
+            const char *alphabet, *targets;
+        } modes[] = {
+            {trie_multi_wildcard, '%', "ab%\\.", "ab%."},
+            {TRIE_WILDCARD ('*'), '*', "ab*%\\.", "ab*%."},
+            {trie_multi_wildcard | TRIE_WILDCARD ('*'), '*', "ab*%\\.", "ab*%."},
+            // A wildcard byte >= 0x80 is a negative char.
+            {TRIE_WILDCARD ('\xc3'), '\xc3', "ab\xc3%\\.", "ab\xc3%."},
+            {trie_multi_wildcard | TRIE_WILDCARD ('\xc3'), '\xc3', "ab\xc3%\\.", "ab\xc3%."},
+        };
+        char (*keys)[maxklen52] = malloc (nkeys52 * sizeof *keys);
+        const char **kp = malloc (nkeys52 * sizeof *kp);
+        int (*tok)[maxtok] = malloc (nkeys52 * sizeof *tok);
+        int *ntok = malloc (nkeys52 * sizeof *ntok);
+        int *prc = malloc (nkeys52 * sizeof *prc);
+        int *brc = malloc (nkeys52 * sizeof *brc);
+        int *expected = malloc ((nkeys52 + 1) * sizeof *expected);
+        const struct result **rfound, **out, **lists[16], **all, **mall;
+        const char *batch[16];
+        char targets[16][16], target[16], many[256], path[] = "/tmp/trie.t.XXXXXX";
+        void *t, *mapped;
+
+        assert (keys && kp && tok && ntok && prc && brc && expected);
+        for (size_t md = 0; md < sizeof modes / sizeof *modes; ++md) {
+            const int multi = modes[md].flags & trie_multi_wildcard;
+            const char w = modes[md].w;
+            unsigned seed = md + 1;
+            int k, j, m, nnaked, nexpected, exact;
+
+            t = trie_init (0, 0, 0, trie_flags | modes[md].flags);
+            for (k = 0; k < nkeys52; ++k) {
+                random_alphabet_key (keys[k], maxklen52, modes[md].alphabet, &seed);
+                kp[k] = keys[k];
+                ntok[k] = glob_parse (keys[k], w, tok[k]);
+                for (nnaked = 0, m = 0; m < ntok[k]; ++m)
+                    nnaked += tok[k][m] < 0;
+                // A key, whose chars and naked wildcards are those of a key
+                // pushed before, is a duplicate.
+                for (j = 0; j < k; ++j)
+                    if (prc[j] == 0 && ntok[j] == ntok[k]
+                        && memcmp (tok[j], tok[k], ntok[k] * sizeof **tok) == 0)
+                        break;
+                prc[k] = trie_push (t, keys[k], keys[k]);
+                if (nnaked > 1 && !multi)
+                    ASSERT (prc[k] == -1, "key = %s, rc = %d\n", keys[k], prc[k]);
+                else
+                    ASSERT (prc[k] == (j < k), "key = %s, rc = %d\n", keys[k], prc[k]);
+            }
+            for (int n = 0; n < ntargets; ++n) {
+                random_alphabet_key (target, 12, modes[md].targets, &seed);
+                // The exact match first, then the longest keys, then the
+                // keys pushed first.
+                nexpected = 0;
+                exact = -1;
+                for (k = 0; k < nkeys52; ++k) {
+                    if (prc[k] || !glob_matches (keys[k], target, w))
+                        continue;
+                    for (nnaked = 0, m = 0; m < ntok[k]; ++m)
+                        nnaked += tok[k][m] < 0;
+                    if (nnaked == 0) {
+                        ASSERT (exact < 0);
+                        exact = k;
+                        continue;
+                    }
+                    for (j = nexpected; j > 0 && strlen (keys[expected[j-1]]) < strlen (keys[k]); --j)
+                        expected[j] = expected[j-1];
+                    expected[j] = k;
+                    ++nexpected;
+                }
+                if (exact >= 0) {
+                    memmove (expected + 1, expected, nexpected * sizeof *expected);
+                    expected[0] = exact;
+                    ++nexpected;
+                }
+                all = trie_find_all (t, target);
+                for (j = 0; j < nexpected && all[j]; ++j)
+                    ASSERT (all[j]->userdata == keys[expected[j]], "mode = %zu, target = %s, found %s, expected %s\n",
+                            md, target, all[j]->key, keys[expected[j]]);
+                ASSERT (j == nexpected && all[j] == 0, "mode = %zu, target = %s, found %d, expected %d\n",
+                        md, target, j, nexpected);
+                for (m = 0; m < 3; ++m)
+                    ASSERT (trie_has (t, target, m) == (nexpected > 0), "mode = %zu, target = %s\n", md, target);
+                strcpy (targets[n % 16], target);
+            }
+
+            // A batch finds what trie_find_all_r finds.
+            rfound = malloc (trie_found_size (t) * sizeof *rfound);
+            out = malloc (16 * trie_found_size (t) * sizeof *out);
+            assert (rfound && out);
+            for (j = 0; j < 16; ++j)
+                batch[j] = targets[j];
+            rc = trie_find_all_batch (t, batch, 16, lists, out, 16 * trie_found_size (t));
+            ASSERT (rc > 0);
+            for (j = 0; j < 16; ++j) {
+                all = trie_find_all_r (t, targets[j], rfound);
+                for (m = 0; all[m] && lists[j][m]; ++m)
+                    ASSERT (all[m] == lists[j][m], "target = %s\n", targets[j]);
+                ASSERT (all[m] == 0 && lists[j][m] == 0, "target = %s\n", targets[j]);
+            }
+            free (out);
+            free (rfound);
+
+            // trie_build_bulk parses the keys like trie_push.
+            mapped = trie_init (0, 0, 0, trie_flags | modes[md].flags);
+            trie_build_bulk (mapped, kp, 0, nkeys52, brc);
+            for (k = 0; k < nkeys52; ++k)
+                ASSERT (brc[k] == prc[k], "key = %s, rc = %d\n", keys[k], brc[k]);
+            trie_free (mapped);
+
+            // The image keeps the wildcard and the mode of the trie.
+            strcpy (path, "/tmp/trie.t.XXXXXX");
+            rc = mkstemp (path);
+            ASSERT (rc >= 0);
+            close (rc);
+            ASSERT (trie_save (t, path) == 0);
+            mapped = trie_open_mmap (path, 0, trie_flags);
+            ASSERT (mapped);
+            unlink (path);
+            for (j = 0; j < 16; ++j) {
+                all = trie_find_all (t, targets[j]);
+                mall = trie_find_all (mapped, targets[j]);
+                for (m = 0; all[m] && mall[m]; ++m)
+                    ASSERT (strcmp (all[m]->key, mall[m]->key) == 0, "target = %s\n", targets[j]);
+                ASSERT (all[m] == 0 && mall[m] == 0, "target = %s\n", targets[j]);
+            }
+            trie_free (mapped);
+            trie_free (t);
+        }
+
+        // A key with many wildcards, which a backtracking search would try
+        // to match in exponentially many ways, takes a lookup of one pass.
+        t = trie_init (0, 0, 0, trie_flags | trie_multi_wildcard);
+        rc = trie_push (t, "%a%a%a%a%a%a%a%a%a%a%a%a%b", userdata);
+        ASSERT (rc == 0);
+        memset (many, 'a', sizeof many - 1);
+        many[sizeof many - 1] = '\0';
+        ASSERT (trie_find_all (t, many)[0] == 0);
+        ASSERT (trie_has (t, many, trie_prefer_auto) == 0);
+        many[sizeof many - 2] = 'b';
+        found = trie_find (t, many);
+        ASSERT (found && found->prefixlen == 0 && found->suffixlen == 1);
+        trie_free (t);
+        free (expected);
+        free (brc);
+        free (prc);
+        free (ntok);
+        free (tok);
+        free (kp);
+        free (keys);
+        break;
+    }
+    case 53: {
+        // Test that trie_build_parallel on several threads pushes random keys,
+        // with duplicates, malformed keys and long common prefixes, like
+        // trie_push in the same order does, and that the built trie can be
+        // modified.
+        enum {nkeys53 = 4000, ntargets = 2000};
+        static const int nthreads[] = {2, 3, 8};
+        const char alphabet[] = "ab%\\.";
+        char (*keys)[32] = malloc (nkeys53 * sizeof *keys);
+        const char **kp = malloc (nkeys53 * sizeof *kp);
+        const void **ud = malloc (nkeys53 * sizeof *ud);
+        int *brc = malloc (nkeys53 * sizeof *brc);
+        const struct result *r, *o;
+        void *other, *oit;
+        char target[32], tail[12];
+        unsigned seed = 1;
+        int k;
+
+        assert (keys && kp && ud && brc);
+        // Most keys share a prefix of several chars with many others, so that
+        // the shards hold the keys of longer prefixes than the first char.
+        for (k = 0; k < nkeys53; ++k) {
+            random_alphabet_key (tail, 9, alphabet, &seed);
+            if (k % 8 == 0)
+                snprintf (keys[k], sizeof *keys, "%s", tail);
+            else
+                snprintf (keys[k], sizeof *keys, "src/m%d/%s", rand_r (&seed) % 24, tail);
+            kp[k] = keys[k];
+            ud[k] = (const void *) (intptr_t) (k + 1);
+        }
+        for (size_t e = 0; e < sizeof nthreads / sizeof *nthreads; ++e) {
+            trie_free (trie);
+            trie = trie_init (0, 0, 0, trie_flags);
+            other = trie_init (0, 0, 0, trie_flags);
+            for (k = 0; k < nkeys53; ++k)
+                brc[k] = 7;
+            rc = trie_build_parallel (trie, kp, ud, nkeys53, nthreads[e], brc);
+            ASSERT (rc >= 0);
+            for (k = 0; k < nkeys53; ++k)
+                ASSERT (trie_push (other, keys[k], ud[k]) == brc[k], "key = %s, rc = %d\n", keys[k], brc[k]);
+            ASSERT (trie_size (trie) == trie_size (other) && trie_size (trie) == rc,
+                    "size = %d, other size = %d, rc = %d\n", trie_size (trie), trie_size (other), rc);
+            // A trie, which has keys, is built on the calling thread.
+            ASSERT (trie_build_parallel (trie, kp, ud, nkeys53, nthreads[e], brc) == 0);
+            for (k = 0; k < nkeys53; ++k)
+                ASSERT (brc[k] == 1 || brc[k] == -1, "key = %s, rc = %d\n", keys[k], brc[k]);
+            ASSERT (trie_size (trie) == trie_size (other));
+            for (int pass = 0; pass < 2; ++pass) {
+                // Both tries have the same keys and userdata.
+                it = trie_iter_begin (trie);
+                oit = trie_iter_begin (other);
+                while ((r = trie_iter_next (it)) && (o = trie_iter_next (oit)))
+                    ASSERT (strcmp (r->key, o->key) == 0 && r->userdata == o->userdata
+                            && r->prefixlen == o->prefixlen && r->suffixlen == o->suffixlen,
+                            "key = %s, other key = %s\n", r->key, o->key);
+                ASSERT (r == 0 && trie_iter_next (oit) == 0);
+                trie_iter_end (oit);
+                trie_iter_end (it);
+                // Both tries find the same matches in the same order.
+                for (k = 0; k < ntargets; ++k) {
+                    random_alphabet_key (tail, 12, "ab%.", &seed);
+                    if (k % 2)
+                        snprintf (target, sizeof target, "src/m%d/%s", rand_r (&seed) % 24, tail);
+                    else
+                        snprintf (target, sizeof target, "%s", tail);
+                    compare_lookups (trie, other, target);
+                }
+                if (pass)
+                    break;
+                // Remove every third key and push a few again, which then
+                // are younger than the others.
+                for (k = 0; k < nkeys53; k += 3)
+                    ASSERT (trie_remove (trie, keys[k]) == trie_remove (other, keys[k]), "key = %s\n", keys[k]);
+                for (k = 0; k < nkeys53; k += 9)
+                    ASSERT (trie_push (trie, keys[k], ud[k]) == trie_push (other, keys[k], ud[k]), "key = %s\n", keys[k]);
+                ASSERT (trie_size (trie) == trie_size (other));
+            }
+            trie_free (other);
+        }
+        free (brc);
+        free (ud);
+        free (kp);
+        free (keys);
+        break;
+    }
+    case 54: {
+        // Test that trie_prefix_iter lists the keys, which start with a
+        // prefix, in the order of trie_iter_begin and up to a limit, in tries
+        // of % and of another wildcard, before and after they are frozen.
+        enum {nkeys54 = 2000, nprefixes = 1500, maxtok = 16};
+        static const struct {
+            int flags;
+            char w;
+            const char *alphabet;
+        } modes[] = {
+            {0, '%', "ab%\\./"},
+            {TRIE_WILDCARD ('*'), '*', "ab*%\\./"},
+            {TRIE_WILDCARD ('\xc3'), '\xc3', "ab\xc3%\\./"},
+        };
+        char (*keys)[maxtok] = malloc (nkeys54 * sizeof *keys);
+        const struct result **all = malloc (nkeys54 * sizeof *all);
+        int (*tok)[maxtok] = malloc (nkeys54 * sizeof *tok);
+        int *ntok = malloc (nkeys54 * sizeof *ntok);
+        int ptok[maxtok], n, np, limit, nlisted;
+        const struct result *r;
+        char prefix[maxtok];
+        unsigned seed = 1;
+        size_t len;
+
+        assert (keys && all && tok && ntok);
+        for (size_t m = 0; m < sizeof modes / sizeof *modes; ++m) {
+            trie_free (trie);
+            trie = trie_init (0, 0, 0, trie_flags | modes[m].flags);
+            for (int k = 0; k < nkeys54; ++k) {
+                random_alphabet_key (keys[k], 12, modes[m].alphabet, &seed);
+                trie_push (trie, keys[k], userdata);
+            }
+            for (int frozen = 0; frozen < 2; ++frozen) {
+                // The keys in the order of the iterator and their chars.
+                n = 0;
+                it = trie_iter_begin (trie);
+                for (; (r = trie_iter_next (it)); ++n) {
+                    all[n] = r;
+                    ntok[n] = glob_parse (r->key, modes[m].w, tok[n]);
+                }
+                trie_iter_end (it);
+                ASSERT (n == trie_size (trie));
+                for (int p = 0; p < nprefixes; ++p) {
+                    // A random prefix or the start of a key, which may end
+                    // inside a segment or between a backslash and a wildcard.
+                    if (p % 2)
+                        random_alphabet_key (prefix, 6, modes[m].alphabet, &seed);
+                    else {
+                        const char *key = all[rand_r (&seed) % n]->key;
+                        len = rand_r (&seed) % (strlen (key) + 1);
+                        memcpy (prefix, key, len);
+                        prefix[len] = '\0';
+                    }
+                    limit = p % 3 ? rand_r (&seed) % 4 : -1;
+                    np = glob_parse (prefix, modes[m].w, ptok);
+                    it = trie_prefix_iter (trie, prefix, limit);
+                    nlisted = 0;
+                    for (int k = 0; k < n && nlisted != limit; ++k) {
+                        if (ntok[k] < np || memcmp (tok[k], ptok, np * sizeof *ptok))
+                            continue;
+                        r = trie_iter_next (it);
+                        ASSERT (r == all[k], "prefix = %s, limit = %d, key = %s, listed = %s\n",
+                                prefix, limit, all[k]->key, r ? r->key : "none");
+                        ++nlisted;
+                    }
+                    ASSERT (trie_iter_next (it) == 0, "prefix = %s, limit = %d\n", prefix, limit);
+                    trie_iter_end (it);
+                }
+                trie_freeze (trie);
+            }
+        }
+        free (ntok);
+        free (tok);
+        free (all);
+        free (keys);
+        break;
+    }
+    case 55: {
+        // Test that trie_open_mmap fails with EINVAL on an image, whose
+        // header is valid, but one of whose results refers to a key or
+        // result outside the image or has lengths, which do not fit its key.
+        // The layout of a result of the image, see struct image_result of
+        // trie.c. The results are followed by the keys at the end of the file.
+        struct image_result {
+            uint64_t key;
+            uint64_t userdata;
+            int32_t order;
+            int32_t len;
+            int32_t prefixlen;
+            int32_t suffixlen;
+            int32_t suffix_next;
+            uint32_t prefix_hash;
+        } ir, saved;
+        const char *keys[] = {"hello.o", "%.o", "obj/%.c", 0};
+        char path[] = "/tmp/trie.t.XXXXXX";
+        void *mapped;
+        off_t offs, keys_nbytes = 0;
+        struct stat st;
+        int fd, nkeys55 = 0;
+
+        for (; keys[nkeys55]; ++nkeys55) {
+            trie_push (trie, keys[nkeys55], userdata);
+            keys_nbytes += strlen (keys[nkeys55]) + 1;
+        }
+        fd = mkstemp (path);
+        ASSERT (fd >= 0);
+        close (fd);
+        rc = trie_save (trie, path);
+        ASSERT (rc == 0, "rc = %d\n", rc);
+        fd = open (path, O_RDWR);
+        ASSERT (fd >= 0);
+        rc = fstat (fd, &st);
+        ASSERT (rc == 0);
+        // Result 2, obj/%.c, is in the suffix index, if the trie has one.
+        offs = st.st_size - keys_nbytes - (nkeys55 - 2) * (off_t) sizeof ir;
+        rc = pread (fd, &saved, sizeof saved, offs);
+        ASSERT (rc == sizeof saved);
+        ASSERT (saved.key == (uint64_t) keys_nbytes - 8 && saved.len == 7,
+                "key = %lu, len = %d\n", (unsigned long) saved.key, saved.len);
+        for (int c = 0; c < 8; ++c) {
+            ir = saved;
+            switch (c) {
+            case 0: break; // Intact.
+            case 1: ir.key = keys_nbytes; break;
+            case 2: ir.key = keys_nbytes - 4; break;
+            case 3: ir.key = UINT64_MAX - 2; break;
+            case 4: ir.len = 8; break;
+            case 5: ir.len = -1; break;
+            case 6: ir.prefixlen = 6; break;
+            case 7: ir.suffix_next = nkeys55; break;
+            }
+            rc = pwrite (fd, &ir, sizeof ir, offs);
+            ASSERT (rc == sizeof ir);
+            errno = 0;
+            mapped = trie_open_mmap (path, 0, trie_flags);
+            // The suffix link is not used without the suffix index.
+            if (c == 0 || (c == 7 && !(trie_flags & trie_suffix_index))) {
+                ASSERT (mapped, "corruption %d\n", c);
+                if (mapped) {
+                    found = trie_find (mapped, "obj/hello.c");
+                    ASSERT (found && strcmp (found->key, "obj/%.c") == 0);
+                    trie_free (mapped);
+                }
+            } else {
+                ASSERT (mapped == 0 && errno == EINVAL, "corruption %d\n", c);
+                if (mapped)
+                    trie_free (mapped);
+            }
+        }
+        close (fd);
+        unlink (path);
+        break;
+    }
+    case 56: {
+        // Test that the nodes of more than UINT16_MAX keys under one prefix,
+        // whose counts saturate, are freed with the keys, so that the same
+        // keys under another prefix take no more nodes. The keys are stored
+        // anew, in blocks of 64KiB.
+        enum {nkeys56 = 66000};
+        char key[32];
+        size_t mem;
+
+        trie_free (trie);
+        trie = trie_init (0, 0, 0, trie_flags);
+        for (int p = 0; p < 2; ++p) {
+            for (int k = 0; k < nkeys56; ++k) {
+                snprintf (key, sizeof key, "%c/%d/%%.o", 'p' + p, k);
+                rc = trie_push (trie, key, userdata);
+                ASSERT (rc == 0, "rc = %d, key = %s\n", rc, key);
+            }
+            if (p == 1) {
+                ASSERT ((trie_memory (trie) - mem) % (64 * 1024) == 0, "memory = %zu, was %zu\n", trie_memory (trie), mem);
+                found = trie_find (trie, "q/65999/x.o");
+                ASSERT (found && strcmp (found->key, "q/65999/%.o") == 0);
+                ASSERT (trie_has (trie, "p/1/x.o", trie_prefer_auto) == 0);
+            }
+            // The newest first, which lead the lists of the suffix index.
+            for (int k = nkeys56 - 1; k >= 0; --k) {
+                snprintf (key, sizeof key, "%c/%d/%%.o", 'p' + p, k);
+                rc = trie_remove (trie, key);
+                ASSERT (rc == 0, "rc = %d, key = %s\n", rc, key);
+            }
+            ASSERT (trie_size (trie) == 0);
+            ASSERT (trie_has (trie, "p/1/x.o", trie_prefer_auto) == 0);
+            mem = trie_memory (trie);
+        }
+        break;
+    }
     case -1: {
         // Performance test.
         // trie.t.tsk without arguments does not run this test.
         int k, m, size;
+        size_t mem;
         struct timeval start, stop;
         suseconds_t duration;
 
@@ -710,6 +2286,10 @@ int run_test (long test, int argc, char *argv[])
 
         duration = timediff (&start, &stop);
         printf ("building a trie of size %d took %ldus\n", size, duration);
+        mem = trie_memory (trie);
+        printf ("trie of size %d uses %zu bytes, %zu bytes per key\n",
+                size, mem, size ? mem / size : 0);
+        print_peak_memory ();
 
         for (k = 0; k < 2; ++k) {
             gettime (&start);
@@ -721,6 +2301,465 @@ int run_test (long test, int argc, char *argv[])
             printf ("%d lookups in trie of %d took %ldus, prefer fuzzy = %d\n",
                     m, size, duration, k);
         }
+
+        gettime (&start);
+        it = trie_iter_begin (trie);
+        for (m = 0; trie_iter_next (it); ++m)
+            ;
+        trie_iter_end (it);
+        gettime (&stop);
+        ASSERT (m == size, "m = %d, size = %d\n", m, size);
+        printf ("iterating over %d keys took %ldus\n", m, timediff (&start, &stop));
+        break;
+    }
+    case -2: {
+        // Performance test of a trie created with no capacity hints.
+        // trie.t.tsk without arguments does not run this test.
+        struct timeval start, stop;
+        size_t mem;
+
+        trie_free (trie);
+        trie = trie_init (0, 0, 0, trie_flags);
+        gettime (&start);
+        randomize_trie (trie, maxklen, nkeys);
+        gettime (&stop);
+        size = trie_size (trie);
+        mem = trie_memory (trie);
+        printf ("building a trie of size %d took %ldus\n", size, timediff (&start, &stop));
+        printf ("trie of size %d uses %zu bytes, %zu bytes per key\n",
+                size, mem, size ? mem / size : 0);
+        print_peak_memory ();
+        break;
+    }
+    case -3: {
+        // Performance test of trie_find_all with a target, which matches
+        // hundreds of patterns.
+        // trie.t.tsk without arguments does not run this test.
+        const char target[] = "src/module/subdir/file_name.o";
+        const int tlen = sizeof target - 1;
+        char key[sizeof target + 1];
+        const struct result **all;
+        struct timeval start, stop;
+        int m, nmatches = 0;
+
+        trie_free (trie);
+        trie = trie_init (0, 0, 0, trie_flags);
+        // Push every pattern, which matches target, i.e. every prefix of
+        // target followed by % followed by every suffix, which leaves at
+        // least one char to %.
+        for (int p = 0; p < tlen; ++p)
+            for (int s = 0; p + s < tlen; ++s) {
+                memcpy (key, target, p);
+                key[p] = '%';
+                memcpy (key + p + 1, target + tlen - s, s);
+                key[p + 1 + s] = '\0';
+                trie_push (trie, key, userdata);
+            }
+        size = trie_size (trie);
+        gettime (&start);
+        for (m = 0; m < nkeys; ++m)
+            for (all = trie_find_all (trie, target), nmatches = 0; *all; ++all)
+                ++nmatches;
+        gettime (&stop);
+        ASSERT (nmatches == size, "nmatches = %d, size = %d\n", nmatches, size);
+        printf ("%d lookups of a target matching %d patterns took %ldus\n",
+                m, nmatches, timediff (&start, &stop));
+        break;
+    }
+    case -4: {
+        // Performance test of concurrent lookups.
+        // Each thread looks up nkeys random keys.
+        // trie.t.tsk without arguments does not run this test.
+        const int ncpus = (int) sysconf (_SC_NPROCESSORS_ONLN);
+        struct lookup_job jobs[ncpus];
+        struct timeval start, stop;
+        suseconds_t duration;
+
+        trie_free (trie);
+        trie = trie_init (0, 0, 0, trie_flags);
+        randomize_trie (trie, maxklen, nkeys);
+        size = trie_size (trie);
+        for (int nthreads = 1; nthreads <= ncpus; nthreads *= 2) {
+            memset (jobs, 0, sizeof jobs);
+            for (int k = 0; k < nthreads; ++k) {
+                jobs[k].trie = trie;
+                jobs[k].nlookups = nkeys;
+                jobs[k].seed = k + 1;
+            }
+            gettime (&start);
+            run_lookup_threads (jobs, nthreads);
+            gettime (&stop);
+            duration = timediff (&start, &stop);
+            printf ("%d threads did %d lookups in trie of %d in %ldus, %.0f lookups/s\n",
+                    nthreads, nthreads * nkeys, size, duration,
+                    duration ? nthreads * (double) nkeys * 1e6 / duration : 0);
+            if (nthreads < ncpus && nthreads * 2 > ncpus)
+                nthreads = ncpus / 2;
+        }
+        break;
+    }
+    case -5: {
+        // Performance test of trie_find_all_batch against trie_find_all_r
+        // with nkeys targets of a build tree.
+        // trie.t.tsk without arguments does not run this test.
+        const int ndirs = 64;
+        char (*targets)[64] = malloc (nkeys * sizeof *targets);
+        const char **keys = malloc (nkeys * sizeof *keys);
+        const struct result ***lists = malloc (nkeys * sizeof *lists);
+        const struct result **found, **out;
+        struct timeval start, stop;
+        size_t outsize;
+        long nfound = 0, nbatch = 0;
+        unsigned seed = 1;
+        int used;
+
+        trie_free (trie);
+        trie = trie_init (0, 0, 0, trie_flags);
+        trie_push (trie, "%.o", userdata);
+        trie_push (trie, "obj/%", userdata);
+        for (int d = 0; d < ndirs; ++d) {
+            char pattern[64];
+            snprintf (pattern, sizeof pattern, "obj/dir%d/%%.o", d);
+            trie_push (trie, pattern, userdata);
+            snprintf (pattern, sizeof pattern, "obj/dir%d/sub%%/file%%.o", d);
+            trie_push (trie, pattern, userdata);
+        }
+        for (int k = 0; k < nkeys; ++k) {
+            snprintf (targets[k], sizeof *targets, "obj/dir%d/sub%d/file%d.o",
+                      rand_r (&seed) % ndirs, rand_r (&seed) % 16, k);
+            keys[k] = targets[k];
+            if (k % 4 == 0)
+                trie_push (trie, targets[k], userdata);
+        }
+        size = trie_size (trie);
+        found = malloc (trie_found_size (trie) * sizeof *found);
+        outsize = (size_t) nkeys * 8;
+        out = malloc (outsize * sizeof *out);
+
+        gettime (&start);
+        for (int k = 0; k < nkeys; ++k)
+            for (const struct result **r = trie_find_all_r (trie, keys[k], found); *r; ++r)
+                ++nfound;
+        gettime (&stop);
+        printf ("%d lookups of trie_find_all_r in trie of %d took %ldus\n",
+                nkeys, size, timediff (&start, &stop));
+
+        gettime (&start);
+        used = trie_find_all_batch (trie, keys, nkeys, lists, out, outsize);
+        gettime (&stop);
+        ASSERT (used > 0, "used = %d\n", used);
+        for (int k = 0; k < nkeys; ++k)
+            for (const struct result **r = lists[k]; *r; ++r)
+                ++nbatch;
+        ASSERT (nfound == nbatch, "nfound = %ld, nbatch = %ld\n", nfound, nbatch);
+        printf ("%d lookups of trie_find_all_batch in trie of %d took %ldus\n",
+                nkeys, size, timediff (&start, &stop));
+        free (out);
+        free (found);
+        free (lists);
+        free (keys);
+        free (targets);
+        break;
+    }
+    case -6: {
+        // Performance test of trie_has on the pathological tries of tests 4
+        // and 34 with keys of nkeys chars.
+        // trie.t.tsk without arguments does not run this test.
+        const char *names[] = {"exact", "fuzzy", "auto"};
+        const int len = nkeys;
+        char *target = malloc (len + 1), *key = malloc (len + 2);
+        struct timeval start, stop;
+
+        memset (target, 'l', len - 1);
+        target[len - 1] = 'o';
+        target[len] = '\0';
+        for (int shape = 4; shape <= 34; shape += 30) {
+            trie_free (trie);
+            trie = trie_init (0, 0, 0, trie_flags);
+            for (int p = 0; p < len; ++p) {
+                if (shape == 4) {
+                    // Like hel%a, which end with a char other than the last
+                    // char of target. Then %lo.
+                    memcpy (key, target, p);
+                    strcpy (key + p, p ? "%a" : "%lo");
+                } else {
+                    // Like h%lla, which replace a char of target with a % and
+                    // end with a char other than the last char of target,
+                    // except hell%.
+                    memcpy (key, target, len);
+                    key[p] = '%';
+                    key[len] = '\0';
+                    if (p < len - 1)
+                        key[len - 1] = 'a';
+                }
+                trie_push (trie, key, userdata);
+            }
+            for (int k = 0; k < 3; ++k) {
+                // Warm up the cache, so that the order of the searches does
+                // not matter.
+                trie_has (trie, target, k);
+                gettime (&start);
+                rc = trie_has (trie, target, k);
+                gettime (&stop);
+                ASSERT (rc);
+                printf ("test %d shape, %d keys of %d chars, prefer %s took %ldus\n",
+                        shape, trie_size (trie), len, names[k], timediff (&start, &stop));
+            }
+        }
+        free (key);
+        free (target);
+        break;
+    }
+    case -7: {
+        // Performance test of trie_find_all with a target of nkeys chars
+        // against patterns %a...ab of 1 to 1000 a's, which almost match at
+        // every position of the target.
+        // trie.t.tsk without arguments does not run this test.
+        const int npatterns = 1000;
+        char *target = malloc (nkeys + 2), *key = malloc (npatterns + 3);
+        const struct result **all;
+        struct timeval start, stop;
+
+        trie_free (trie);
+        trie = trie_init (0, 0, 0, trie_flags);
+        key[0] = '%';
+        for (int p = 1; p <= npatterns; ++p) {
+            memset (key + 1, 'a', p);
+            strcpy (key + 1 + p, "b");
+            trie_push (trie, key, userdata);
+        }
+        memset (target, 'a', nkeys);
+        strcpy (target + nkeys, "c");
+        gettime (&start);
+        all = trie_find_all (trie, target);
+        gettime (&stop);
+        ASSERT (*all == 0);
+        printf ("lookup of a target of %d chars against %d patterns took %ldus\n",
+                nkeys + 1, trie_size (trie), timediff (&start, &stop));
+        free (key);
+        free (target);
+        break;
+    }
+    case -8: {
+        // Performance test of trie_find_all with nkeys targets of a build tree
+        // against rules %.ext for 1000 extensions and obj/dir/%.o for 64
+        // dirs.
+        // trie.t.tsk without arguments does not run this test.
+        char (*targets)[64] = malloc (nkeys * sizeof *targets);
+        struct timeval start, stop;
+        char pattern[64];
+        unsigned seed = 1;
+        long nfound = 0;
+
+        trie_free (trie);
+        trie = trie_init (0, 0, 0, trie_flags);
+        for (int e = 0; e < 1000; ++e) {
+            snprintf (pattern, sizeof pattern, "%%.x%d", e);
+            trie_push (trie, pattern, userdata);
+        }
+        for (int d = 0; d < 64; ++d) {
+            snprintf (pattern, sizeof pattern, "obj/dir%d/%%.o", d);
+            trie_push (trie, pattern, userdata);
+        }
+        trie_push (trie, "%.o", userdata);
+        trie_push (trie, "obj/%", userdata);
+        for (int k = 0; k < nkeys; ++k)
+            snprintf (targets[k], sizeof *targets, "obj/dir%d/sub%d/file%d.o",
+                      rand_r (&seed) % 64, rand_r (&seed) % 16, k);
+        gettime (&start);
+        for (int k = 0; k < nkeys; ++k)
+            for (const struct result **r = trie_find_all (trie, targets[k]); *r; ++r)
+                ++nfound;
+        gettime (&stop);
+        ASSERT (nfound == 3L * nkeys, "nfound = %ld\n", nfound);
+        printf ("%d lookups in trie of %d took %ldus\n",
+                nkeys, trie_size (trie), timediff (&start, &stop));
+        free (targets);
+        break;
+    }
+    case -9: {
+        // Performance test of trie_find_all with a trace of nkeys lookups of
+        // nkeys/256 targets against the rules of test -8. A target is looked
+        // up once for each of its dependents, and few targets, like common
+        // headers, have most dependents.
+        // trie.t.tsk without arguments does not run this test.
+        const int ntargets = nkeys / 256 + 1;
+        char (*targets)[64] = malloc (ntargets * sizeof *targets);
+        int *trace = malloc (nkeys * sizeof *trace);
+        struct timeval start, stop;
+        char pattern[64];
+        unsigned seed = 1;
+        long nfound = 0;
+        size_t hits, misses;
+
+        trie_free (trie);
+        trie = trie_init (0, 0, 0, trie_flags);
+        for (int e = 0; e < 1000; ++e) {
+            snprintf (pattern, sizeof pattern, "%%.x%d", e);
+            trie_push (trie, pattern, userdata);
+        }
+        for (int d = 0; d < 64; ++d) {
+            snprintf (pattern, sizeof pattern, "obj/dir%d/%%.o", d);
+            trie_push (trie, pattern, userdata);
+        }
+        trie_push (trie, "%.o", userdata);
+        trie_push (trie, "obj/%", userdata);
+        for (int k = 0; k < ntargets; ++k)
+            snprintf (targets[k], sizeof *targets, "obj/dir%d/sub%d/file%d.o",
+                      rand_r (&seed) % 64, rand_r (&seed) % 16, k);
+        for (int k = 0; k < nkeys; ++k) {
+            long r = rand_r (&seed) % ntargets;
+            r = r * (rand_r (&seed) % ntargets) / ntargets;
+            trace[k] = r * (rand_r (&seed) % ntargets) / ntargets;
+        }
+        gettime (&start);
+        for (int k = 0; k < nkeys; ++k)
+            for (const struct result **r = trie_find_all (trie, targets[trace[k]]); *r; ++r)
+                ++nfound;
+        gettime (&stop);
+        ASSERT (nfound == 3L * nkeys, "nfound = %ld\n", nfound);
+        trie_cache_stats (trie, &hits, &misses);
+        printf ("%d lookups of %d targets in trie of %d took %ldus, %zu hits, %zu misses\n",
+                nkeys, ntargets, trie_size (trie), timediff (&start, &stop), hits, misses);
+        free (trace);
+        free (targets);
+        break;
+    }
+    case -10: {
+        // Performance test of trie_find_all and trie_has with nkeys targets of
+        // a deep source tree, whose paths share long runs of chars.
+        // trie.t.tsk without arguments does not run this test.
+        char (*targets)[96] = malloc (nkeys * sizeof *targets);
+        struct timeval start, stop;
+        long nfound = 0;
+
+        trie_free (trie);
+        trie = trie_init (0, 0, 0, trie_flags);
+        for (int k = 0; k < nkeys; ++k) {
+            snprintf (targets[k], sizeof *targets,
+                      "src/components/module%d/implementation/subdir%d/file%d.c",
+                      k % 97, k % 13, k);
+            trie_push (trie, targets[k], userdata);
+        }
+        trie_push (trie, "%.c", userdata);
+        trie_push (trie, "src/components/%.c", userdata);
+        printf ("a trie of %d takes %zu bytes\n", trie_size (trie), trie_memory (trie));
+        gettime (&start);
+        for (int k = 0; k < nkeys; ++k)
+            for (const struct result **r = trie_find_all (trie, targets[k * 7919L % nkeys]); *r; ++r)
+                ++nfound;
+        gettime (&stop);
+        ASSERT (nfound == 3L * nkeys, "nfound = %ld\n", nfound);
+        printf ("%d lookups in trie of %d took %ldus\n",
+                nkeys, trie_size (trie), timediff (&start, &stop));
+        nfound = 0;
+        gettime (&start);
+        for (int k = 0; k < nkeys; ++k)
+            nfound += trie_has (trie, targets[k * 7919L % nkeys], trie_prefer_auto);
+        gettime (&stop);
+        ASSERT (nfound == nkeys, "nfound = %ld\n", nfound);
+        printf ("%d trie_has in trie of %d took %ldus\n",
+                nkeys, trie_size (trie), timediff (&start, &stop));
+        free (targets);
+        break;
+    }
+    case -11: {
+        // Performance test of trie_find_all and trie_has with nkeys targets of
+        // 256 chars or more against the rules of test -8, with the vector and
+        // with the scalar scan of a key inside a wildcard.
+        // trie.t.tsk without arguments does not run this test.
+        char (*targets)[320] = malloc (nkeys * sizeof *targets);
+        struct timeval start, stop;
+        char pattern[64], dir[256];
+        unsigned seed = 1;
+        long nfound;
+
+        for (int d = 0; d < (int) sizeof dir - 1; ++d)
+            dir[d] = d % 16 == 15 ? '/' : 'a' + d % 26;
+        dir[sizeof dir - 1] = '\0';
+        for (int k = 0; k < nkeys; ++k)
+            snprintf (targets[k], sizeof *targets, "obj/dir%d/%s/file%d.o",
+                      rand_r (&seed) % 64, dir + rand_r (&seed) % 16, k);
+        for (int scalar = 0; scalar < 2; ++scalar) {
+            trie_free (trie);
+            trie = trie_init (0, 0, 0, trie_flags | (scalar ? trie_scalar_scan : 0));
+            for (int e = 0; e < 1000; ++e) {
+                snprintf (pattern, sizeof pattern, "%%.x%d", e);
+                trie_push (trie, pattern, userdata);
+            }
+            for (int d = 0; d < 64; ++d) {
+                snprintf (pattern, sizeof pattern, "obj/dir%d/%%.o", d);
+                trie_push (trie, pattern, userdata);
+            }
+            trie_push (trie, "%.o", userdata);
+            trie_push (trie, "obj/%", userdata);
+            nfound = 0;
+            gettime (&start);
+            for (int k = 0; k < nkeys; ++k)
+                for (const struct result **r = trie_find_all (trie, targets[k]); *r; ++r)
+                    ++nfound;
+            gettime (&stop);
+            ASSERT (nfound == 3L * nkeys, "nfound = %ld\n", nfound);
+            printf ("%d lookups of long targets in trie of %d took %ldus, scalar = %d\n",
+                    nkeys, trie_size (trie), timediff (&start, &stop), scalar);
+            nfound = 0;
+            gettime (&start);
+            for (int k = 0; k < nkeys; ++k)
+                nfound += trie_has (trie, targets[k], k % 3);
+            gettime (&stop);
+            ASSERT (nfound == nkeys, "nfound = %ld\n", nfound);
+            printf ("%d trie_has of long targets in trie of %d took %ldus, scalar = %d\n",
+                    nkeys, trie_size (trie), timediff (&start, &stop), scalar);
+        }
+        free (targets);
+        break;
+    }
+    case -12: {
+        // Performance test of building a trie of nkeys paths of a deep source
+        // tree and 1000 patterns in random order with trie_push, with
+        // trie_build_bulk and with trie_build_parallel on 2, 4 and 8 threads.
+        // trie.t.tsk without arguments does not run this test.
+        const int n = nkeys + 1000;
+        char (*keys)[96] = malloc (n * sizeof *keys);
+        const char **kp = malloc (n * sizeof *kp);
+        struct timeval start, stop;
+        unsigned seed = 1;
+
+        for (int k = 0; k < nkeys; ++k)
+            snprintf (keys[k], sizeof *keys,
+                      "src/components/module%d/implementation/subdir%d/file%d.c",
+                      rand_r (&seed) % 97, rand_r (&seed) % 13, k);
+        for (int k = 0; k < 1000; ++k)
+            snprintf (keys[nkeys + k], sizeof *keys, "obj/dir%d/%%.x%d", k % 64, k);
+        for (int k = n - 1; k > 0; --k) {
+            char tmp[sizeof *keys];
+            const int j = rand_r (&seed) % (k + 1);
+            memcpy (tmp, keys[k], sizeof tmp);
+            memcpy (keys[k], keys[j], sizeof tmp);
+            memcpy (keys[j], tmp, sizeof tmp);
+        }
+        for (int k = 0; k < n; ++k)
+            kp[k] = keys[k];
+        // bulk is 0 for trie_push, 1 for trie_build_bulk or the number of
+        // threads of trie_build_parallel.
+        for (int bulk = 0; bulk <= 8; bulk = bulk < 2 ? bulk + 1 : 2 * bulk) {
+            trie_free (trie);
+            trie = trie_init (0, 0, 0, trie_flags);
+            gettime (&start);
+            if (bulk > 1)
+                trie_build_parallel (trie, kp, 0, n, bulk, 0);
+            else if (bulk)
+                trie_build_bulk (trie, kp, 0, n, 0);
+            else
+                for (int k = 0; k < n; ++k)
+                    trie_push (trie, kp[k], userdata);
+            gettime (&stop);
+            ASSERT (trie_size (trie) == n, "size = %d\n", trie_size (trie));
+            printf ("building a trie of %d keys took %ldus, %zu bytes, bulk = %d\n",
+                    n, timediff (&start, &stop), trie_memory (trie), bulk);
+        }
+        free (kp);
+        free (keys);
         break;
     }
     default:
@@ -746,14 +2785,20 @@ int main (int argc, char *argv[])
             fprintf(stderr, "usage: %s [test] [test arg]...\n", argv[0]);
             return 1;
         }
-        run_test (test, argc, argv);
+        for (int e = 0; e < (int) (sizeof flag_sets / sizeof *flag_sets); ++e) {
+            trie_flags = flag_sets[e];
+            run_test (test, argc, argv);
+        }
         if (status > 0)
             fprintf (stderr, "%d tests failed\n", status);
         return status;
     }
     // Run all tests.
-    for (int k = 0; run_test (k, argc, argv) != -1; ++k)
+    for (int e = 0; e < (int) (sizeof flag_sets / sizeof *flag_sets); ++e) {
+        trie_flags = flag_sets[e];
+        for (int k = 0; run_test (k, argc, argv) != -1; ++k)
             ;
+    }
     if (status > 0)
         fprintf (stderr, "%d tests failed\n", status);
     return status;